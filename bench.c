@@ -0,0 +1,934 @@
+// Throughput benchmarks for the parser and the CRC32 engine.
+// Results go out as JSON lines (one object per measurement) so runs can be diffed between releases,
+// with a human readable summary on stderr.
+#include "stream_parser.h"
+#include "crc32.h"
+#include "icd_generator.h"
+#include "icd_parser.h"
+#include "capture.h"
+#include "parallel_parse.h"
+#include "packet_sink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+// Refs in flight between the parser thread and the consumer thread in the pooled benchmark
+#define HANDOFF_RING_SIZE 4096
+
+typedef struct {
+    FILE *output;
+    double min_seconds; // Each measurement repeats until at least this much time passed
+    int failures;       // Runs whose packets didn't match the reference run
+    const char *cli;    // stream_parser binary whose --replay is timed end to end, NULL to skip it
+    // Recorded with every result, since they decide what the numbers mean
+    long cpus;
+    const char *crc_backend;
+} Bench;
+
+typedef struct {
+    const char *name;
+    IcdGeneratorConfig generator;
+    int64_t max_payload_size; // Parser configuration
+    int clean;                // No noise, so every generated frame must come out as a packet
+} Scenario;
+
+static double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void count_packet(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
+    (void)packet_buffer;
+    (void)packet_size;
+    ++*(int64_t*)packet_callback_data;
+}
+
+static void report(Bench *const bench, const char *const benchmark, const char *const scenario, const char *const variant,
+                   const int64_t chunk, const int64_t bytes, const int64_t packets, const int64_t calls, const double seconds) {
+    const double mb_per_s = (double)bytes / seconds / 1e6;
+    fprintf(bench->output, "{\"benchmark\":\"%s\",\"scenario\":\"%s\",\"variant\":\"%s\",\"chunk\":%lld,"
+            "\"bytes\":%lld,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"cpus\":%ld,\"crc_backend\":\"%s\"",
+            benchmark, scenario, variant, (long long)chunk, (long long)bytes, seconds, mb_per_s, bench->cpus, bench->crc_backend);
+    if (packets > 0) {
+        fprintf(bench->output, ",\"packets\":%lld,\"packets_per_s\":%.0f,\"ns_per_packet\":%.2f",
+                (long long)packets, (double)packets / seconds, seconds * 1e9 / (double)packets);
+    }
+    if (calls > 0) {
+        fprintf(bench->output, ",\"calls\":%lld,\"ns_per_call\":%.2f", (long long)calls, seconds * 1e9 / (double)calls);
+    }
+    fprintf(bench->output, "}\n");
+    fflush(bench->output);
+
+    fprintf(stderr, "%-14s %-12s %-22s chunk %6lld: %9.1f MB/s", benchmark, scenario, variant, (long long)chunk, mb_per_s);
+    if (packets > 0) {
+        fprintf(stderr, "  %12.0f packets/s  %8.1f ns/packet", (double)packets / seconds, seconds * 1e9 / (double)packets);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Parses the whole stream once, chunk 0 meaning stream_parser_push_byte(). Returns the packet count.
+static int64_t parse_once(StreamParser *const parser, const uint8_t *const data, const int64_t length, const int64_t chunk) {
+    int64_t packets = 0;
+    stream_parser_register_packet_callback(parser, count_packet, &packets);
+    if (chunk == 0) {
+        for (int64_t i = 0; i < length; ++i) {
+            stream_parser_push_byte(parser, data[i]);
+        }
+    } else {
+        for (int64_t i = 0; i < length; i += chunk) {
+            stream_parser_push_bytes(parser, data + i, (length - i < chunk) ? length - i : chunk, NULL);
+        }
+    }
+    return packets;
+}
+
+static void bench_parser(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                         const int64_t expected_packets, const StreamParserCrcMode crc_mode, const int64_t chunk) {
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    if (!parser) {
+        fprintf(stderr, "Failed to open stream parser\n");
+        exit(EXIT_FAILURE);
+    }
+    stream_parser_set_crc_mode(parser, crc_mode);
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        const int64_t pass_packets = parse_once(parser, data, length, chunk);
+        if (pass_packets != expected_packets) {
+            fprintf(stderr, "MISMATCH: %s chunk %lld got %lld packets, expected %lld\n", scenario->name,
+                    (long long)chunk, (long long)pass_packets, (long long)expected_packets);
+            ++bench->failures;
+        }
+        packets += pass_packets;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    stream_parser_close(parser);
+
+    char variant[64];
+    snprintf(variant, sizeof variant, "%s/%s", chunk == 0 ? "push_byte" : "push_bytes",
+             crc_mode == STREAM_PARSER_CRC_INCREMENTAL ? "crc_incremental" : "crc_deferred");
+    report(bench, chunk == 0 ? "push_byte" : "push_bytes", scenario->name, variant, chunk, passes * length, packets, 0, elapsed);
+}
+
+typedef struct {
+    int64_t packets;
+    int64_t batches;
+    int64_t malformed; // Views that don't look like a whole frame
+} BatchCount;
+
+static void count_batch(const StreamParserPacketView *const packets, size_t packet_count, void *const packet_batch_callback_data) {
+    BatchCount *const count = (BatchCount*)packet_batch_callback_data;
+    for (size_t i = 0; i < packet_count; ++i) {
+        const uint8_t *const packet = packets[i].packet_buffer;
+        const int64_t size = packets[i].packet_size;
+        count->malformed += (packet[0] != '/') | (packet[1] != '*') | (packet[size - 2] != '*') | (packet[size - 1] != '/');
+    }
+    count->packets += (int64_t)packet_count;
+    ++count->batches;
+}
+
+// Packets delivered through the batch callback instead of one call per packet
+static void bench_batch(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                        const int64_t expected_packets, const int64_t chunk) {
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    BatchCount count;
+    if (!parser || stream_parser_register_packet_batch_callback(parser, count_batch, &count, 0, 0) != STREAM_PARSER_OK) {
+        fprintf(stderr, "Failed to open stream parser with a batch callback\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        memset(&count, 0, sizeof count);
+        for (int64_t i = 0; i < length; i += chunk) {
+            stream_parser_push_bytes(parser, data + i, (length - i < chunk) ? length - i : chunk, NULL);
+        }
+        if (count.packets != expected_packets || count.malformed) {
+            fprintf(stderr, "MISMATCH: %s batch chunk %lld got %lld packets (%lld malformed), expected %lld\n", scenario->name,
+                    (long long)chunk, (long long)count.packets, (long long)count.malformed, (long long)expected_packets);
+            ++bench->failures;
+        }
+        packets += count.packets;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    stream_parser_close(parser);
+    report(bench, "push_bytes", scenario->name, "push_bytes/batch", chunk, passes * length, packets, 0, elapsed);
+}
+
+static void count_timed_packet(const uint8_t *const packet_buffer, int64_t packet_size, const StreamParserPacketTimes *const times, void *const timed_packet_callback_data) {
+    (void)times;
+    count_packet(packet_buffer, packet_size, timed_packet_callback_data);
+}
+
+// Timed packet callback with both latency histograms kept, the cost of --latency
+static void bench_latency(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                          const int64_t expected_packets, const int64_t chunk) {
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    if (!parser || stream_parser_set_latency_histograms(parser, 1) != STREAM_PARSER_OK) {
+        fprintf(stderr, "Failed to open stream parser with latency histograms\n");
+        exit(EXIT_FAILURE);
+    }
+    int64_t count = 0;
+    stream_parser_register_timed_packet_callback(parser, count_timed_packet, &count);
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        count = 0;
+        for (int64_t i = 0; i < length; i += chunk) {
+            stream_parser_set_arrival_time(parser, (uint64_t)((monotonic_seconds() - start) * 1e9) + 1);
+            stream_parser_push_bytes(parser, data + i, (length - i < chunk) ? length - i : chunk, NULL);
+        }
+        LatencyHistogram arrival_to_callback;
+        stream_parser_get_latency_histograms(parser, &arrival_to_callback, NULL, 1);
+        if (count != expected_packets || (int64_t)arrival_to_callback.count != expected_packets) {
+            fprintf(stderr, "MISMATCH: %s latency chunk %lld got %lld packets (%lld timed), expected %lld\n", scenario->name,
+                    (long long)chunk, (long long)count, (long long)arrival_to_callback.count, (long long)expected_packets);
+            ++bench->failures;
+        }
+        packets += count;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    stream_parser_close(parser);
+    report(bench, "push_bytes", scenario->name, "push_bytes/latency", chunk, passes * length, packets, 0, elapsed);
+}
+
+// Single producer single consumer ring carrying pooled packets to a consumer thread
+typedef struct {
+    PacketPoolRef refs[HANDOFF_RING_SIZE];
+    _Atomic uint64_t head; // Written by the parser thread
+    _Atomic uint64_t tail; // Written by the consumer thread
+    _Atomic int done;
+    int64_t packets;       // Consumer side count
+    int64_t bytes;
+} Handoff;
+
+static void handoff_packet(const PacketPoolRef packet, void *const pooled_packet_callback_data) {
+    Handoff *const handoff = (Handoff*)pooled_packet_callback_data;
+    const uint64_t head = atomic_load_explicit(&handoff->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&handoff->tail, memory_order_acquire) >= HANDOFF_RING_SIZE) {
+        sched_yield();
+    }
+    packet_pool_retain(packet);
+    handoff->refs[head % HANDOFF_RING_SIZE] = packet;
+    atomic_store_explicit(&handoff->head, head + 1, memory_order_release);
+}
+
+static void *handoff_consumer(void *const arg) {
+    Handoff *const handoff = (Handoff*)arg;
+    uint64_t tail = 0;
+    for (;;) {
+        const uint64_t head = atomic_load_explicit(&handoff->head, memory_order_acquire);
+        if (tail == head) {
+            if (atomic_load_explicit(&handoff->done, memory_order_acquire) &&
+                tail == atomic_load_explicit(&handoff->head, memory_order_acquire)) {
+                return NULL;
+            }
+            sched_yield();
+            continue;
+        }
+        for (; tail != head; ++tail) {
+            const PacketPoolRef packet = handoff->refs[tail % HANDOFF_RING_SIZE];
+            if (packet_pool_claim(packet) == 0) {
+                int64_t size;
+                const uint8_t *const data = packet_pool_data(packet, &size);
+                handoff->bytes += size + (data[0] != '/');
+                ++handoff->packets;
+                packet_pool_release(packet);
+            }
+        }
+        atomic_store_explicit(&handoff->tail, tail, memory_order_release);
+    }
+}
+
+// Packets handed through a PacketPool to another thread, which is what an asynchronous consumer pays.
+// The pool blocks when full, so every packet has to make it to the consumer.
+static void bench_pooled(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                         const int64_t expected_packets, const int64_t chunk) {
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    PacketPoolConfig pool_config = packet_pool_default_config(scenario->max_payload_size + STREAM_PARSER_FRAME_OVERHEAD);
+    pool_config.exhaustion = PACKET_POOL_BLOCK;
+    PacketPool *const pool = packet_pool_open(&pool_config);
+    static Handoff handoff;
+    if (!parser || !pool || stream_parser_register_pooled_packet_callback(parser, pool, handoff_packet, &handoff) != STREAM_PARSER_OK) {
+        fprintf(stderr, "Failed to open stream parser with a packet pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        memset(&handoff, 0, sizeof handoff);
+        pthread_t consumer;
+        pthread_create(&consumer, NULL, handoff_consumer, &handoff);
+        for (int64_t i = 0; i < length; i += chunk) {
+            stream_parser_push_bytes(parser, data + i, (length - i < chunk) ? length - i : chunk, NULL);
+        }
+        atomic_store_explicit(&handoff.done, 1, memory_order_release);
+        pthread_join(consumer, NULL);
+        if (handoff.packets != expected_packets) {
+            fprintf(stderr, "MISMATCH: %s pooled chunk %lld got %lld packets, expected %lld\n", scenario->name,
+                    (long long)chunk, (long long)handoff.packets, (long long)expected_packets);
+            ++bench->failures;
+        }
+        packets += handoff.packets;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+
+    PacketPoolStats stats;
+    packet_pool_get_stats(pool, &stats);
+    if (stats.in_use != 0) {
+        fprintf(stderr, "MISMATCH: %s pooled chunk %lld leaked %lld slots\n", scenario->name, (long long)chunk, (long long)stats.in_use);
+        ++bench->failures;
+    }
+    stream_parser_close(parser);
+    packet_pool_close(pool);
+    report(bench, "push_bytes", scenario->name, "push_bytes/pooled_thread", chunk, passes * length, packets, 0, elapsed);
+}
+
+static void bench_crc(Bench *const bench, const uint8_t *const data, const int64_t length, const int64_t chunk) {
+    for (int backend = 0; backend < CRC32_BACKEND_COUNT; ++backend) {
+        if (crc32_select_backend((CRC32_Backend)backend) != 0) {
+            continue;
+        }
+        // The bitwise reference is so slow that a fraction of the buffer is plenty
+        const int64_t span = (backend == CRC32_BACKEND_BITWISE) ? length / 16 : length;
+        int64_t bytes = 0;
+        int64_t calls = 0;
+        volatile uint32_t sink = 0;
+        const double start = monotonic_seconds();
+        double elapsed = 0;
+        do {
+            for (int64_t i = 0; i + chunk <= span; i += chunk) {
+                CRC32_State state = crc32_create_engine();
+                crc32_update(&state, data + i, chunk);
+                sink ^= crc32_finalize(&state);
+                bytes += chunk;
+                ++calls;
+            }
+            elapsed = monotonic_seconds() - start;
+        } while (elapsed < bench->min_seconds);
+        (void)sink;
+        report(bench, "crc32_update", "random", crc32_backend_name((CRC32_Backend)backend), chunk, bytes, 0, calls, elapsed);
+    }
+    // Back to the fastest one for whatever runs next
+    static const CRC32_Backend preference[] = { CRC32_BACKEND_ARMV8, CRC32_BACKEND_PCLMUL, CRC32_BACKEND_SLICE8 };
+    for (size_t i = 0; i < sizeof preference / sizeof preference[0]; ++i) {
+        if (crc32_select_backend(preference[i]) == 0) {
+            break;
+        }
+    }
+}
+
+// Frames payloads cut out of data with stream_parser_encode_batch(), and checks that the parser
+// takes every frame back.
+static void bench_encode(Bench *const bench, const uint8_t *const data, const int64_t length, const int64_t payload_size) {
+    const size_t count = (size_t)(length / (payload_size + STREAM_PARSER_FRAME_OVERHEAD));
+    StreamParserEncodeItem *const items = (StreamParserEncodeItem*)malloc(count * sizeof(StreamParserEncodeItem));
+    uint8_t *const out = (uint8_t*)malloc((size_t)length);
+    if (!items || !out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        items[i].type[0] = 'E';
+        items[i].type[1] = 'N';
+        items[i].type[2] = (uint8_t)i;
+        items[i].payload = data + (int64_t)i * payload_size;
+        items[i].payload_size = payload_size;
+    }
+
+    int64_t passes = 0;
+    int64_t encoded_length = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        size_t encoded = 0;
+        encoded_length = stream_parser_encode_batch(items, count, out, length, &encoded);
+        if (encoded != count) {
+            fprintf(stderr, "MISMATCH: encode_batch framed %zu of %zu packets\n", encoded, count);
+            ++bench->failures;
+        }
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    const int64_t parsed = parser ? parse_once(parser, out, encoded_length, 4096) : -1;
+    stream_parser_close(parser);
+    if (parsed != (int64_t)count) {
+        fprintf(stderr, "MISMATCH: parser took back %lld of %zu encoded packets\n", (long long)parsed, count);
+        ++bench->failures;
+    }
+    free(out);
+    free(items);
+
+    char scenario[32];
+    snprintf(scenario, sizeof scenario, "payload_%lld", (long long)payload_size);
+    report(bench, "encode_batch", scenario, "encode_batch", 0, passes * encoded_length, passes * (int64_t)count, 0, elapsed);
+}
+
+// Runs the CLI on a capture file with stdout going to output_fd and stderr to /dev/null.
+// Returns its exit status, or -1 if it couldn't run or was killed.
+static int run_cli_replay(const Bench *const bench, const char *const path, const char *const format,
+                          const int64_t max_payload_size, const int output_fd) {
+    char max_payload[32];
+    snprintf(max_payload, sizeof max_payload, "%lld", (long long)max_payload_size);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0 || dup2(output_fd, STDOUT_FILENO) < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        char *const argv[] = { (char*)bench->cli, "--replay", (char*)path, "--output-format", (char*)format,
+                               "--max-payload", max_payload, NULL };
+        execv(bench->cli, argv);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// Counts the records of a raw output file: uint32 frame length, uint32 source index, then the frame.
+// Returns -1 if the file is cut short.
+static int64_t count_raw_records(const int fd) {
+    const off_t size = lseek(fd, 0, SEEK_END);
+    uint8_t *const data = size > 0 ? (uint8_t*)malloc((size_t)size) : NULL;
+    if (size <= 0 || !data || pread(fd, data, (size_t)size, 0) != size) {
+        free(data);
+        return size == 0 ? 0 : -1;
+    }
+    int64_t records = 0;
+    off_t offset = 0;
+    while (size - offset >= 8) {
+        const uint32_t length = (uint32_t)data[offset] | (uint32_t)data[offset + 1] << 8 |
+                                (uint32_t)data[offset + 2] << 16 | (uint32_t)data[offset + 3] << 24;
+        offset += 8 + (off_t)length;
+        ++records;
+    }
+    free(data);
+    return offset == size ? records : -1;
+}
+
+// Times the whole CLI replaying the capture file, process start, error lines and output formatting
+// included: with text output, which prints the errors too, and quiet, which only counts them.
+// A raw run first checks that the CLI finds the same packets as the reference parser.
+static void bench_cli_replay(Bench *const bench, const Scenario *const scenario, const char *const path,
+                             const int64_t length, const int64_t expected_packets, const int64_t chunk) {
+    char raw_path[] = "/tmp/stream_parser_bench_raw_XXXXXX";
+    const int raw_fd = mkstemp(raw_path);
+    if (raw_fd < 0) {
+        fprintf(stderr, "Failed to create a file for the CLI output\n");
+        exit(EXIT_FAILURE);
+    }
+    unlink(raw_path);
+    const int status = run_cli_replay(bench, path, "raw", scenario->max_payload_size, raw_fd);
+    const int64_t raw_packets = count_raw_records(raw_fd);
+    close(raw_fd);
+    if (status != 0 || raw_packets != expected_packets) {
+        fprintf(stderr, "MISMATCH: %s CLI replay exited with %d and got %lld packets, expected %lld\n", scenario->name,
+                status, (long long)raw_packets, (long long)expected_packets);
+        ++bench->failures;
+        return;
+    }
+
+    const int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("Error opening /dev/null");
+        exit(EXIT_FAILURE);
+    }
+    static const char *const formats[] = { "text", "quiet" };
+    for (size_t f = 0; f < sizeof formats / sizeof formats[0]; ++f) {
+        int64_t passes = 0;
+        const double start = monotonic_seconds();
+        double elapsed = 0;
+        do {
+            if (run_cli_replay(bench, path, formats[f], scenario->max_payload_size, null_fd) != 0) {
+                fprintf(stderr, "MISMATCH: %s CLI replay with %s output failed\n", scenario->name, formats[f]);
+                ++bench->failures;
+                break;
+            }
+            ++passes;
+            elapsed = monotonic_seconds() - start;
+        } while (elapsed < bench->min_seconds);
+        char variant[32];
+        snprintf(variant, sizeof variant, "cli/%s", formats[f]);
+        report(bench, "replay_cli", scenario->name, variant, chunk, passes * length, passes * expected_packets, passes, elapsed);
+    }
+    close(null_fd);
+}
+
+// Writes the stream to a capture file in chunks, then measures replaying it from the mapping,
+// and through the CLI when there is one.
+static void bench_replay(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                         const int64_t expected_packets, const int64_t chunk) {
+    char path[] = "/tmp/stream_parser_bench_XXXXXX";
+    const int fd = mkstemp(path);
+    CaptureWriter *const writer = fd >= 0 ? capture_writer_open(path, 0) : NULL;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!writer) {
+        fprintf(stderr, "Failed to create a capture file\n");
+        exit(EXIT_FAILURE);
+    }
+    const int source = capture_writer_add_source(writer, scenario->name);
+    for (int64_t i = 0; i < length; i += chunk) {
+        capture_writer_write(writer, source, capture_monotonic_ns(), data + i, (length - i < chunk) ? length - i : chunk);
+    }
+    capture_writer_close(writer);
+    CaptureReader *const reader = capture_reader_open(path);
+
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    if (!reader || !parser) {
+        unlink(path);
+        fprintf(stderr, "Failed to open the capture file or stream parser\n");
+        exit(EXIT_FAILURE);
+    }
+    int64_t pass_packets = 0;
+    stream_parser_register_packet_callback(parser, count_packet, &pass_packets);
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        pass_packets = 0;
+        capture_reader_rewind(reader);
+        CaptureRecord record;
+        while (capture_reader_next(reader, &record) == 1) {
+            if (record.type == CAPTURE_RECORD_CHUNK) {
+                stream_parser_push_bytes(parser, record.data, record.length, NULL);
+            }
+        }
+        if (pass_packets != expected_packets) {
+            fprintf(stderr, "MISMATCH: %s replay got %lld packets, expected %lld\n", scenario->name,
+                    (long long)pass_packets, (long long)expected_packets);
+            ++bench->failures;
+        }
+        packets += pass_packets;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    stream_parser_close(parser);
+    capture_reader_close(reader);
+    report(bench, "replay", scenario->name, "replay/mmap", chunk, passes * length, packets, 0, elapsed);
+    if (bench->cli) {
+        bench_cli_replay(bench, scenario, path, length, expected_packets, chunk);
+    }
+    unlink(path);
+}
+
+// Folds every packet, in order, into a CRC32, so that two runs agree only if they found the same
+// packets in the same order
+static void hash_packet(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
+    crc32_update((CRC32_State*)packet_callback_data, packet_buffer, packet_size);
+}
+
+// Splits the stream into chunks parsed on several threads, and checks the stitched packets
+// against one parser fed the whole stream.
+static void bench_parallel(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                           const int threads, const int64_t chunk) {
+    ParallelParseConfig config = parallel_parse_default_config();
+    config.threads = threads;
+    config.chunk_size = chunk;
+    config.parser.max_payload_size = scenario->max_payload_size;
+
+    StreamParser *const reference = stream_parser_open_ex(&config.parser);
+    if (!reference) {
+        fprintf(stderr, "Failed to open stream parser\n");
+        exit(EXIT_FAILURE);
+    }
+    CRC32_State expected = crc32_create_engine();
+    stream_parser_register_packet_callback(reference, hash_packet, &expected);
+    stream_parser_push_bytes(reference, data, length, NULL);
+    stream_parser_close(reference);
+    const uint32_t expected_hash = crc32_finalize(&expected);
+
+    CRC32_State hash = crc32_create_engine();
+    if (parallel_parse(&config, data, length, hash_packet, &hash, NULL) != 0 || crc32_finalize(&hash) != expected_hash) {
+        fprintf(stderr, "MISMATCH: %s parallel parse on %d threads differs from a single parser\n", scenario->name, threads);
+        ++bench->failures;
+    }
+
+    // Timed with a packet callback as cheap as the other benchmarks use
+    int64_t passes = 0;
+    int64_t packets = 0;
+    int64_t reparsed = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        int64_t pass_packets = 0;
+        ParallelParseStats stats;
+        if (parallel_parse(&config, data, length, count_packet, &pass_packets, &stats) != 0) {
+            fprintf(stderr, "Parallel parse failed\n");
+            exit(EXIT_FAILURE);
+        }
+        packets += pass_packets;
+        reparsed += stats.reparsed_bytes;
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+
+    char variant[64];
+    snprintf(variant, sizeof variant, "parallel/%d_threads", threads);
+    report(bench, "parallel_parse", scenario->name, variant, chunk, passes * length, packets, 0, elapsed);
+    if (reparsed) {
+        fprintf(stderr, "%-14s %-12s %-22s reparsed %.3f%% at chunk boundaries\n", "", "", "",
+                100.0 * (double)reparsed / (double)(passes * length));
+    }
+}
+
+static void sink_packet(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
+    packet_sink_write((PacketSink*)packet_callback_data, "bench", 0, packet_buffer, packet_size);
+}
+
+// Parses the stream with every packet formatted into a sink that writes to /dev/null, so the
+// cost of the CLI's output comes on top of push_bytes at the same chunk size.
+static void bench_sink(Bench *const bench, const Scenario *const scenario, const uint8_t *const data, const int64_t length,
+                       const int64_t expected_packets, const PacketSinkFormat format, const int64_t chunk) {
+    static const char *const format_names[] = { "text", "raw", "jsonl", "quiet" };
+    const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    PacketSink *const sink = fd >= 0 ? packet_sink_open(fd, format, PACKET_SINK_DEFAULT_BUFFER_SIZE, PACKET_SINK_DEFAULT_FLUSH_INTERVAL) : NULL;
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = scenario->max_payload_size;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    if (!sink || !parser) {
+        fprintf(stderr, "Failed to open the sink or the stream parser\n");
+        exit(EXIT_FAILURE);
+    }
+    stream_parser_register_packet_callback(parser, sink_packet, sink);
+
+    int64_t passes = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        for (int64_t i = 0; i < length; i += chunk) {
+            stream_parser_push_bytes(parser, data + i, (length - i < chunk) ? length - i : chunk, NULL);
+        }
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    if (packet_sink_flush(sink) != 0) {
+        fprintf(stderr, "MISMATCH: %s sink failed to write\n", scenario->name);
+        ++bench->failures;
+    }
+    packet_sink_close(sink);
+    stream_parser_close(parser);
+    close(fd);
+
+    char variant[64];
+    snprintf(variant, sizeof variant, "sink/%s", format_names[format]);
+    report(bench, "packet_sink", scenario->name, variant, chunk, passes * length, passes * expected_packets, 0, elapsed);
+}
+
+// The parsers icd_parser.h generates, behind one interface so the benchmarks can loop over them.
+// Only the call per chunk goes through a pointer, the push itself is specialized for its ICD.
+typedef struct {
+    const IcdDescriptor *icd;
+    size_t size;
+    void (*init)(void *parser, IcdPacketCallback callback, void *callback_data);
+    void (*push)(void *parser, const uint8_t *bytes, int64_t length);
+} GeneratedParser;
+
+#define GENERATED_PARSER_FUNCTIONS(name, ...) \
+    static void name##_init_any(void *const parser, const IcdPacketCallback callback, void *const callback_data) { \
+        name##_parser_init((name##_parser*)parser, callback, callback_data); \
+    } \
+    static void name##_push_any(void *const parser, const uint8_t *const bytes, const int64_t length) { \
+        name##_parser_push((name##_parser*)parser, bytes, length); \
+    }
+ICD_DESCRIPTORS(GENERATED_PARSER_FUNCTIONS)
+#undef GENERATED_PARSER_FUNCTIONS
+
+#define GENERATED_PARSER_ENTRY(name, ...) { &name##_descriptor, sizeof(name##_parser), name##_init_any, name##_push_any },
+static const GeneratedParser generated_parsers[] = { ICD_DESCRIPTORS(GENERATED_PARSER_ENTRY) };
+#undef GENERATED_PARSER_ENTRY
+
+// Runs a generated parser over the whole stream once, in chunks. Returns the packet count.
+static int64_t parse_generated(const GeneratedParser *const generated, void *const parser, const uint8_t *const data,
+                               const int64_t length, const int64_t chunk, const IcdPacketCallback callback, void *const callback_data) {
+    generated->init(parser, callback, callback_data);
+    for (int64_t i = 0; i < length; i += chunk) {
+        generated->push(parser, data + i, (length - i < chunk) ? length - i : chunk);
+    }
+    return (int64_t)((const IcdParserCore*)parser)->packets;
+}
+
+// Times a generated parser. If reference_hash isn't NULL, its packets have to hash to it.
+static void bench_generated(Bench *const bench, const GeneratedParser *const generated, const char *const scenario,
+                            const uint8_t *const data, const int64_t length, const int64_t expected_packets,
+                            const uint32_t *const reference_hash, const int64_t chunk) {
+    void *const parser = malloc(generated->size);
+    if (!parser) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    CRC32_State hash = crc32_create_engine();
+    const int64_t hashed_packets = parse_generated(generated, parser, data, length, chunk, hash_packet, &hash);
+    if (hashed_packets != expected_packets || (reference_hash && crc32_finalize(&hash) != *reference_hash)) {
+        fprintf(stderr, "MISMATCH: %s %s parser chunk %lld got %lld packets, expected %lld%s\n", scenario, generated->icd->name,
+                (long long)chunk, (long long)hashed_packets, (long long)expected_packets,
+                hashed_packets == expected_packets ? " with different contents" : "");
+        ++bench->failures;
+    }
+
+    int64_t passes = 0;
+    int64_t packets = 0;
+    const double start = monotonic_seconds();
+    double elapsed = 0;
+    do {
+        int64_t counted = 0;
+        packets += parse_generated(generated, parser, data, length, chunk, count_packet, &counted);
+        ++passes;
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < bench->min_seconds);
+    free(parser);
+
+    char variant[64];
+    snprintf(variant, sizeof variant, "generated/%s", generated->icd->name);
+    report(bench, "icd_parser", scenario, variant, chunk, passes * length, packets, 0, elapsed);
+}
+
+// The generated parser of stream_parser's own ICD has to find exactly what a StreamParser
+// configured for the same largest payload finds.
+static void bench_generated_stream(Bench *const bench, const Scenario *const scenario, const uint8_t *const data,
+                                   const int64_t length, const int64_t chunk) {
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = ICD_STREAM_MAX_PAYLOAD_SIZE;
+    StreamParser *const reference = stream_parser_open_ex(&config);
+    if (!reference) {
+        fprintf(stderr, "Failed to open stream parser\n");
+        exit(EXIT_FAILURE);
+    }
+    CRC32_State expected = crc32_create_engine();
+    stream_parser_register_packet_callback(reference, hash_packet, &expected);
+    stream_parser_push_bytes(reference, data, length, NULL);
+    StreamParserStats stats;
+    stream_parser_get_stats(reference, &stats, 0);
+    const int64_t expected_packets = (int64_t)stats.packets_out;
+    stream_parser_close(reference);
+    const uint32_t expected_hash = crc32_finalize(&expected);
+
+    bench_generated(bench, &generated_parsers[0], scenario->name, data, length, expected_packets, &expected_hash, chunk);
+}
+
+// The other ICDs, on streams of their own. Clean streams must give back every frame, and noisy
+// ones the same packets whether they come in small chunks or all at once.
+static void bench_generated_icds(Bench *const bench, uint8_t *const data, const int64_t stream_size) {
+    for (size_t g = 1; g < sizeof generated_parsers / sizeof generated_parsers[0]; ++g) {
+        const GeneratedParser *const generated = &generated_parsers[g];
+        for (int noisy = 0; noisy <= 1; ++noisy) {
+            IcdGeneratorConfig config = icd_generator_default_config(
+                generated->icd->max_payload_size < 4096 ? generated->icd->max_payload_size : 4096);
+            config.icd = generated->icd;
+            config.payload_distribution = ICD_GENERATOR_PAYLOAD_UNIFORM;
+            if (noisy) {
+                config.garbage_probability = 0.3;
+                config.bit_flip_probability = 0.05;
+                config.truncate_probability = 0.02;
+                config.fake_header_probability = 0.1;
+            }
+            IcdGeneratorSummary summary;
+            const int64_t length = icd_generator_fill(&config, data, stream_size, &summary);
+
+            void *const parser = malloc(generated->size);
+            if (!parser) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            CRC32_State whole = crc32_create_engine();
+            const int64_t expected_packets = parse_generated(generated, parser, data, length, length, hash_packet, &whole);
+            free(parser);
+            const uint32_t whole_hash = crc32_finalize(&whole);
+            if (!noisy && expected_packets != summary.valid_frames) {
+                fprintf(stderr, "MISMATCH: %s parser found %lld packets out of %lld generated frames\n", generated->icd->name,
+                        (long long)expected_packets, (long long)summary.valid_frames);
+                ++bench->failures;
+            }
+            bench_generated(bench, generated, noisy ? "noisy" : "clean", data, length, expected_packets, &whole_hash, 16);
+            bench_generated(bench, generated, noisy ? "noisy" : "clean", data, length, expected_packets, &whole_hash, 4096);
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: stream_parser_bench [--output <file>] [--min-time <seconds>] [--size <megabytes>] [--cli <stream_parser binary>]\n");
+}
+
+int main(int argc, char *argv[]) {
+    Bench bench;
+    bench.output = stdout;
+    bench.min_seconds = 0.2;
+    bench.failures = 0;
+    bench.cli = NULL;
+    bench.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bench.crc_backend = crc32_backend_name(crc32_active_backend());
+    int64_t stream_size = 8 << 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            bench.output = fopen(argv[++i], "w");
+            if (!bench.output) {
+                perror("Error opening output file");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            bench.min_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            stream_size = (int64_t)(atof(argv[++i]) * (1 << 20));
+        } else if (strcmp(argv[i], "--cli") == 0 && i + 1 < argc) {
+            bench.cli = argv[++i];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (stream_size < (1 << 16)) {
+        stream_size = 1 << 16;
+    }
+
+    uint8_t *const data = (uint8_t*)malloc((size_t)stream_size);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    static const uint8_t types[][3] = { { 'A', 'A', 'A' }, { 'C', 'M', 'D' }, { 'T', 'L', 'M' }, { 0x01, 0x02, 0x03 } };
+    Scenario scenarios[4];
+    memset(scenarios, 0, sizeof scenarios);
+
+    scenarios[0].name = "clean_small";
+    scenarios[0].generator = icd_generator_default_config(8);
+    scenarios[0].max_payload_size = STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE;
+    scenarios[0].clean = 1;
+
+    scenarios[1].name = "clean_max";
+    scenarios[1].generator = icd_generator_default_config(STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE);
+    scenarios[1].max_payload_size = STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE;
+    scenarios[1].clean = 1;
+
+    scenarios[2].name = "noisy";
+    scenarios[2].generator = icd_generator_default_config(STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE);
+    scenarios[2].generator.payload_distribution = ICD_GENERATOR_PAYLOAD_UNIFORM;
+    scenarios[2].generator.types = types;
+    scenarios[2].generator.type_count = 4;
+    scenarios[2].generator.garbage_probability = 0.3;
+    scenarios[2].generator.bit_flip_probability = 0.05;
+    scenarios[2].generator.truncate_probability = 0.02;
+    scenarios[2].generator.fake_header_probability = 0.1;
+    scenarios[2].max_payload_size = STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE;
+
+    scenarios[3].name = "large";
+    scenarios[3].generator = icd_generator_default_config(4096);
+    scenarios[3].generator.payload_distribution = ICD_GENERATOR_PAYLOAD_UNIFORM;
+    scenarios[3].generator.min_payload_size = 256;
+    scenarios[3].max_payload_size = STREAM_PARSER_MAX_PAYLOAD_SIZE;
+    scenarios[3].clean = 1;
+
+    static const int64_t chunks[] = { 16, 256, 4096, 65536 };
+    static const StreamParserCrcMode crc_modes[] = { STREAM_PARSER_CRC_INCREMENTAL, STREAM_PARSER_CRC_DEFERRED };
+
+    for (size_t s = 0; s < sizeof scenarios / sizeof scenarios[0]; ++s) {
+        const Scenario *const scenario = &scenarios[s];
+        IcdGeneratorSummary summary;
+        const int64_t length = icd_generator_fill(&scenario->generator, data, stream_size, &summary);
+
+        // The byte-at-a-time parser is the reference every other variant has to agree with
+        StreamParserConfig config = stream_parser_default_config();
+        config.max_payload_size = scenario->max_payload_size;
+        StreamParser *const reference = stream_parser_open_ex(&config);
+        const int64_t expected_packets = reference ? parse_once(reference, data, length, 0) : -1;
+        stream_parser_close(reference);
+        if (scenario->clean && expected_packets != summary.valid_frames) {
+            fprintf(stderr, "MISMATCH: %s parsed %lld packets out of %lld generated frames\n", scenario->name,
+                    (long long)expected_packets, (long long)summary.valid_frames);
+            ++bench.failures;
+        }
+
+        for (size_t m = 0; m < sizeof crc_modes / sizeof crc_modes[0]; ++m) {
+            bench_parser(&bench, scenario, data, length, expected_packets, crc_modes[m], 0);
+            for (size_t c = 0; c < sizeof chunks / sizeof chunks[0]; ++c) {
+                bench_parser(&bench, scenario, data, length, expected_packets, crc_modes[m], chunks[c]);
+            }
+        }
+        for (size_t c = 0; c < sizeof chunks / sizeof chunks[0]; ++c) {
+            bench_batch(&bench, scenario, data, length, expected_packets, chunks[c]);
+        }
+        bench_latency(&bench, scenario, data, length, expected_packets, 4096);
+        bench_generated_stream(&bench, scenario, data, length, 4096);
+        static const PacketSinkFormat sink_formats[] = { PACKET_SINK_TEXT, PACKET_SINK_JSONL, PACKET_SINK_RAW };
+        for (size_t f = 0; f < sizeof sink_formats / sizeof sink_formats[0]; ++f) {
+            bench_sink(&bench, scenario, data, length, expected_packets, sink_formats[f], 4096);
+        }
+        bench_pooled(&bench, scenario, data, length, expected_packets, 4096);
+        bench_replay(&bench, scenario, data, length, expected_packets, 65536);
+        static const int parallel_threads[] = { 1, 2, 4, 8 };
+        for (size_t t = 0; t < sizeof parallel_threads / sizeof parallel_threads[0]; ++t) {
+            bench_parallel(&bench, scenario, data, length, parallel_threads[t], 1 << 20);
+        }
+    }
+
+    bench_generated_icds(&bench, data, stream_size);
+
+    static const int64_t encode_payloads[] = { 8, STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE, 4096 };
+    for (size_t p = 0; p < sizeof encode_payloads / sizeof encode_payloads[0]; ++p) {
+        bench_encode(&bench, data, stream_size, encode_payloads[p]);
+    }
+
+    // The CRC engine alone, over random bytes, at packet sized and buffer sized calls
+    IcdGeneratorConfig noise = icd_generator_default_config(4096);
+    noise.payload_distribution = ICD_GENERATOR_PAYLOAD_UNIFORM;
+    const int64_t noise_length = icd_generator_fill(&noise, data, stream_size, NULL);
+    static const int64_t crc_chunks[] = { 64, 1024, 65536 };
+    for (size_t c = 0; c < sizeof crc_chunks / sizeof crc_chunks[0]; ++c) {
+        bench_crc(&bench, data, noise_length, crc_chunks[c]);
+    }
+
+    free(data);
+    if (bench.output != stdout) {
+        fclose(bench.output);
+    }
+    if (bench.failures) {
+        fprintf(stderr, "%d benchmark runs produced wrong results\n", bench.failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,331 @@
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_MAGIC "SPCAP\r\n\x1a"
+#define MAGIC_SIZE 8
+#define FILE_HEADER_SIZE 32
+#define RECORD_HEADER_SIZE 24
+#define RECORD_ALIGNMENT 8
+// Large enough that a busy capture costs one write() per many chunks, as long as the flush
+// interval lets them pile up
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+struct CaptureWriter {
+    int fd;
+    uint64_t start_ns;
+    int source_count;
+    int failed;
+    uint64_t flush_interval_ns;
+    uint64_t oldest_ns; // When the oldest buffered record was appended
+    int64_t buffered;
+    uint8_t buffer[WRITE_BUFFER_SIZE];
+};
+
+struct CaptureReader {
+    const uint8_t *data;
+    int64_t size;
+    int64_t offset;
+    uint64_t start_time_ns;
+    const char **source_names;
+    uint32_t source_capacity;
+};
+
+static void put_u32(uint8_t *const out, const uint32_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static void put_u64(uint8_t *const out, const uint64_t value) {
+    put_u32(out, (uint32_t)value);
+    put_u32(out + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t get_u32(const uint8_t *const in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *const in) {
+    return (uint64_t)get_u32(in) | ((uint64_t)get_u32(in + 4) << 32);
+}
+
+static int64_t padded(const int64_t length) {
+    return (length + RECORD_ALIGNMENT - 1) & ~(int64_t)(RECORD_ALIGNMENT - 1);
+}
+
+uint64_t capture_monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int write_all(const int fd, const uint8_t *data, int64_t length) {
+    while (length > 0) {
+        const ssize_t written = write(fd, data, (size_t)length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int capture_writer_flush(CaptureWriter *const writer) {
+    if (!writer || writer->failed) {
+        return -1;
+    }
+    if (writer->buffered > 0 && write_all(writer->fd, writer->buffer, writer->buffered) != 0) {
+        perror("Error writing capture file");
+        writer->failed = 1;
+        return -1;
+    }
+    writer->buffered = 0;
+    return 0;
+}
+
+int capture_writer_flush_if_due(CaptureWriter *const writer) {
+    if (!writer || writer->failed || writer->buffered == 0) {
+        return -1;
+    }
+    const uint64_t waited = capture_monotonic_ns() - writer->oldest_ns;
+    if (waited >= writer->flush_interval_ns) {
+        capture_writer_flush(writer);
+        return -1;
+    }
+    return (int)((writer->flush_interval_ns - waited + 999999) / 1000000);
+}
+
+// Appends one record, straight to the file when it doesn't fit in the buffer
+static int append_record(CaptureWriter *const writer, const CaptureRecordType type, const uint32_t source,
+                         const uint64_t timestamp_ns, const uint8_t *const data, const int64_t length) {
+    if (!writer || writer->failed || length < 0 || length > UINT32_MAX) {
+        return -1;
+    }
+    const int64_t record_size = RECORD_HEADER_SIZE + padded(length);
+    if (writer->buffered + record_size > WRITE_BUFFER_SIZE && capture_writer_flush(writer) != 0) {
+        return -1;
+    }
+
+    uint8_t header[RECORD_HEADER_SIZE];
+    put_u32(header, (uint32_t)type);
+    put_u32(header + 4, source);
+    put_u64(header + 8, timestamp_ns);
+    put_u32(header + 16, (uint32_t)length);
+    put_u32(header + 20, 0);
+    static const uint8_t zeros[RECORD_ALIGNMENT] = { 0 };
+    const int64_t padding = padded(length) - length;
+
+    if (record_size > WRITE_BUFFER_SIZE) {
+        if (write_all(writer->fd, header, sizeof header) != 0 || write_all(writer->fd, data, length) != 0 ||
+            write_all(writer->fd, zeros, padding) != 0) {
+            perror("Error writing capture file");
+            writer->failed = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (writer->buffered == 0) {
+        writer->oldest_ns = capture_monotonic_ns();
+    }
+    uint8_t *const out = writer->buffer + writer->buffered;
+    memcpy(out, header, sizeof header);
+    memcpy(out + RECORD_HEADER_SIZE, data, (size_t)length);
+    memset(out + RECORD_HEADER_SIZE + length, 0, (size_t)padding);
+    writer->buffered += record_size;
+    return 0;
+}
+
+CaptureWriter *capture_writer_open(const char *const path, const double flush_interval) {
+    CaptureWriter *const writer = (CaptureWriter*)malloc(sizeof(CaptureWriter));
+    if (!writer) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        printf("Error %i opening capture file %s: %s\n", errno, path, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+    writer->start_ns = capture_monotonic_ns();
+    writer->source_count = 0;
+    writer->failed = 0;
+    writer->flush_interval_ns = flush_interval > 0 ? (uint64_t)(flush_interval * 1e9) : 0;
+    writer->oldest_ns = writer->start_ns;
+
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    uint8_t *const header = writer->buffer;
+    memcpy(header, CAPTURE_MAGIC, MAGIC_SIZE);
+    put_u32(header + 8, CAPTURE_VERSION);
+    put_u32(header + 12, FILE_HEADER_SIZE);
+    put_u64(header + 16, (uint64_t)realtime.tv_sec * 1000000000ull + (uint64_t)realtime.tv_nsec);
+    put_u64(header + 24, writer->start_ns);
+    writer->buffered = FILE_HEADER_SIZE;
+    return writer;
+}
+
+int capture_writer_add_source(CaptureWriter *const writer, const char *const name) {
+    if (!writer || !name || writer->source_count >= CAPTURE_MAX_SOURCES) {
+        return -1;
+    }
+    const int source = writer->source_count;
+    if (append_record(writer, CAPTURE_RECORD_SOURCE, (uint32_t)source, 0, (const uint8_t*)name, (int64_t)strlen(name) + 1) != 0) {
+        return -1;
+    }
+    ++writer->source_count;
+    return source;
+}
+
+int capture_writer_write(CaptureWriter *const writer, const int source, const uint64_t timestamp_ns, const uint8_t *const data, const int64_t length) {
+    if (!writer || source < 0 || source >= writer->source_count) {
+        return -1;
+    }
+    const uint64_t since_start = timestamp_ns > writer->start_ns ? timestamp_ns - writer->start_ns : 0;
+    return append_record(writer, CAPTURE_RECORD_CHUNK, (uint32_t)source, since_start, data, length);
+}
+
+void capture_writer_close(CaptureWriter *const writer) {
+    if (writer) {
+        capture_writer_flush(writer);
+        close(writer->fd);
+        free(writer);
+    }
+}
+
+CaptureReader *capture_reader_open(const char *const path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Error %i opening capture file %s: %s\n", errno, path, strerror(errno));
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < FILE_HEADER_SIZE) {
+        printf("Error: %s is not a capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *const mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("Error %i mapping capture file %s: %s\n", errno, path, strerror(errno));
+        return NULL;
+    }
+    // Replay reads the file front to back exactly once
+    madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+    const uint8_t *const data = (const uint8_t*)mapping;
+    const uint32_t header_size = get_u32(data + 12);
+    if (memcmp(data, CAPTURE_MAGIC, MAGIC_SIZE) != 0 || get_u32(data + 8) != CAPTURE_VERSION ||
+        header_size < FILE_HEADER_SIZE || header_size > (uint64_t)info.st_size) {
+        printf("Error: %s is not a version %d capture file\n", path, CAPTURE_VERSION);
+        munmap(mapping, (size_t)info.st_size);
+        return NULL;
+    }
+
+    CaptureReader *const reader = (CaptureReader*)calloc(1, sizeof(CaptureReader));
+    if (!reader) {
+        munmap(mapping, (size_t)info.st_size);
+        return NULL;
+    }
+    reader->data = data;
+    reader->size = (int64_t)info.st_size;
+    reader->start_time_ns = get_u64(data + 16);
+    capture_reader_rewind(reader);
+    return reader;
+}
+
+static int remember_source(CaptureReader *const reader, const uint32_t source, const char *const name) {
+    // capture_reader_next() already refused larger ids, so the doubling below can't overflow
+    if (source >= reader->source_capacity) {
+        uint32_t capacity = reader->source_capacity ? reader->source_capacity : 16;
+        while (capacity <= source) {
+            capacity *= 2;
+        }
+        const char **const names = (const char**)realloc((void*)reader->source_names, capacity * sizeof(char*));
+        if (!names) {
+            return -1;
+        }
+        memset((void*)(names + reader->source_capacity), 0, (capacity - reader->source_capacity) * sizeof(char*));
+        reader->source_names = names;
+        reader->source_capacity = capacity;
+    }
+    reader->source_names[source] = name;
+    return 0;
+}
+
+int capture_reader_next(CaptureReader *const reader, CaptureRecord *const record) {
+    if (!reader || !record) {
+        return -1;
+    }
+    if (reader->offset == reader->size) {
+        return 0;
+    }
+    if (reader->size - reader->offset < RECORD_HEADER_SIZE) {
+        return -1;
+    }
+    const uint8_t *const header = reader->data + reader->offset;
+    const int64_t length = get_u32(header + 16);
+    if (reader->size - reader->offset - RECORD_HEADER_SIZE < length) {
+        return -1;
+    }
+    record->type = (CaptureRecordType)get_u32(header);
+    record->source = get_u32(header + 4);
+    if (record->source >= CAPTURE_MAX_SOURCES) {
+        return -1;
+    }
+    record->timestamp_ns = get_u64(header + 8);
+    record->data = header + RECORD_HEADER_SIZE;
+    record->length = length;
+
+    if (record->type == CAPTURE_RECORD_SOURCE) {
+        if (length == 0 || record->data[length - 1] != '\0' || remember_source(reader, record->source, (const char*)record->data) != 0) {
+            return -1;
+        }
+    } else if (record->type != CAPTURE_RECORD_CHUNK) {
+        return -1;
+    }
+    // The padding of the very last record may be missing if the file was cut short
+    const int64_t next = reader->offset + RECORD_HEADER_SIZE + padded(length);
+    reader->offset = next < reader->size ? next : reader->size;
+    return 1;
+}
+
+const char *capture_reader_source_name(const CaptureReader *const reader, const uint32_t source) {
+    return (reader && source < reader->source_capacity) ? reader->source_names[source] : NULL;
+}
+
+uint64_t capture_reader_start_time_ns(const CaptureReader *const reader) {
+    return reader ? reader->start_time_ns : 0;
+}
+
+int64_t capture_reader_size(const CaptureReader *const reader) {
+    return reader ? reader->size : 0;
+}
+
+void capture_reader_rewind(CaptureReader *const reader) {
+    if (reader) {
+        reader->offset = get_u32(reader->data + 12);
+    }
+}
+
+void capture_reader_close(CaptureReader *const reader) {
+    if (reader) {
+        munmap((void*)reader->data, (size_t)reader->size);
+        free((void*)reader->source_names);
+        free(reader);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+// Capture files hold the raw bytes read from every source, with the time they arrived, so that an
+// incident can be replayed through the parser later.
+//
+// Layout, all integers little endian:
+//   file header:  magic "SPCAP\r\n\x1a", uint32 version, uint32 header size,
+//                 uint64 start time (CLOCK_REALTIME ns), uint64 start time (CLOCK_MONOTONIC ns)
+//   records:      uint32 type, uint32 source id, uint64 ns since start, uint32 length, uint32 reserved,
+//                 then length bytes of data, padded with zeros to a multiple of 8
+// A source record (data: the source's name, NUL terminated) comes before the first chunk of that source.
+// Records are only ever appended, so a file cut short by a crash is valid up to its last whole record.
+
+#define CAPTURE_VERSION 1
+
+// Source ids are below this. Readers treat a record with a larger one as damage.
+#define CAPTURE_MAX_SOURCES 65536
+
+typedef enum {
+    CAPTURE_RECORD_SOURCE = 1,
+    CAPTURE_RECORD_CHUNK = 2
+} CaptureRecordType;
+
+typedef struct {
+    CaptureRecordType type;
+    uint32_t source;        // Below CAPTURE_MAX_SOURCES
+    uint64_t timestamp_ns;  // Since the capture started
+    const uint8_t *data;    // Points into the mapped file, valid until capture_reader_close()
+    int64_t length;
+} CaptureRecord;
+
+typedef struct CaptureWriter CaptureWriter;
+typedef struct CaptureReader CaptureReader;
+
+// CLOCK_MONOTONIC in nanoseconds, the clock chunk timestamps are taken with.
+extern uint64_t capture_monotonic_ns();
+
+// Creates (or truncates) a capture file. Records go out in one write() when the buffer fills up,
+// or from capture_writer_flush_if_due() once the oldest has waited flush_interval seconds.
+// Returns NULL with a message printed on failure.
+extern CaptureWriter *capture_writer_open(const char *path, double flush_interval);
+
+// Declares a source. Returns its id for capture_writer_write(), or -1 on failure, including
+// once CAPTURE_MAX_SOURCES sources are declared.
+extern int capture_writer_add_source(CaptureWriter *writer, const char *name);
+
+// Appends a chunk. timestamp_ns is a capture_monotonic_ns() reading. Records are buffered,
+// see capture_writer_flush(). Returns 0 on success, -1 on write errors.
+extern int capture_writer_write(CaptureWriter *writer, int source, uint64_t timestamp_ns, const uint8_t *data, int64_t length);
+
+// Writes out buffered records. Returns 0 on success, -1 on write errors.
+extern int capture_writer_flush(CaptureWriter *writer);
+
+// Flushes if the oldest buffered record has waited flush_interval. Returns the milliseconds until
+// the next flush is due, rounded up, or -1 if nothing is buffered.
+extern int capture_writer_flush_if_due(CaptureWriter *writer);
+
+// Flushes and closes the file.
+extern void capture_writer_close(CaptureWriter *writer);
+
+// Maps a capture file for reading. Returns NULL with a message printed on failure.
+extern CaptureReader *capture_reader_open(const char *path);
+
+// Reads the next record. Returns 1 on success, 0 at the end of the file,
+// -1 if the rest of the file is damaged or cut short.
+extern int capture_reader_next(CaptureReader *reader, CaptureRecord *record);
+
+// Name of a source seen so far, or NULL.
+extern const char *capture_reader_source_name(const CaptureReader *reader, uint32_t source);
+
+// CLOCK_REALTIME nanoseconds at the start of the capture.
+extern uint64_t capture_reader_start_time_ns(const CaptureReader *reader);
+
+// Total size of the mapped file, in bytes.
+extern int64_t capture_reader_size(const CaptureReader *reader);
+
+// Starts over from the first record.
+extern void capture_reader_rewind(CaptureReader *reader);
+
+extern void capture_reader_close(CaptureReader *reader);
+
+#endif // CAPTURE_H
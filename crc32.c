@@ -1,27 +1,318 @@
 #include "crc32.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #define CRC32_POLYNOMIAL 0xEDB88320
 
-CRC32_State crc32_create_engine() {
-    CRC32_State state;
-    state.crc = 0xFFFFFFFF;
-    return state;
-}
+// Below this many bytes the folding kernels aren't worth their setup cost.
+#define CRC32_PCLMUL_MINIMUM_LENGTH 64
+
+// All kernels work on the raw (not yet inverted) CRC register, same as CRC32_State.
+typedef uint32_t (*CRC32_Kernel)(uint32_t crc, const uint8_t *data, int64_t length);
+
+// tables[0] is the classic byte-at-a-time table, tables[k] advances
+// a byte that is followed by k more bytes. Only crc32_init() writes them,
+// everyone else reads them through crc32_tables.
+static uint32_t tables[8][256];
+const uint32_t (*const crc32_tables)[256] = (const uint32_t (*)[256])tables;
+
+static CRC32_Kernel crc32_kernel;
+static CRC32_Backend crc32_backend;
 
 // CRC-32/ISO-HDLC (IEEE)
-void crc32_update(CRC32_State *const state, const uint8_t *const data, const int64_t length) {
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *const data, const int64_t length) {
     for (int64_t i = 0; i < length; ++i) {
-        state->crc ^= data[i];
+        crc ^= data[i];
         for (uint8_t j = 0; j < 8; j++) {
-            if (state->crc & 1) {
-                state->crc = (state->crc >> 1) ^ CRC32_POLYNOMIAL;
+            if (crc & 1) {
+                crc = (crc >> 1) ^ CRC32_POLYNOMIAL;
             } else {
-                state->crc >>= 1;
+                crc >>= 1;
             }
         }
     }
+    return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, int64_t length) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, sizeof low);
+        memcpy(&high, data + 4, sizeof high);
+        low ^= crc;
+        crc = tables[7][low & 0xFF] ^
+              tables[6][(low >> 8) & 0xFF] ^
+              tables[5][(low >> 16) & 0xFF] ^
+              tables[4][low >> 24] ^
+              tables[3][high & 0xFF] ^
+              tables[2][(high >> 8) & 0xFF] ^
+              tables[1][(high >> 16) & 0xFF] ^
+              tables[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while (length-- > 0) {
+        crc = tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Folds 64 bytes at a time with carry-less multiplication, then Barrett-reduces to 32 bits.
+// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+// The constants are x^n mod P(x) for the bit-reflected IEEE polynomial.
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *data, int64_t length) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    length -= 64;
+
+    // Four independent 128 bit lanes, 64 bytes per iteration
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining whole 16 byte blocks
+    while (length >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        data += 16;
+        length -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction down to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *const data, const int64_t length) {
+    if (length < CRC32_PCLMUL_MINIMUM_LENGTH) {
+        return crc32_slice8(crc, data, length);
+    }
+    const int64_t folded = length & ~(int64_t)15;
+    crc = crc32_pclmul_fold(crc, data, folded);
+    return crc32_slice8(crc, data + folded, length - folded);
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *data, int64_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof word);
+        crc = __crc32d(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32b(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+static CRC32_Kernel kernel_of(const CRC32_Backend backend) {
+    switch (backend) {
+        case CRC32_BACKEND_BITWISE:
+            return crc32_bitwise;
+        case CRC32_BACKEND_SLICE8:
+            return crc32_slice8;
+#if defined(__x86_64__)
+        case CRC32_BACKEND_PCLMUL:
+            return (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) ? crc32_pclmul : NULL;
+#endif
+#if defined(__aarch64__)
+        case CRC32_BACKEND_ARMV8:
+            return (getauxval(AT_HWCAP) & HWCAP_CRC32) ? crc32_armv8 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+// Builds the lookup tables and picks the fastest backend before main() runs,
+// so crc32_update() never has to check whether it was initialized.
+__attribute__((constructor))
+static void crc32_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        const uint8_t byte = (uint8_t)i;
+        tables[0][i] = crc32_bitwise(0, &byte, 1);
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int k = 1; k < 8; ++k) {
+            const uint32_t previous = tables[k - 1][i];
+            tables[k][i] = (previous >> 8) ^ tables[0][previous & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    static const CRC32_Backend preference[] = { CRC32_BACKEND_ARMV8, CRC32_BACKEND_PCLMUL, CRC32_BACKEND_SLICE8 };
+    for (size_t i = 0; i < sizeof preference / sizeof preference[0]; ++i) {
+        if (crc32_select_backend(preference[i]) == 0) {
+            break;
+        }
+    }
+}
+
+CRC32_State crc32_create_engine() {
+    CRC32_State state;
+    state.crc = 0xFFFFFFFF;
+    return state;
+}
+
+void crc32_update(CRC32_State *const state, const uint8_t *const data, const int64_t length) {
+    state->crc = crc32_kernel(state->crc, data, length);
 }
 
 uint32_t crc32_finalize(const CRC32_State *const state) {
     return state->crc ^ 0xFFFFFFFF;
 }
+
+CRC32_Backend crc32_active_backend() {
+    return crc32_backend;
+}
+
+const char *crc32_backend_name(const CRC32_Backend backend) {
+    switch (backend) {
+        case CRC32_BACKEND_BITWISE: return "bitwise";
+        case CRC32_BACKEND_SLICE8: return "slice8";
+        case CRC32_BACKEND_PCLMUL: return "pclmul";
+        case CRC32_BACKEND_ARMV8: return "armv8";
+        default: return "unknown";
+    }
+}
+
+int crc32_backend_supported(const CRC32_Backend backend) {
+    return kernel_of(backend) != NULL;
+}
+
+int crc32_select_backend(const CRC32_Backend backend) {
+    const CRC32_Kernel kernel = kernel_of(backend);
+    if (!kernel) {
+        return -1;
+    }
+    crc32_kernel = kernel;
+    crc32_backend = backend;
+    return 0;
+}
+
+int crc32_self_test() {
+    // Deterministic pseudo random data, with room to shift the start for alignment tests
+    static uint8_t data[4096 + 64];
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < sizeof data; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    static const uint8_t hello[] = "Hello, World!";
+
+    int failures = 0;
+    for (int backend = 0; backend < CRC32_BACKEND_COUNT; ++backend) {
+        const CRC32_Kernel kernel = kernel_of((CRC32_Backend)backend);
+        if (!kernel) {
+            continue;
+        }
+        int ok = (kernel(0xFFFFFFFF, hello, sizeof hello - 1) ^ 0xFFFFFFFF) == 0xEC4AC3D0;
+        for (int64_t length = 0; ok && length <= 4096; length += (length < 300) ? 1 : 331) {
+            for (int offset = 0; ok && offset < 16; ++offset) {
+                const uint8_t *const start = data + offset;
+                const uint32_t expected = crc32_bitwise(0xFFFFFFFF, start, length);
+                ok = kernel(0xFFFFFFFF, start, length) == expected;
+                // Incremental updates have to give the same answer no matter where the split is
+                const int64_t split = length / 3;
+                ok = ok && kernel(kernel(0xFFFFFFFF, start, split), start + split, length - split) == expected;
+            }
+        }
+        if (!ok) {
+            ++failures;
+        }
+    }
+    return failures;
+}
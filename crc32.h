@@ -7,10 +7,44 @@ typedef struct {
     uint32_t crc;
 } CRC32_State;
 
+// Implementations of crc32_update(). They all compute the exact same CRC,
+// the fastest one supported by the CPU is picked at program startup.
+typedef enum {
+    CRC32_BACKEND_BITWISE, // Reference implementation, one bit at a time
+    CRC32_BACKEND_SLICE8,  // Slicing-by-8 lookup tables, portable
+    CRC32_BACKEND_PCLMUL,  // x86-64 SSE4.1 + PCLMULQDQ carry-less multiply folding
+    CRC32_BACKEND_ARMV8,   // AArch64 CRC32 instructions
+    CRC32_BACKEND_COUNT
+} CRC32_Backend;
+
 extern CRC32_State crc32_create_engine();
 // To test if this standard is compatible with your app, the string: "Hello, World!"
 // without the null terminator produces result: 0xEC4AC3D0 which is the result seen in https://crccalc.com/
 extern void crc32_update(CRC32_State *state, const uint8_t *data, int64_t length);
 extern uint32_t crc32_finalize(const CRC32_State *state);
 
+// Slicing-by-8 lookup tables, built at program startup, read only. crc32_tables[0] is the classic
+// byte table.
+extern const uint32_t (*const crc32_tables)[256];
+
+// Folds a single byte into the CRC. Much cheaper than crc32_update() for one byte
+// since it skips the backend dispatch.
+static inline void crc32_update_byte(CRC32_State *const state, const uint8_t byte) {
+    state->crc = crc32_tables[0][(state->crc ^ byte) & 0xFF] ^ (state->crc >> 8);
+}
+
+// Backend currently used by crc32_update().
+extern CRC32_Backend crc32_active_backend();
+extern const char *crc32_backend_name(CRC32_Backend backend);
+// Returns nonzero if the backend can run on this CPU.
+extern int crc32_backend_supported(CRC32_Backend backend);
+// Forces crc32_update() to use a specific backend (meant for benchmarks and tests).
+// Not thread safe- call it before any thread starts hashing.
+// Returns 0 on success, -1 if the backend isn't supported on this CPU.
+extern int crc32_select_backend(CRC32_Backend backend);
+
+// Checks every supported backend against the bitwise reference over many lengths,
+// alignments and split points. Returns the number of failing backends (0 means all good).
+extern int crc32_self_test();
+
 #endif // CRC32_ENGINE_H
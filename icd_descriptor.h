@@ -0,0 +1,165 @@
+#ifndef ICD_DESCRIPTOR_H
+#define ICD_DESCRIPTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+
+// Frame layouts of the ICDs this tree speaks. Every one of them is framed the same way:
+//
+//   header (2) | payload length (length_size, little-endian) | type (type_size) | payload | checksum | trailer (2)
+//
+// and the checksum covers every byte of the frame except itself, trailer included. They differ in
+// the delimiters, the width of the length and type fields, the checksum and the largest payload.
+typedef enum {
+    ICD_CHECKSUM_CRC32,  // 4 bytes, little-endian, the same CRC as crc32_update()
+    ICD_CHECKSUM_CRC16   // 2 bytes, little-endian, CRC-16/CCITT-FALSE
+} IcdChecksum;
+
+#define ICD_CHECKSUM_SIZE(checksum) ((checksum) == ICD_CHECKSUM_CRC32 ? 4 : 2)
+#define ICD_FRAME_OVERHEAD(length_size, type_size, checksum) (2 + (length_size) + (type_size) + ICD_CHECKSUM_SIZE(checksum) + 2)
+
+// The ICD of stream_parser.h. The handwritten parser takes its layout from these.
+#define ICD_STREAM_HEADER_0 '/'
+#define ICD_STREAM_HEADER_1 '*'
+#define ICD_STREAM_LENGTH_SIZE 2
+#define ICD_STREAM_TYPE_SIZE 3
+#define ICD_STREAM_CHECKSUM ICD_CHECKSUM_CRC32
+#define ICD_STREAM_TRAILER_0 '*'
+#define ICD_STREAM_TRAILER_1 '/'
+#define ICD_STREAM_MAX_PAYLOAD_SIZE 65535
+
+// Every ICD, as X(name, header_0, header_1, length_size, type_size, checksum, trailer_0, trailer_1, max_payload_size).
+// length_size is 1, 2 or 4 and type_size 0 to 4. icd_parser.h generates a parser for each one.
+#define ICD_DESCRIPTORS(X) \
+    X(icd_stream, ICD_STREAM_HEADER_0, ICD_STREAM_HEADER_1, ICD_STREAM_LENGTH_SIZE, ICD_STREAM_TYPE_SIZE, \
+      ICD_STREAM_CHECKSUM, ICD_STREAM_TRAILER_0, ICD_STREAM_TRAILER_1, ICD_STREAM_MAX_PAYLOAD_SIZE) \
+    /* Short telemetry frames over slow serial links */ \
+    X(icd_compact, 0x7E, 0x5A, 1, 1, ICD_CHECKSUM_CRC16, 0xA5, 0x7E, 255) \
+    /* Bulk transfers with the CCSDS sync marker's first two bytes */ \
+    X(icd_bulk, 0x1A, 0xCF, 4, 2, ICD_CHECKSUM_CRC32, 0xFC, 0x1D, 1 << 20)
+
+// The same layout as a value, for code that handles any ICD at run time, like the generator.
+// Passed as a compile time constant to the always inlined functions below, every field folds away.
+typedef struct {
+    const char *name;
+    uint8_t header[2];
+    int length_size;
+    int type_size;
+    IcdChecksum checksum;
+    uint8_t trailer[2];
+    int64_t max_payload_size;
+} IcdDescriptor;
+
+#define ICD_DESCRIPTOR_VALUE(name, header_0, header_1, length_size, type_size, checksum, trailer_0, trailer_1, max_payload_size) \
+    { #name, { (header_0), (header_1) }, (length_size), (type_size), (checksum), { (trailer_0), (trailer_1) }, (max_payload_size) }
+
+#define ICD_INLINE static inline __attribute__((always_inline))
+
+ICD_INLINE int icd_type_offset(const IcdDescriptor *const icd) {
+    return 2 + icd->length_size;
+}
+
+ICD_INLINE int icd_payload_offset(const IcdDescriptor *const icd) {
+    return 2 + icd->length_size + icd->type_size;
+}
+
+ICD_INLINE int icd_checksum_size(const IcdDescriptor *const icd) {
+    return ICD_CHECKSUM_SIZE(icd->checksum);
+}
+
+ICD_INLINE int64_t icd_overhead(const IcdDescriptor *const icd) {
+    return ICD_FRAME_OVERHEAD(icd->length_size, icd->type_size, icd->checksum);
+}
+
+// Payload length field of a frame whose first 2 + length_size bytes are known
+ICD_INLINE int64_t icd_payload_length(const IcdDescriptor *const icd, const uint8_t *const frame) {
+    uint64_t length = 0;
+    for (int i = 0; i < icd->length_size; ++i) {
+        length |= (uint64_t)frame[2 + i] << (8 * i);
+    }
+    return (int64_t)length;
+}
+
+// CRC-16/CCITT-FALSE, a nibble at a time: a table small enough to live in the instruction stream
+ICD_INLINE uint16_t icd_crc16_update(uint16_t crc, const uint8_t *const data, const int64_t length) {
+    static const uint16_t table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    };
+    for (int64_t i = 0; i < length; ++i) {
+        crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)]);
+        crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)]);
+    }
+    return crc;
+}
+
+// Checksum of a whole frame: everything before the checksum field, then the trailer
+ICD_INLINE uint32_t icd_frame_checksum(const IcdDescriptor *const icd, const uint8_t *const frame, const int64_t frame_length) {
+    const int64_t checksum_offset = frame_length - 2 - icd_checksum_size(icd);
+    if (icd->checksum == ICD_CHECKSUM_CRC32) {
+        CRC32_State engine = crc32_create_engine();
+        crc32_update(&engine, frame, checksum_offset);
+        crc32_update(&engine, frame + frame_length - 2, 2);
+        return crc32_finalize(&engine);
+    }
+    uint16_t crc = icd_crc16_update(0xFFFF, frame, checksum_offset);
+    return icd_crc16_update(crc, frame + frame_length - 2, 2);
+}
+
+// Checksum field of a whole frame
+ICD_INLINE uint32_t icd_received_checksum(const IcdDescriptor *const icd, const uint8_t *const frame, const int64_t frame_length) {
+    const uint8_t *const field = frame + frame_length - 2 - icd_checksum_size(icd);
+    uint32_t checksum = 0;
+    for (int i = 0; i < icd_checksum_size(icd); ++i) {
+        checksum |= (uint32_t)field[i] << (8 * i);
+    }
+    return checksum;
+}
+
+// Encodes a payload into a frame. type must hold type_size bytes. The payload may already sit at
+// out + icd_payload_offset(), in which case it isn't copied. Returns the frame length, or -1 if the
+// payload is too long or doesn't fit in capacity.
+static inline int64_t icd_encode(const IcdDescriptor *const icd, const uint8_t *const type, const uint8_t *const payload,
+                                 const int64_t payload_size, uint8_t *const out, const int64_t capacity) {
+    const int64_t frame_length = payload_size + icd_overhead(icd);
+    if (payload_size < 0 || payload_size > icd->max_payload_size || frame_length > capacity) {
+        return -1;
+    }
+    out[0] = icd->header[0];
+    out[1] = icd->header[1];
+    for (int i = 0; i < icd->length_size; ++i) {
+        out[2 + i] = (uint8_t)((uint64_t)payload_size >> (8 * i));
+    }
+    for (int i = 0; i < icd->type_size; ++i) {
+        out[icd_type_offset(icd) + i] = type[i];
+    }
+    if (payload_size > 0 && payload != out + icd_payload_offset(icd)) {
+        memmove(out + icd_payload_offset(icd), payload, (size_t)payload_size);
+    }
+    out[frame_length - 2] = icd->trailer[0];
+    out[frame_length - 1] = icd->trailer[1];
+    const uint32_t checksum = icd_frame_checksum(icd, out, frame_length);
+    uint8_t *const field = out + frame_length - 2 - icd_checksum_size(icd);
+    for (int i = 0; i < icd_checksum_size(icd); ++i) {
+        field[i] = (uint8_t)(checksum >> (8 * i));
+    }
+    return frame_length;
+}
+
+// icd_stream_descriptor, icd_compact_descriptor, ... Constants, so that code inlined with them
+// is specialized for the ICD.
+#define ICD_DEFINE_DESCRIPTOR(name, ...) \
+    static const IcdDescriptor name##_descriptor __attribute__((unused)) = ICD_DESCRIPTOR_VALUE(name, __VA_ARGS__);
+ICD_DESCRIPTORS(ICD_DEFINE_DESCRIPTOR)
+#undef ICD_DEFINE_DESCRIPTOR
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ICD_DESCRIPTOR_H
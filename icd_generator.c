@@ -0,0 +1,113 @@
+#include "icd_generator.h"
+#include <math.h>
+#include <string.h>
+
+// xorshift64*, plenty for test data and identical on every platform
+static uint64_t next_random(uint64_t *const state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double next_probability(uint64_t *const state) {
+    return (double)(next_random(state) >> 11) / 9007199254740992.0;
+}
+
+static int64_t next_in_range(uint64_t *const state, const int64_t min, const int64_t max) {
+    if (max <= min) {
+        return min;
+    }
+    return min + (int64_t)(next_random(state) % (uint64_t)(max - min + 1));
+}
+
+static int64_t next_payload_size(const IcdGeneratorConfig *const config, uint64_t *const state) {
+    switch (config->payload_distribution) {
+        case ICD_GENERATOR_PAYLOAD_UNIFORM:
+            return next_in_range(state, config->min_payload_size, config->max_payload_size);
+        case ICD_GENERATOR_PAYLOAD_EXPONENTIAL: {
+            const double mean = (double)(config->min_payload_size + config->max_payload_size) / 4.0 + 1.0;
+            const int64_t size = config->min_payload_size + (int64_t)(-log(1.0 - next_probability(state)) * mean);
+            return size > config->max_payload_size ? config->max_payload_size : size;
+        }
+        case ICD_GENERATOR_PAYLOAD_FIXED:
+        default:
+            return config->max_payload_size;
+    }
+}
+
+IcdGeneratorConfig icd_generator_default_config(const int64_t max_payload_size) {
+    IcdGeneratorConfig config;
+    memset(&config, 0, sizeof config);
+    config.seed = 0x5EED;
+    config.payload_distribution = ICD_GENERATOR_PAYLOAD_FIXED;
+    config.min_payload_size = 0;
+    config.max_payload_size = max_payload_size;
+    config.max_garbage_length = 16;
+    return config;
+}
+
+int64_t icd_generator_fill(const IcdGeneratorConfig *const config, uint8_t *const out, const int64_t capacity, IcdGeneratorSummary *const summary) {
+    const IcdDescriptor *const icd = config->icd ? config->icd : &icd_stream_descriptor;
+    IcdGeneratorSummary counts;
+    memset(&counts, 0, sizeof counts);
+    uint64_t state = config->seed ? config->seed : 1;
+
+    int64_t length = 0;
+    for (;;) {
+        const int64_t payload_size = next_payload_size(config, &state);
+        const int64_t garbage_length = (next_probability(&state) < config->garbage_probability)
+            ? next_in_range(&state, 1, config->max_garbage_length) : 0;
+        const int fake_header = next_probability(&state) < config->fake_header_probability;
+        if (length + garbage_length + 2 + payload_size + icd_overhead(icd) > capacity) {
+            break;
+        }
+
+        for (int64_t i = 0; i < garbage_length; ++i) {
+            uint8_t byte = (uint8_t)next_random(&state);
+            out[length++] = (byte == icd->header[0]) ? 0 : byte;
+        }
+        if (fake_header) {
+            out[length++] = icd->trailer[0];
+            out[length++] = icd->trailer[1];
+        }
+        counts.garbage_bytes += garbage_length + (fake_header ? 2 : 0);
+
+        // The body is written in place, right where icd_encode() expects it
+        uint8_t *const frame = out + length;
+        uint8_t *const payload = frame + icd_payload_offset(icd);
+        for (int64_t i = 0; i < payload_size; ++i) {
+            payload[i] = (uint8_t)next_random(&state);
+        }
+        uint8_t type[4] = { 'A', 'A', 'A', 'A' };
+        if (config->type_count > 0) {
+            memcpy(type, config->types[next_random(&state) % (uint64_t)config->type_count], 3);
+        }
+        int64_t frame_length = icd_encode(icd, type, payload, payload_size, frame, capacity - length);
+        ++counts.frames;
+
+        int damaged = 0;
+        if (next_probability(&state) < config->bit_flip_probability) {
+            frame[next_random(&state) % (uint64_t)frame_length] ^= (uint8_t)(1u << (next_random(&state) % 8));
+            ++counts.corrupted_frames;
+            damaged = 1;
+        }
+        if (next_probability(&state) < config->truncate_probability) {
+            frame_length = next_in_range(&state, 1, frame_length - 1);
+            ++counts.truncated_frames;
+            damaged = 1;
+        }
+        if (!damaged) {
+            ++counts.valid_frames;
+        }
+        length += frame_length;
+    }
+
+    if (summary) {
+        *summary = counts;
+    }
+    return length;
+}
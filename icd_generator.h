@@ -0,0 +1,67 @@
+#ifndef ICD_GENERATOR_H
+#define ICD_GENERATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "icd_descriptor.h"
+
+// Synthetic ICD stream generator, for benchmarks and for exercising the parser without hardware.
+
+typedef enum {
+    ICD_GENERATOR_PAYLOAD_FIXED,       // Always max_payload_size
+    ICD_GENERATOR_PAYLOAD_UNIFORM,     // Uniform in [min_payload_size, max_payload_size]
+    ICD_GENERATOR_PAYLOAD_EXPONENTIAL  // Mostly small, exponential with mean (min + max) / 4, capped at max
+} IcdGeneratorPayloadDistribution;
+
+typedef struct {
+    uint64_t seed;
+
+    // Layout of the frames, one of the *_descriptor constants of icd_descriptor.h.
+    // NULL means icd_stream_descriptor, the ICD of stream_parser.h. Payloads may not exceed its max_payload_size.
+    const IcdDescriptor *icd;
+
+    IcdGeneratorPayloadDistribution payload_distribution;
+    int64_t min_payload_size;
+    int64_t max_payload_size;
+
+    // Packet types to pick from uniformly. If type_count is 0, every frame gets type "AAA".
+    // ICDs with shorter type fields take the leading bytes, longer ones are padded with 'A'.
+    const uint8_t (*types)[3];
+    int type_count;
+
+    // Probability that a run of random garbage (1 to max_garbage_length bytes) precedes a frame.
+    // Garbage never contains the first header byte so it can't be mistaken for a header.
+    double garbage_probability;
+    int64_t max_garbage_length;
+    // Probability that one random bit of a frame is flipped
+    double bit_flip_probability;
+    // Probability that a frame is cut short at a random point
+    double truncate_probability;
+    // Probability that a frame is preceded by the trailer, "*/" in stream_parser's ICD, which
+    // looks like the start of a header
+    double fake_header_probability;
+} IcdGeneratorConfig;
+
+typedef struct {
+    int64_t frames;            // Frames started, whatever happened to them
+    int64_t valid_frames;      // Frames written out complete and untouched
+    int64_t corrupted_frames;  // Frames with a flipped bit
+    int64_t truncated_frames;  // Frames cut short
+    int64_t garbage_bytes;     // Bytes of garbage and fake headers in between frames
+} IcdGeneratorSummary;
+
+// Returns a configuration producing clean back to back frames of max_payload_size bytes.
+extern IcdGeneratorConfig icd_generator_default_config(int64_t max_payload_size);
+
+// Fills out with frames (and whatever noise the configuration asks for) until the next frame
+// wouldn't fit. Returns the number of bytes written. summary may be NULL.
+extern int64_t icd_generator_fill(const IcdGeneratorConfig *config, uint8_t *out, int64_t capacity, IcdGeneratorSummary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ICD_GENERATOR_H
@@ -0,0 +1,168 @@
+#ifndef ICD_PARSER_H
+#define ICD_PARSER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include "icd_descriptor.h"
+
+// Parsers specialized at compile time for each ICD of icd_descriptor.h. For every
+// X(name, ...) entry there is:
+//
+//   name##_parser                                   the parser, with its buffers inside (no heap)
+//   name##_parser_init(parser, callback, data)      sets it up, callback gets every valid frame
+//   name##_parser_push(parser, bytes, length)       feeds it bytes
+//
+// They are lean siblings of stream_parser.h: a packet callback and a few counters, no error
+// callbacks or stats threads. Packets come out exactly as from a StreamParser of the same ICD
+// (with rescanning of rejected frames, which is the default): a frame is taken when its header,
+// length, trailer and checksum all check out, and the search for the next header goes on right
+// after the first byte of a frame that doesn't. Frames found whole in the pushed bytes are handed
+// out in place, so packet_buffer is only valid during the callback.
+// All the layout comes from a constant descriptor the code is inlined with, so offsets, field
+// widths and the checksum are fixed at compile time, as in a handwritten parser.
+
+// Same contract as StreamParserPacketCallback
+typedef void (*IcdPacketCallback)(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data);
+
+typedef struct {
+    IcdPacketCallback callback;
+    void *callback_data;
+    int64_t index;             // Bytes of an unfinished frame held in the buffer
+    uint64_t packets;
+    uint64_t rejects;          // Frames with a bad length, trailer or checksum
+    uint64_t skipped_bytes;    // Bytes that weren't the start of a header
+} IcdParserCore;
+
+// What a frame candidate starting with header[0] turned out to be
+#define ICD_FRAME_NEEDS_BYTES 0
+#define ICD_FRAME_NOT_HEADER (-1)
+#define ICD_FRAME_REJECTED (-2)
+
+static inline void icd_parser_core_init(IcdParserCore *const core, const IcdPacketCallback callback, void *const callback_data) {
+    memset(core, 0, sizeof *core);
+    core->callback = callback;
+    core->callback_data = callback_data;
+}
+
+// Returns the length of a whole valid frame at frame[0, available), or one of the ICD_FRAME_* codes.
+ICD_INLINE int64_t icd_check_frame(const IcdDescriptor *const icd, const uint8_t *const frame, const int64_t available) {
+    if (available < 2) {
+        return ICD_FRAME_NEEDS_BYTES;
+    }
+    if (frame[1] != icd->header[1]) {
+        return ICD_FRAME_NOT_HEADER;
+    }
+    if (available < 2 + icd->length_size) {
+        return ICD_FRAME_NEEDS_BYTES;
+    }
+    const int64_t payload_length = icd_payload_length(icd, frame);
+    if (payload_length > icd->max_payload_size) {
+        return ICD_FRAME_REJECTED;
+    }
+    const int64_t frame_length = payload_length + icd_overhead(icd);
+    if (available < frame_length) {
+        return ICD_FRAME_NEEDS_BYTES;
+    }
+    if (frame[frame_length - 2] != icd->trailer[0] || frame[frame_length - 1] != icd->trailer[1] ||
+        icd_frame_checksum(icd, frame, frame_length) != icd_received_checksum(icd, frame, frame_length)) {
+        return ICD_FRAME_REJECTED;
+    }
+    return frame_length;
+}
+
+// Finds the frames in bytes, with nothing held from before. A frame cut off by the end is held.
+ICD_INLINE void icd_parser_scan(const IcdDescriptor *const icd, IcdParserCore *const core, uint8_t *const buffer,
+                                const uint8_t *const bytes, const int64_t length) {
+    int64_t i = 0;
+    while (i < length) {
+        const uint8_t *const header = (const uint8_t*)memchr(bytes + i, icd->header[0], (size_t)(length - i));
+        if (!header) {
+            core->skipped_bytes += (uint64_t)(length - i);
+            return;
+        }
+        const int64_t at = (int64_t)(header - bytes);
+        core->skipped_bytes += (uint64_t)(at - i);
+        const int64_t result = icd_check_frame(icd, bytes + at, length - at);
+        if (result > 0) {
+            ++core->packets;
+            core->callback(bytes + at, result, core->callback_data);
+            i = at + result;
+        } else if (result == ICD_FRAME_NEEDS_BYTES) {
+            memcpy(buffer, bytes + at, (size_t)(length - at));
+            core->index = length - at;
+            return;
+        } else {
+            // Not a frame after all, the next header may start at its second byte
+            if (result == ICD_FRAME_REJECTED) {
+                ++core->rejects;
+            } else {
+                ++core->skipped_bytes;
+            }
+            i = at + 1;
+        }
+    }
+}
+
+// Feeds bytes to a parser. buffer and scratch hold the largest frame of the ICD each.
+ICD_INLINE void icd_parser_push(const IcdDescriptor *const icd, IcdParserCore *const core, uint8_t *const buffer,
+                                uint8_t *const scratch, const uint8_t *const bytes, const int64_t length) {
+    int64_t i = 0;
+    while (core->index > 0 && i < length) {
+        // Complete the held frame: first up to its length field, then to its end
+        int64_t wanted = 2 + icd->length_size;
+        if (core->index >= wanted) {
+            wanted = icd_payload_length(icd, buffer) + icd_overhead(icd);
+        }
+        const int64_t take = (wanted - core->index < length - i) ? wanted - core->index : length - i;
+        memcpy(buffer + core->index, bytes + i, (size_t)take);
+        core->index += take;
+        i += take;
+
+        const int64_t result = icd_check_frame(icd, buffer, core->index);
+        if (result > 0) {
+            ++core->packets;
+            core->callback(buffer, result, core->callback_data);
+            core->index = 0;
+        } else if (result != ICD_FRAME_NEEDS_BYTES) {
+            if (result == ICD_FRAME_REJECTED) {
+                ++core->rejects;
+            } else {
+                ++core->skipped_bytes;
+            }
+            // Scan the held bytes after the first again, the ones from this push follow from the start
+            const int64_t held = core->index - i;
+            memcpy(scratch, buffer + 1, (size_t)(held - 1));
+            core->index = 0;
+            icd_parser_scan(icd, core, buffer, scratch, held - 1);
+            i = 0;
+        }
+    }
+    if (core->index == 0 && i < length) {
+        icd_parser_scan(icd, core, buffer, bytes + i, length - i);
+    }
+}
+
+#define ICD_DEFINE_PARSER(name, header_0, header_1, length_size, type_size, checksum, trailer_0, trailer_1, max_payload_size) \
+    typedef struct { \
+        IcdParserCore core; \
+        uint8_t buffer[ICD_FRAME_OVERHEAD(length_size, type_size, checksum) + (max_payload_size)]; \
+        uint8_t scratch[ICD_FRAME_OVERHEAD(length_size, type_size, checksum) + (max_payload_size)]; \
+    } name##_parser; \
+    static inline void name##_parser_init(name##_parser *const parser, const IcdPacketCallback callback, void *const callback_data) { \
+        icd_parser_core_init(&parser->core, callback, callback_data); \
+    } \
+    static inline void name##_parser_push(name##_parser *const parser, const uint8_t *const bytes, const int64_t length) { \
+        icd_parser_push(&name##_descriptor, &parser->core, parser->buffer, parser->scratch, bytes, length); \
+    }
+ICD_DESCRIPTORS(ICD_DEFINE_PARSER)
+#undef ICD_DEFINE_PARSER
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ICD_PARSER_H
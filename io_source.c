@@ -0,0 +1,284 @@
+#include "io_source.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+int io_source_baud_rate(const int baud_rate, speed_t *const speed) {
+    static const struct {
+        int rate;
+        speed_t speed;
+    } rates[] = {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+        { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+        { 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 }, { 2000000, B2000000 },
+        { 3000000, B3000000 }, { 4000000, B4000000 },
+#endif
+    };
+    for (size_t i = 0; i < sizeof rates / sizeof rates[0]; ++i) {
+        if (rates[i].rate == baud_rate) {
+            *speed = rates[i].speed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int open_tty(const char *const port, const int baud_rate) {
+    speed_t speed;
+    if (io_source_baud_rate(baud_rate, &speed) != 0) {
+        printf("Error: Unsupported baud rate %d for %s\n", baud_rate, port);
+        return -1;
+    }
+
+    const int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening port");
+        return -1;
+    }
+
+    struct termios tty;
+    memset(&tty, 0, sizeof tty);
+    if (tcgetattr(fd, &tty) != 0) {
+        perror("Error from tcgetattr");
+        close(fd);
+        return -1;
+    }
+
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
+
+    tty.c_cflag &= ~PARENB; // Clear parity bit, disabling parity
+    tty.c_cflag &= ~CSTOPB; // Clear stop field, only one stop bit used in communication
+    tty.c_cflag &= ~CSIZE; // Clear all bits that set the data size
+    tty.c_cflag |= CS8; // 8 bits per byte
+    tty.c_cflag &= ~CRTSCTS; // Disable RTS/CTS hardware flow control
+    tty.c_cflag |= CREAD | CLOCAL; // Turn on READ & ignore ctrl lines
+
+    tty.c_lflag &= ~ICANON;
+    tty.c_lflag &= ~ECHO; // Disable echo
+    tty.c_lflag &= ~ECHOE; // Disable erasure
+    tty.c_lflag &= ~ECHONL; // Disable new-line echo
+    tty.c_lflag &= ~ISIG; // Disable interpretation of INTR, QUIT and SUSP
+
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Turn off s/w flow ctrl
+    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL); // Disable any special handling of received bytes
+
+    tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
+    tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
+
+    // The fd is non-blocking and driven by epoll, so reads return whatever is there right away
+    tty.c_cc[VTIME] = 0;
+    tty.c_cc[VMIN] = 0;
+
+    const int tcsetattr_ret = tcsetattr(fd, TCSANOW, &tty);
+    if (tcsetattr_ret != 0) {
+        printf("Error from tcsetattr: %d\n", tcsetattr_ret);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Asks the kernel to stamp every received skb, so latency is measured from when the data reached
+// the host rather than from when the read got around to it. Sources that can't do it fall back to
+// reading the clock after the read.
+static void enable_receive_timestamps(const int fd) {
+    const int enabled = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof enabled);
+}
+
+// Splits "host:port" (or just "port", meaning any address) and resolves it.
+static struct addrinfo *resolve(const char *const address, const int socket_type, const int passive) {
+    char host[256];
+    const char *port = address;
+    const char *const colon = strrchr(address, ':');
+    const char *host_ptr = NULL;
+    if (colon) {
+        const size_t host_length = (size_t)(colon - address);
+        if (host_length >= sizeof host) {
+            return NULL;
+        }
+        memcpy(host, address, host_length);
+        host[host_length] = '\0';
+        host_ptr = host_length > 0 ? host : NULL;
+        port = colon + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socket_type;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo *result = NULL;
+    const int gai_ret = getaddrinfo(host_ptr, port, &hints, &result);
+    if (gai_ret != 0) {
+        printf("Error resolving %s: %s\n", address, gai_strerror(gai_ret));
+        return NULL;
+    }
+    return result;
+}
+
+static int open_inet(const char *const address, const int socket_type) {
+    const int passive = socket_type == SOCK_DGRAM;
+    struct addrinfo *const addresses = resolve(address, socket_type, passive);
+    if (!addresses) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        // TCP connects blocking for simplicity, UDP just binds and waits for datagrams
+        const int ret = passive ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (ret == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        printf("Error %s %s: %s\n", passive ? "binding" : "connecting to", address, strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    enable_receive_timestamps(fd);
+    return fd;
+}
+
+static int open_unix(const char *const path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        printf("Error: Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating unix socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        printf("Error connecting to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    enable_receive_timestamps(fd);
+    return fd;
+}
+
+static int open_fifo(const char *const path) {
+    // Opened read-write so that the pipe never reports end of stream when a writer
+    // goes away- the next writer just picks up where the last one left off.
+    const int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Error opening fifo %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+int io_source_open(IoSource *const source, const IoSourceKind kind, const char *const address, const int baud_rate) {
+    source->kind = kind;
+    source->address = address;
+    switch (kind) {
+        case IO_SOURCE_TTY: source->fd = open_tty(address, baud_rate); break;
+        case IO_SOURCE_TCP: source->fd = open_inet(address, SOCK_STREAM); break;
+        case IO_SOURCE_UDP: source->fd = open_inet(address, SOCK_DGRAM); break;
+        case IO_SOURCE_UNIX: source->fd = open_unix(address); break;
+        case IO_SOURCE_FIFO: source->fd = open_fifo(address); break;
+        default: source->fd = -1; break;
+    }
+    return source->fd < 0 ? -1 : 0;
+}
+
+static uint64_t clock_ns(const clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Reads from a socket along with its SO_TIMESTAMPNS receive timestamp, if the kernel gave one.
+// Those are CLOCK_REALTIME, so they are moved to CLOCK_MONOTONIC by how long ago they were taken.
+static ssize_t receive_stamped(const int fd, uint8_t *const buffer, const size_t capacity, uint64_t *const arrival_ns) {
+    struct iovec iov = { buffer, capacity };
+    union {
+        struct cmsghdr align;
+        uint8_t data[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof message);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof control.data;
+    const ssize_t n = recvmsg(fd, &message, 0);
+    if (n <= 0) {
+        return n;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof stamp);
+            const uint64_t stamp_ns = (uint64_t)stamp.tv_sec * 1000000000ull + (uint64_t)stamp.tv_nsec;
+            const uint64_t monotonic = clock_ns(CLOCK_MONOTONIC);
+            const uint64_t realtime = clock_ns(CLOCK_REALTIME);
+            const uint64_t age = realtime > stamp_ns ? realtime - stamp_ns : 0;
+            *arrival_ns = monotonic > age ? monotonic - age : 0;
+        }
+    }
+    return n;
+}
+
+ssize_t io_source_read(IoSource *const source, uint8_t *const buffer, const size_t capacity, uint64_t *const arrival_ns) {
+    uint64_t stamp = 0;
+    const int is_socket = source->kind == IO_SOURCE_TCP || source->kind == IO_SOURCE_UDP || source->kind == IO_SOURCE_UNIX;
+    const ssize_t n = (is_socket && arrival_ns) ? receive_stamped(source->fd, buffer, capacity, &stamp) : read(source->fd, buffer, capacity);
+    if (n > 0) {
+        if (arrival_ns) {
+            *arrival_ns = stamp ? stamp : clock_ns(CLOCK_MONOTONIC);
+        }
+        return n;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n == 0 && (source->kind == IO_SOURCE_TTY || source->kind == IO_SOURCE_UDP)) {
+        return 0; // No data on a tty, or an empty datagram
+    }
+    return -1;
+}
+
+void io_source_close(IoSource *const source) {
+    if (source->fd >= 0) {
+        close(source->fd);
+        source->fd = -1;
+    }
+}
+
+const char *io_source_kind_name(const IoSourceKind kind) {
+    switch (kind) {
+        case IO_SOURCE_TTY: return "tty";
+        case IO_SOURCE_TCP: return "tcp";
+        case IO_SOURCE_UDP: return "udp";
+        case IO_SOURCE_UNIX: return "unix";
+        case IO_SOURCE_FIFO: return "fifo";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef IO_SOURCE_H
+#define IO_SOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+// Byte stream sources the command line tool can listen on. All of them are opened non-blocking.
+typedef enum {
+    IO_SOURCE_TTY,  // Serial port, configured raw 8N1 at the given baud rate
+    IO_SOURCE_TCP,  // TCP client connection to host:port
+    IO_SOURCE_UDP,  // UDP socket bound to [host:]port, every datagram is appended to the stream
+    IO_SOURCE_UNIX, // Unix stream socket client connection to a path
+    IO_SOURCE_FIFO  // Named pipe
+} IoSourceKind;
+
+typedef struct {
+    IoSourceKind kind;
+    const char *address; // As given on the command line, not owned
+    int fd;
+} IoSource;
+
+// Maps a numeric baud rate (9600, 115200, ...) to what termios wants.
+// Returns 0 on success, -1 if the rate isn't a standard one.
+extern int io_source_baud_rate(int baud_rate, speed_t *speed);
+
+// Opens a source. baud_rate only matters for IO_SOURCE_TTY.
+// Returns 0 on success, -1 with a message printed on failure.
+extern int io_source_open(IoSource *source, IoSourceKind kind, const char *address, int baud_rate);
+
+// Reads whatever is available, up to capacity bytes.
+// Returns the number of bytes read, 0 if nothing is available right now,
+// or -1 if the source is gone (end of stream or error).
+// When bytes were read, arrival_ns (may be NULL) gets the CLOCK_MONOTONIC time they arrived: the
+// kernel's receive timestamp (SO_TIMESTAMPNS) on sockets, the time of the read on ttys and fifos.
+extern ssize_t io_source_read(IoSource *source, uint8_t *buffer, size_t capacity, uint64_t *arrival_ns);
+
+extern void io_source_close(IoSource *source);
+
+extern const char *io_source_kind_name(IoSourceKind kind);
+
+#endif // IO_SOURCE_H
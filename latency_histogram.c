@@ -0,0 +1,117 @@
+#include "latency_histogram.h"
+#include <string.h>
+#include <math.h>
+
+#define SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+// The recording thread updates counters with relaxed load + store, like the parser's stats, so
+// readers on other threads see whole values without any locked instructions.
+static inline void counter_add(uint64_t *const counter, const uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(const uint64_t value) {
+    const int msb = value ? 63 - __builtin_clzll(value) : 0;
+    const int shift = msb > LATENCY_HISTOGRAM_SUB_BUCKET_BITS ? msb - LATENCY_HISTOGRAM_SUB_BUCKET_BITS : 0;
+    if (shift > LATENCY_HISTOGRAM_MAX_SHIFT) {
+        return LATENCY_HISTOGRAM_BUCKETS - 1;
+    }
+    return (shift << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + (int)(value >> shift);
+}
+
+// Lowest value of a bucket, and how many values it covers
+static uint64_t bucket_low(const int index, uint64_t *const width) {
+    const int shift = index < 2 * SUB_BUCKETS ? 0 : (index >> LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    *width = (uint64_t)1 << shift;
+    return (uint64_t)(index - (shift << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)) << shift;
+}
+
+static uint64_t bucket_high(const int index) {
+    uint64_t width;
+    const uint64_t low = bucket_low(index, &width);
+    return low + width - 1;
+}
+
+void latency_histogram_reset(LatencyHistogram *const histogram) {
+    memset(histogram, 0, sizeof *histogram);
+}
+
+void latency_histogram_record(LatencyHistogram *const histogram, const uint64_t value_ns) {
+    counter_add(&histogram->counts[bucket_index(value_ns)], 1);
+    counter_add(&histogram->sum_ns, value_ns);
+    counter_add(&histogram->count, 1);
+}
+
+void latency_histogram_copy(LatencyHistogram *const out, const LatencyHistogram *const histogram) {
+    out->sum_ns = __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    uint64_t count = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        out->counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        count += out->counts[i];
+    }
+    // Keep the total consistent with the buckets, whatever was recorded in between
+    out->count = count;
+}
+
+void latency_histogram_subtract(LatencyHistogram *const histogram, const LatencyHistogram *const earlier) {
+    histogram->count -= earlier->count;
+    histogram->sum_ns -= earlier->sum_ns;
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        histogram->counts[i] -= earlier->counts[i];
+    }
+}
+
+uint64_t latency_histogram_percentile(const LatencyHistogram *const histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    if (percentile > 100) {
+        percentile = 100;
+    }
+    uint64_t wanted = (uint64_t)ceil(percentile / 100 * (double)histogram->count);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            return bucket_high(i);
+        }
+    }
+    return bucket_high(LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+double latency_histogram_mean(const LatencyHistogram *const histogram) {
+    return histogram->count ? (double)histogram->sum_ns / (double)histogram->count : 0.0;
+}
+
+void latency_histogram_write_percentiles(const LatencyHistogram *const histogram, FILE *const out, const double unit_ns) {
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    const double mean = latency_histogram_mean(histogram);
+    double variance = 0;
+    uint64_t seen = 0;
+    int last = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+        uint64_t width;
+        const double middle = (double)bucket_low(i, &width) + (double)(width - 1) / 2;
+        variance += (middle - mean) * (middle - mean) * (double)histogram->counts[i];
+        seen += histogram->counts[i];
+        last = i;
+        const double fraction = (double)seen / (double)histogram->count;
+        if (seen < histogram->count) {
+            fprintf(out, "%12.3f %1.12f %10llu %14.2f\n", (double)bucket_high(i) / unit_ns, fraction,
+                    (unsigned long long)seen, 1 / (1 - fraction));
+        } else {
+            fprintf(out, "%12.3f %1.12f %10llu\n", (double)bucket_high(i) / unit_ns, fraction, (unsigned long long)seen);
+        }
+    }
+    const double deviation = histogram->count ? sqrt(variance / (double)histogram->count) : 0.0;
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / unit_ns, deviation / unit_ns);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n",
+            histogram->count ? (double)bucket_high(last) / unit_ns : 0.0, (unsigned long long)histogram->count);
+    fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", LATENCY_HISTOGRAM_MAX_SHIFT + 2, 2 * SUB_BUCKETS);
+}
@@ -0,0 +1,54 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-linear histogram of nanosecond latencies, laid out like an HdrHistogram: every power of two
+// is split into 32 equal buckets, so a value is known to within 1/32 (3%) of itself while the whole
+// range from 1 ns to about 18 minutes fits in a fixed 9 KB. Larger values land in the last bucket.
+// Values below 64 ns are counted exactly.
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 5
+#define LATENCY_HISTOGRAM_MAX_SHIFT 34
+#define LATENCY_HISTOGRAM_BUCKETS ((LATENCY_HISTOGRAM_MAX_SHIFT + 2) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t counts[LATENCY_HISTOGRAM_BUCKETS];
+} LatencyHistogram;
+
+extern void latency_histogram_reset(LatencyHistogram *histogram);
+
+// Counts one value. Only one thread may record into a histogram, but any thread may read it
+// with latency_histogram_copy() meanwhile.
+extern void latency_histogram_record(LatencyHistogram *histogram, uint64_t value_ns);
+
+// Snapshot of a histogram another thread may be recording into. Counts recorded during the copy
+// may or may not be included.
+extern void latency_histogram_copy(LatencyHistogram *out, const LatencyHistogram *histogram);
+
+// Removes the counts of an earlier snapshot of the same histogram.
+extern void latency_histogram_subtract(LatencyHistogram *histogram, const LatencyHistogram *earlier);
+
+// Highest value that falls in the same bucket as the value at the given percentile (0 to 100),
+// so the true value is never above it by more than 3%. 0 for an empty histogram.
+extern uint64_t latency_histogram_percentile(const LatencyHistogram *histogram, double percentile);
+
+// Mean of the recorded values, exact rather than bucketed. 0 for an empty histogram.
+extern double latency_histogram_mean(const LatencyHistogram *histogram);
+
+// Writes the percentile distribution in the text format of HdrHistogram's
+// outputPercentileDistribution(), which its plotting tools read. Values are divided by
+// unit_ns, e.g. 1000 for microseconds.
+extern void latency_histogram_write_percentiles(const LatencyHistogram *histogram, FILE *out, double unit_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LATENCY_HISTOGRAM_H
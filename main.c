@@ -1,143 +1,1370 @@
 #include "stream_parser.h"
+#include "crc32.h"
+#include "io_source.h"
+#include "pipeline.h"
+#include "capture.h"
+#include "parallel_parse.h"
+#include "icd_parser.h"
+#include "packet_sink.h"
+#include "packet_pool.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// Big enough to drain a busy socket in one go, small enough to stay in cache
+#define READ_BUFFER_SIZE 65536
+#define MAX_EPOLL_EVENTS 64
+#define DEFAULT_BAUD_RATE 9600
+
+// One input source and the parser that owns its byte stream
+typedef struct {
+    IoSource io;
+    StreamParser *parser;
+    char name[128]; // Source tag printed with every packet, like "tty:/dev/ttyUSB0"
+    uint32_t index; // Position of the source on the command line, tags packets in raw output
+    int record_source; // Id of the source in the --record capture file
+} Stream;
 
 volatile sig_atomic_t keep_running = 1;
+// Set by SIGUSR1, the latency histograms are printed at the next chance
+volatile sig_atomic_t print_latency_requested = 0;
+
+// Everything read goes into this file when recording
+static CaptureWriter *recorder;
+// --latency: every parser keeps latency histograms
+static int keep_latency;
+// --trace: print every byte read
+static int trace_bytes;
+// Every parser the CLI opens, in any mode, is made with this. --max-payload sets its payload limit.
+static StreamParserConfig parser_config;
+// Where the packets go, in the --output-format
+static PacketSink *sink;
+static PacketSinkFormat sink_format;
 
 static void int_handler(const int dummy) {
     (void)dummy;
     keep_running = 0;
 }
 
-static void error_callback(const StreamParserError error, const char *message, void *const error_callback_data) {
-    (void)error_callback_data; // Unused parameter
-    printf("Error [%d]: %s\n", error, message);
-    fflush(stdout);
+static void usr1_handler(const int dummy) {
+    (void)dummy;
+    print_latency_requested = 1;
+}
+
+// Text packets share stdout with the messages, so the buffered ones go out first to keep the order
+static void flush_text_packets() {
+    if (sink && sink_format == PACKET_SINK_TEXT) {
+        packet_sink_flush(sink);
+    }
+}
+
+// Prints a line that comes up while packets are flowing, like an error. Text packets share stdout
+// with it, so it goes through the sink to keep its place among them without flushing them. With the
+// other formats stdout is stderr already.
+static void print_message(const char *const format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if (sink && sink_format == PACKET_SINK_TEXT) {
+        packet_sink_write_message(sink, line, length < (int)sizeof line ? length : (int)sizeof line - 1);
+    } else {
+        fputs(line, stderr);
+    }
+}
+
+static void error_event_callback(const StreamParserErrorEvent *const event, void *const error_event_callback_data) {
+    const Stream *const stream = (const Stream*)error_event_callback_data;
+    char message[512];
+    stream_parser_format_error(stream->parser, event, message, sizeof message);
+    print_message("[%s] Error [%d]: %s\n", stream->name, (int)event->code, message);
+}
+
+// Prints the errors of a stream's parser. Structured events, so nothing is formatted for errors
+// that aren't printed, and a run of bytes that aren't a header is one error, which also lets
+// stream_parser_push_bytes() skip to the next header with memchr(). Quiet runs only count them,
+// in the stats.
+static void report_errors(Stream *const stream) {
+    if (sink_format != PACKET_SINK_QUIET) {
+        stream_parser_register_error_event_callback(stream->parser, error_event_callback, stream);
+    }
+    stream_parser_set_coalesce_header_errors(stream->parser, 1);
+}
+
+// Skipped bytes and rejected packets are normal on a noisy link and come through the error events,
+// so only the codes that mean the call itself went wrong are printed.
+static void check_push_result(const Stream *const stream, const StreamParserError error) {
+    if (error != STREAM_PARSER_OK && error != STREAM_PARSER_HEADER_NOT_FOUND_YET && error != STREAM_PARSER_INVALID_PACKET) {
+        print_message("[%s] Error code returned by stream_parser_push_bytes: %d\n", stream->name, (int)error);
+    }
 }
 
 static void packet_callback(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
-    (void)packet_callback_data; // Unused parameter
+    const Stream *const stream = (const Stream*)packet_callback_data;
+    packet_sink_write(sink, stream->name, stream->index, packet_buffer, packet_size);
+}
+
+// Collects what the parser hands out during the encoder round trip
+typedef struct {
+    uint8_t *data;
+    int64_t length;
+    int64_t packets;
+} RoundTrip;
+
+static void collect_packet(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
+    RoundTrip *const round_trip = (RoundTrip*)packet_callback_data;
+    memcpy(round_trip->data + round_trip->length, packet_buffer, (size_t)packet_size);
+    round_trip->length += packet_size;
+    ++round_trip->packets;
+}
+
+// Frames payloads of awkward sizes with every encoder variant and checks that the parser gives
+// back exactly the same frames, whether fed a byte at a time or in odd sized chunks.
+// Returns the number of failures.
+static int encoder_round_trip() {
+    static const int64_t sizes[] = { 0, 1, 2, 50, 51, 52, 255, 256, 4095, STREAM_PARSER_MAX_PAYLOAD_SIZE };
+    static const uint8_t type[3] = { 'R', 'T', 0x01 };
+    enum { PAYLOADS = sizeof sizes / sizeof sizes[0] };
+    int64_t total = 0;
+    for (int i = 0; i < PAYLOADS; ++i) {
+        total += sizes[i] + STREAM_PARSER_FRAME_OVERHEAD;
+    }
+    uint8_t *const payload = (uint8_t*)malloc(STREAM_PARSER_MAX_PAYLOAD_SIZE);
+    uint8_t *const encoded = (uint8_t*)malloc((size_t)total * 3);
+    RoundTrip round_trip;
+    round_trip.data = (uint8_t*)malloc((size_t)total * 3);
+    StreamParserConfig config = stream_parser_default_config();
+    config.max_payload_size = STREAM_PARSER_MAX_PAYLOAD_SIZE;
+    StreamParser *const parser = stream_parser_open_ex(&config);
+    if (!payload || !encoded || !round_trip.data || !parser) {
+        printf("Encoder round trip: out of memory\n");
+        return 1;
+    }
+    for (int64_t i = 0; i < STREAM_PARSER_MAX_PAYLOAD_SIZE; ++i) {
+        payload[i] = (uint8_t)(i * 131 + (i >> 8));
+    }
+
+    // The same frames three times over: one at a time, gathered from iovecs, and as a batch
+    int64_t length = 0;
+    StreamParserEncodeItem items[PAYLOADS];
+    for (int i = 0; i < PAYLOADS; ++i) {
+        length += stream_parser_encode(type, payload, sizes[i], encoded + length, total * 3 - length);
+
+        StreamParserFrameParts parts;
+        struct iovec iov[3];
+        const int parts_count = stream_parser_encode_iov(type, payload, sizes[i], &parts, iov);
+        for (int part = 0; part < parts_count; ++part) {
+            memcpy(encoded + length, iov[part].iov_base, iov[part].iov_len);
+            length += (int64_t)iov[part].iov_len;
+        }
+
+        memcpy(items[i].type, type, 3);
+        items[i].payload = payload;
+        items[i].payload_size = sizes[i];
+    }
+    size_t batch_encoded = 0;
+    length += stream_parser_encode_batch(items, PAYLOADS, encoded + length, total * 3 - length, &batch_encoded);
+
+    int failures = (length != total * 3 || batch_encoded != PAYLOADS) ? 1 : 0;
+    stream_parser_register_packet_callback(parser, collect_packet, &round_trip);
+    for (int pass = 0; pass < 2; ++pass) {
+        round_trip.length = 0;
+        round_trip.packets = 0;
+        if (pass == 0) {
+            for (int64_t i = 0; i < length; ++i) {
+                stream_parser_push_byte(parser, encoded[i]);
+            }
+        } else {
+            for (int64_t i = 0; i < length; i += 1021) {
+                stream_parser_push_bytes(parser, encoded + i, (length - i < 1021) ? length - i : 1021, NULL);
+            }
+        }
+        if (round_trip.packets != 3 * PAYLOADS || round_trip.length != length || memcmp(round_trip.data, encoded, (size_t)length) != 0) {
+            ++failures;
+        }
+    }
+
+    stream_parser_close(parser);
+    free(round_trip.data);
+    free(encoded);
+    free(payload);
+    return failures;
+}
+
+static void collect_times(const uint8_t *const packet_buffer, int64_t packet_size, const StreamParserPacketTimes *const times, void *const timed_packet_callback_data) {
+    (void)packet_buffer;
+    (void)packet_size;
+    StreamParserPacketTimes *const last = (StreamParserPacketTimes*)timed_packet_callback_data;
+    *last = *times;
+}
+
+// Checks the arrival times the parser hands out for a frame split across pushes and a whole one,
+// and that the latency histograms count them. Returns the number of failures.
+static int packet_times_test() {
+    static const uint8_t type[3] = { 'T', 'M', 0x01 };
+    uint8_t frame[64];
+    const int64_t length = stream_parser_encode(type, (const uint8_t*)"timed", 5, frame, sizeof frame);
+    StreamParser *const parser = stream_parser_open();
+    if (!parser || stream_parser_set_latency_histograms(parser, 1) != STREAM_PARSER_OK) {
+        printf("Packet times: out of memory\n");
+        return 1;
+    }
+    StreamParserPacketTimes times = { 0, 0 };
+    stream_parser_register_timed_packet_callback(parser, collect_times, &times);
+
+    int failures = 0;
+    stream_parser_set_arrival_time(parser, 1000);
+    stream_parser_push_bytes(parser, frame, 3, NULL);
+    stream_parser_set_arrival_time(parser, 5000);
+    stream_parser_push_bytes(parser, frame + 3, length - 3, NULL);
+    failures += (times.first_byte_ns != 1000 || times.last_byte_ns != 5000) ? 1 : 0;
+    stream_parser_set_arrival_time(parser, 7000);
+    stream_parser_push_bytes(parser, frame, length, NULL);
+    failures += (times.first_byte_ns != 7000 || times.last_byte_ns != 7000) ? 1 : 0;
+
+    LatencyHistogram first_to_last;
+    stream_parser_get_latency_histograms(parser, NULL, &first_to_last, 1);
+    const uint64_t slowest = latency_histogram_percentile(&first_to_last, 100);
+    failures += (first_to_last.count != 2 || latency_histogram_percentile(&first_to_last, 50) != 0 || slowest < 4000 || slowest > 4000 * 33 / 32) ? 1 : 0;
+    stream_parser_get_latency_histograms(parser, NULL, &first_to_last, 0);
+    failures += first_to_last.count != 0 ? 1 : 0;
+
+    // Arrival times going backwards are recorded as no wait, not as a wrapped around one
+    stream_parser_set_arrival_time(parser, 9000);
+    stream_parser_push_bytes(parser, frame, 3, NULL);
+    stream_parser_set_arrival_time(parser, 8000);
+    stream_parser_push_bytes(parser, frame + 3, length - 3, NULL);
+    stream_parser_get_latency_histograms(parser, NULL, &first_to_last, 1);
+    failures += (first_to_last.count != 1 || first_to_last.sum_ns != 0) ? 1 : 0;
+
+    stream_parser_close(parser);
+    return failures;
+}
+
+// Runs a stream through a parser a byte at a time, then all at once, and checks that both find the
+// same packets with the same counters, the number of packets expected, and how many of them only
+// rescanning recovered. A parser with rescanning off has to find expected_without_rescan of them.
+// Returns the number of failures.
+static int rescan_case(const uint8_t *const stream, const int64_t length, const int64_t expected_packets,
+                       const uint64_t expected_recovered, const int64_t expected_without_rescan) {
+    uint8_t *const data = (uint8_t*)malloc((size_t)length * 3);
+    if (!data) {
+        printf("Rescanning: out of memory\n");
+        return 1;
+    }
+    RoundTrip round_trip[3];
+    StreamParserStats stats[3];
+    for (int pass = 0; pass < 3; ++pass) {
+        StreamParser *const parser = stream_parser_open();
+        if (!parser) {
+            printf("Rescanning: out of memory\n");
+            free(data);
+            return 1;
+        }
+        round_trip[pass].data = data + pass * length;
+        round_trip[pass].length = 0;
+        round_trip[pass].packets = 0;
+        stream_parser_register_packet_callback(parser, collect_packet, &round_trip[pass]);
+        if (pass == 0) {
+            for (int64_t i = 0; i < length; ++i) {
+                stream_parser_push_byte(parser, stream[i]);
+            }
+        } else {
+            // The last pass is the parser without rescanning
+            stream_parser_set_rescan_rejected(parser, pass == 1);
+            stream_parser_push_bytes(parser, stream, length, NULL);
+        }
+        stream_parser_get_stats(parser, &stats[pass], 0);
+        stream_parser_close(parser);
+    }
+    int failures = 0;
+    if (round_trip[0].packets != round_trip[1].packets || round_trip[0].length != round_trip[1].length ||
+        memcmp(round_trip[0].data, round_trip[1].data, (size_t)round_trip[0].length) != 0 ||
+        stats[0].packets_out != stats[1].packets_out || stats[0].recovered_packets != stats[1].recovered_packets ||
+        stats[0].resyncs != stats[1].resyncs || stats[0].header_skipped_bytes != stats[1].header_skipped_bytes) {
+        ++failures;
+    }
+    failures += (round_trip[0].packets != expected_packets || stats[0].recovered_packets != expected_recovered) ? 1 : 0;
+    failures += (round_trip[2].packets != expected_without_rescan || stats[2].recovered_packets != 0) ? 1 : 0;
+    free(data);
+    return failures;
+}
+
+// Streams whose rejected frames get rescanned, each checked for the same packets and counters
+// whether pushed a byte at a time or all at once, and against a parser that doesn't rescan.
+// Returns the number of failures.
+static int rescan_test() {
+    // "/**/" fails its length, and the rescanned '/' it ends with is followed by a new frame
+    static const uint8_t slash_star[] = {
+        0x2f, 0x2a, 0x2a, 0x2f, 0x2f, 0x2a, 0x06, 0x00, 0x43, 0x78, 0x79, 0xdd, 0xcd, 0xc1, 0xe0, 0x77,
+        0x2f, 0xb7, 0xb3, 0xed, 0x81, 0x2a, 0x2f };
+    int failures = rescan_case(slash_star, sizeof slash_star, 1, 0, 1);
+
+    // A corrupted header claims 20 bytes of payload, swallowing a whole frame and the filler after
+    // it, and fails its trailer. Only rescanning finds the swallowed frame, the next one is found either way.
+    static const uint8_t type[3] = { 'R', 'S', 0x01 };
+    static const uint8_t payload[3] = { 'a', 'b', 'c' };
+    uint8_t swallowing[7 + 2 * (sizeof payload + STREAM_PARSER_FRAME_OVERHEAD) + 10] = { 0x2f, 0x2a, 20, 0x00, 'X', 'X', 'X' };
+    int64_t length = 7;
+    length += stream_parser_encode(type, payload, sizeof payload, swallowing + length, (int64_t)sizeof swallowing - length);
+    length += 10; // Zeros up to where the swallowing frame's trailer should be
+    length += stream_parser_encode(type, payload, sizeof payload, swallowing + length, (int64_t)sizeof swallowing - length);
+    failures += rescan_case(swallowing, length, 2, 1, 1);
+    return failures;
+}
+
+static void count_handled(const uint8_t *const packet_buffer, int64_t packet_size, void *const handled) {
+    (void)packet_buffer;
+    (void)packet_size;
+    ++*(int*)handled;
+}
+
+// Collects the error events of the type dispatch test, one for every byte that isn't a header
+typedef struct {
+    StreamParserErrorEvent events[1024];
+    int count;
+} ErrorEvents;
+
+static void collect_error_event(const StreamParserErrorEvent *const event, void *const error_event_callback_data) {
+    ErrorEvents *const errors = (ErrorEvents*)error_event_callback_data;
+    if (errors->count < (int)(sizeof errors->events / sizeof errors->events[0])) {
+        errors->events[errors->count] = *event;
+    }
+    ++errors->count;
+}
+
+// Type handlers registered out of order, up to STREAM_PARSER_MAX_TYPE_HANDLERS, some removed again,
+// and the default handler, each checked to get exactly its own packets. Then unknown types rejected
+// as soon as their type bytes are in, with the same events and counters whether the stream is pushed
+// a byte at a time or all at once. Returns the number of failures.
+static int type_dispatch_test() {
+    enum { TYPES = STREAM_PARSER_MAX_TYPE_HANDLERS };
+    static const uint8_t payload[3] = { 'a', 'b', 'c' };
+    static const uint8_t unknown_type[3] = { 'U', 'U', 'U' };
+    uint8_t types[TYPES + 1][3];
+    uint8_t stream[(TYPES + 2) * (sizeof payload + STREAM_PARSER_FRAME_OVERHEAD)];
+    int64_t length = 0;
+    for (int i = 0; i <= TYPES; ++i) {
+        types[i][0] = 'T';
+        types[i][1] = (uint8_t)i;
+        types[i][2] = 0x80;
+        length += stream_parser_encode(types[i], payload, sizeof payload, stream + length, (int64_t)sizeof stream - length);
+    }
+    length += stream_parser_encode(unknown_type, payload, sizeof payload, stream + length, (int64_t)sizeof stream - length);
+
+    StreamParser *const parser = stream_parser_open();
+    if (!parser) {
+        printf("Type dispatch: out of memory\n");
+        return 1;
+    }
+    int failures = 0;
+    // handled[TYPES] counts the default handler's packets
+    int handled[TYPES + 1] = { 0 };
+    // 13 is odd, so this visits every type once, in an order that isn't sorted
+    for (int i = 0; i < TYPES; ++i) {
+        const int type = (i * 13) % TYPES;
+        failures += stream_parser_register_type_handler(parser, types[type], count_handled, &handled[type]) != STREAM_PARSER_OK ? 1 : 0;
+    }
+    // Full: a new type doesn't fit, replacing a handler still works
+    failures += stream_parser_register_type_handler(parser, types[TYPES], count_handled, &handled[TYPES]) != STREAM_PARSER_INVALID_ARG ? 1 : 0;
+    failures += stream_parser_register_type_handler(parser, types[5], count_handled, &handled[5]) != STREAM_PARSER_OK ? 1 : 0;
+    // Removing the largest keys and the smallest one leaves stale keys behind unless they're padded again
+    for (int type = TYPES - 3; type < TYPES; ++type) {
+        stream_parser_register_type_handler(parser, types[type], NULL, NULL);
+    }
+    stream_parser_register_type_handler(parser, types[0], NULL, NULL);
+    stream_parser_register_type_handler(parser, types[0], count_handled, &handled[0]);
+    stream_parser_register_default_type_handler(parser, count_handled, &handled[TYPES]);
+
+    for (int64_t i = 0; i < length; ++i) {
+        stream_parser_push_byte(parser, stream[i]);
+    }
+    stream_parser_push_bytes(parser, stream, length, NULL);
+    stream_parser_close(parser);
+    for (int type = 0; type < TYPES; ++type) {
+        failures += handled[type] != (type < TYPES - 3 ? 2 : 0) ? 1 : 0;
+    }
+    // The removed types, the one that never fit and the unknown one, on both passes
+    failures += handled[TYPES] != 2 * 5 ? 1 : 0;
 
-    printf("Received packet with length %lld bytes and contents: [", (long long)packet_size);
-    for (int64_t i = 0; i < packet_size; ++i) {
-        printf(" 0x%02x", packet_buffer[i]);
-        if (i < packet_size - 1) {
-            printf(",");
+    // Only the first two types are wanted, so everything else is rejected in STATE_TYPE
+    static ErrorEvents errors[2];
+    StreamParserStats stats[2];
+    int wanted[2][2] = { { 0, 0 }, { 0, 0 } };
+    for (int pass = 0; pass < 2; ++pass) {
+        StreamParser *const rejecting = stream_parser_open();
+        if (!rejecting) {
+            printf("Type dispatch: out of memory\n");
+            return failures + 1;
         }
+        errors[pass].count = 0;
+        stream_parser_register_type_handler(rejecting, types[0], count_handled, &wanted[pass][0]);
+        stream_parser_register_type_handler(rejecting, types[1], count_handled, &wanted[pass][1]);
+        stream_parser_set_reject_unknown_types(rejecting, 1);
+        stream_parser_register_error_event_callback(rejecting, collect_error_event, &errors[pass]);
+        if (pass == 0) {
+            for (int64_t i = 0; i < length; ++i) {
+                stream_parser_push_byte(rejecting, stream[i]);
+            }
+        } else {
+            stream_parser_push_bytes(rejecting, stream, length, NULL);
+        }
+        stream_parser_get_stats(rejecting, &stats[pass], 0);
+        stream_parser_close(rejecting);
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        failures += (wanted[pass][0] != 1 || wanted[pass][1] != 1 || stats[pass].packets_out != 2 ||
+                     stats[pass].type_rejects != TYPES) ? 1 : 0;
+    }
+    failures += errors[0].count != errors[1].count ? 1 : 0;
+    int type_events = 0;
+    for (int i = 0; i < errors[0].count && i < errors[1].count && i < (int)(sizeof errors[0].events / sizeof errors[0].events[0]); ++i) {
+        const StreamParserErrorEvent *const byte_event = &errors[0].events[i];
+        const StreamParserErrorEvent *const bulk_event = &errors[1].events[i];
+        failures += (byte_event->code != bulk_event->code || byte_event->reason != bulk_event->reason ||
+                     byte_event->state != bulk_event->state || byte_event->byte != bulk_event->byte ||
+                     byte_event->buffer_index != bulk_event->buffer_index || byte_event->skipped_bytes != bulk_event->skipped_bytes) ? 1 : 0;
+        if (byte_event->reason == STREAM_PARSER_REASON_UNKNOWN_TYPE) {
+            failures += (byte_event->code != STREAM_PARSER_INVALID_PACKET || byte_event->state != STREAM_PARSER_STATE_TYPE) ? 1 : 0;
+            ++type_events;
+        }
+    }
+    failures += type_events != TYPES ? 1 : 0;
+    return failures;
+}
+
+// Copies a packet into the pool and publishes it with one reference kept, like a parser callback
+// handing the packet to another thread. Returns 0 on success, -1 if it was dropped.
+static int pool_hand_off(PacketPool *const pool, const uint8_t value, PacketPoolRef *const ref) {
+    const uint8_t packet[4] = { value, value, value, value };
+    if (packet_pool_acquire(pool, packet, sizeof packet, ref) != 0) {
+        return -1;
+    }
+    packet_pool_retain(*ref);
+    packet_pool_publish(*ref);
+    return 0;
+}
+
+static int pool_holds(const PacketPoolRef ref, const uint8_t value) {
+    int64_t size = 0;
+    const uint8_t *const data = packet_pool_data(ref, &size);
+    return size == 4 && data[0] == value && data[3] == value;
+}
+
+static void *pool_release_later(void *const arg) {
+    const struct timespec delay = { 0, 20 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+    packet_pool_release(*(const PacketPoolRef*)arg);
+    return NULL;
+}
+
+// Stale handles, PACKET_POOL_DROP_OLDEST stealing the oldest unclaimed packet and never a claimed
+// one, and PACKET_POOL_BLOCK waking up when a slot is released. Returns the number of failures.
+static int packet_pool_test() {
+    PacketPoolConfig config = packet_pool_default_config(4);
+    config.slot_count = 3;
+    config.exhaustion = PACKET_POOL_DROP_OLDEST;
+    PacketPool *pool = packet_pool_open(&config);
+    if (!pool) {
+        printf("Packet pool: out of memory\n");
+        return 1;
+    }
+    int failures = 0;
+    PacketPoolRef refs[6];
+    PacketPoolStats stats;
+
+    // Released for good: the handle goes stale, and the slot is free again
+    failures += pool_hand_off(pool, 1, &refs[0]) != 0 ? 1 : 0;
+    packet_pool_release(refs[0]);
+    failures += (packet_pool_retain(refs[0]) != -1 || packet_pool_claim(refs[0]) != -1) ? 1 : 0;
+    packet_pool_release(refs[0]);
+    packet_pool_get_stats(pool, &stats);
+    failures += stats.in_use != 0 ? 1 : 0;
+
+    // The oldest unclaimed packet goes first, claimed ones stay
+    failures += (pool_hand_off(pool, 2, &refs[1]) != 0 || pool_hand_off(pool, 3, &refs[2]) != 0 ||
+                 pool_hand_off(pool, 4, &refs[3]) != 0) ? 1 : 0;
+    failures += packet_pool_claim(refs[1]) != 0 ? 1 : 0;
+    failures += pool_hand_off(pool, 5, &refs[4]) != 0 ? 1 : 0;
+    failures += (packet_pool_claim(refs[2]) != -1 || packet_pool_claim(refs[3]) != 0 || packet_pool_claim(refs[4]) != 0) ? 1 : 0;
+    failures += (!pool_holds(refs[1], 2) || !pool_holds(refs[3], 4) || !pool_holds(refs[4], 5)) ? 1 : 0;
+    // Every packet is claimed, so the new one is dropped instead
+    failures += pool_hand_off(pool, 6, &refs[5]) != -1 ? 1 : 0;
+    packet_pool_get_stats(pool, &stats);
+    failures += (stats.dropped_oldest != 1 || stats.dropped_newest != 1 || stats.in_use != 3) ? 1 : 0;
+    packet_pool_release(refs[1]);
+    packet_pool_release(refs[3]);
+    packet_pool_release(refs[4]);
+    packet_pool_close(pool);
+
+    // The producer waits for the only slot until another thread releases it
+    config.slot_count = 1;
+    config.exhaustion = PACKET_POOL_BLOCK;
+    pool = packet_pool_open(&config);
+    if (!pool) {
+        printf("Packet pool: out of memory\n");
+        return failures + 1;
+    }
+    pthread_t releaser;
+    failures += pool_hand_off(pool, 7, &refs[0]) != 0 ? 1 : 0;
+    if (pthread_create(&releaser, NULL, pool_release_later, &refs[0]) != 0) {
+        packet_pool_close(pool);
+        return failures + 1;
+    }
+    failures += (pool_hand_off(pool, 8, &refs[1]) != 0 || !pool_holds(refs[1], 8)) ? 1 : 0;
+    pthread_join(releaser, NULL);
+    packet_pool_get_stats(pool, &stats);
+    failures += (stats.blocked != 1 || stats.in_use != 1 || packet_pool_claim(refs[0]) != -1) ? 1 : 0;
+    packet_pool_release(refs[1]);
+    packet_pool_close(pool);
+    return failures;
+}
+
+typedef void (*IcdPush)(void *parser, const uint8_t *bytes, int64_t length);
+
+// Frames payloads of a few sizes in an ICD, each behind a stray header byte and a copy with a bad
+// checksum, and checks that the generated parser gives back exactly the good frames, whether fed a
+// byte at a time or all at once. core is the parser's, push its push function.
+// Returns the number of failures.
+static int icd_round_trip(const IcdDescriptor *const icd, IcdParserCore *const core, void *const parser, const IcdPush push) {
+    const int64_t largest = icd->max_payload_size < 70000 ? icd->max_payload_size : 70000;
+    const int64_t sizes[] = { 0, 1, 50, largest };
+    enum { PAYLOADS = sizeof sizes / sizeof sizes[0] };
+    static const uint8_t type[4] = { 'R', 'T', 0x01, 0x02 };
+    const int64_t capacity = 2 * PAYLOADS * (largest + icd_overhead(icd) + 1);
+    uint8_t *const payload = (uint8_t*)malloc((size_t)largest);
+    uint8_t *const stream = (uint8_t*)malloc((size_t)capacity);
+    uint8_t *const expected = (uint8_t*)malloc((size_t)capacity);
+    RoundTrip round_trip;
+    round_trip.data = (uint8_t*)malloc((size_t)capacity);
+    if (!payload || !stream || !expected || !round_trip.data) {
+        printf("ICD descriptors: out of memory\n");
+        return 1;
+    }
+    for (int64_t i = 0; i < largest; ++i) {
+        payload[i] = (uint8_t)(i * 131 + (i >> 8));
+    }
+
+    int failures = 0;
+    int64_t length = 0;
+    int64_t expected_length = 0;
+    for (int i = 0; i < PAYLOADS; ++i) {
+        stream[length++] = icd->header[0];
+        const int64_t frame_length = icd_encode(icd, type, payload, sizes[i], stream + length, capacity - length);
+        memcpy(stream + length + frame_length, stream + length, (size_t)frame_length);
+        stream[length + frame_length - 3] ^= 0x40; // Inside the checksum
+        memcpy(expected + expected_length, stream + length + frame_length, (size_t)frame_length);
+        length += 2 * frame_length;
+        expected_length += frame_length;
     }
-    printf(" ]\n");
+    if (icd == &icd_stream_descriptor) {
+        // Both encoders write the same frame for stream_parser's ICD
+        uint8_t *const frame = (uint8_t*)malloc((size_t)(largest + STREAM_PARSER_FRAME_OVERHEAD));
+        const int64_t frame_length = frame ? stream_parser_encode(type, payload, largest, frame, largest + STREAM_PARSER_FRAME_OVERHEAD) : -1;
+        failures += (frame_length < 0 || memcmp(frame, expected + expected_length - frame_length, (size_t)frame_length) != 0) ? 1 : 0;
+        free(frame);
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        round_trip.length = 0;
+        round_trip.packets = 0;
+        icd_parser_core_init(core, collect_packet, &round_trip);
+        if (pass == 0) {
+            for (int64_t i = 0; i < length; ++i) {
+                push(parser, stream + i, 1);
+            }
+        } else {
+            push(parser, stream, length);
+        }
+        if (round_trip.packets != PAYLOADS || round_trip.length != expected_length ||
+            memcmp(round_trip.data, expected, (size_t)expected_length) != 0 || core->rejects != PAYLOADS) {
+            ++failures;
+        }
+    }
+
+    free(round_trip.data);
+    free(expected);
+    free(stream);
+    free(payload);
+    return failures;
+}
+
+#define ICD_ROUND_TRIP(name, ...) \
+    static void name##_push(void *const parser, const uint8_t *const bytes, const int64_t length) { \
+        name##_parser_push((name##_parser*)parser, bytes, length); \
+    } \
+    static int name##_round_trip() { \
+        name##_parser *const parser = (name##_parser*)malloc(sizeof(name##_parser)); \
+        if (!parser) { \
+            printf("ICD descriptors: out of memory\n"); \
+            return 1; \
+        } \
+        const int failures = icd_round_trip(&name##_descriptor, &parser->core, parser, name##_push); \
+        free(parser); \
+        return failures; \
+    }
+ICD_DESCRIPTORS(ICD_ROUND_TRIP)
+#undef ICD_ROUND_TRIP
+
+// Verifies every CRC32 backend this CPU supports against the reference implementation,
+// the encoder against the parser, the packet arrival times, rescanning, type dispatch, the packet
+// pool, and the parser of every ICD.
+static int run_self_test() {
+    printf("CRC32 backend in use: %s\n", crc32_backend_name(crc32_active_backend()));
+    for (int backend = 0; backend < CRC32_BACKEND_COUNT; ++backend) {
+        printf("  %-8s %s\n", crc32_backend_name((CRC32_Backend)backend),
+               crc32_backend_supported((CRC32_Backend)backend) ? "supported" : "not supported");
+    }
+    const int failures = crc32_self_test();
+    printf("CRC32 self test: %s\n", failures == 0 ? "PASSED" : "FAILED");
+    const int round_trip_failures = encoder_round_trip();
+    printf("Encoder round trip: %s\n", round_trip_failures == 0 ? "PASSED" : "FAILED");
+    const int times_failures = packet_times_test();
+    printf("Packet times: %s\n", times_failures == 0 ? "PASSED" : "FAILED");
+    const int rescan_failures = rescan_test();
+    printf("Rescanning: %s\n", rescan_failures == 0 ? "PASSED" : "FAILED");
+    const int dispatch_failures = type_dispatch_test();
+    printf("Type dispatch: %s\n", dispatch_failures == 0 ? "PASSED" : "FAILED");
+    const int pool_failures = packet_pool_test();
+    printf("Packet pool: %s\n", pool_failures == 0 ? "PASSED" : "FAILED");
+#define ICD_RUN_ROUND_TRIP(name, ...) + name##_round_trip()
+    const int icd_failures = 0 ICD_DESCRIPTORS(ICD_RUN_ROUND_TRIP);
+#undef ICD_RUN_ROUND_TRIP
+    printf("ICD descriptors: %s\n", icd_failures == 0 ? "PASSED" : "FAILED");
     fflush(stdout);
+    return (failures == 0 && round_trip_failures == 0 && times_failures == 0 && rescan_failures == 0 && dispatch_failures == 0 && pool_failures == 0 && icd_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int main(int argc, char *argv[]) {
-    char *port = NULL;
+static double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
 
-    // Iterate through command line arguments to find the --port argument
-    for (int i = 1; i < argc - 1; i++) {
-        if (strcmp(argv[i], "--port") == 0) {
-            port = argv[i + 1];
+// Prints the parser counters accumulated over the last interval as rates.
+static void print_stats(const Stream *const stream, const double elapsed) {
+    StreamParserStats stats;
+    if (stream_parser_get_stats(stream->parser, &stats, 1) != STREAM_PARSER_OK || elapsed <= 0) {
+        return;
+    }
+    flush_text_packets();
+    printf("[%s] Stats: in %.0f B/s, out %.1f packets/s (%.0f B/s), skipped %.0f B/s, "
+           "rejects: length %llu, crc %llu, trailer %llu, type %llu, resyncs %llu, recovered %llu\n",
+           stream->name, stats.bytes_in / elapsed, stats.packets_out / elapsed, stats.bytes_out / elapsed,
+           stats.header_skipped_bytes / elapsed,
+           (unsigned long long)stats.length_rejects, (unsigned long long)stats.crc_mismatches,
+           (unsigned long long)stats.trailer_failures, (unsigned long long)stats.type_rejects,
+           (unsigned long long)stats.resyncs, (unsigned long long)stats.recovered_packets);
+    LatencyHistogram arrival_to_callback;
+    LatencyHistogram first_to_last;
+    if (stream_parser_get_latency_histograms(stream->parser, &arrival_to_callback, &first_to_last, 1) == STREAM_PARSER_OK) {
+        printf("  latency us: arrival to callback p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f; first to last byte p50 %.1f, p99 %.1f, max %.1f\n",
+               latency_histogram_percentile(&arrival_to_callback, 50) / 1e3, latency_histogram_percentile(&arrival_to_callback, 99) / 1e3,
+               latency_histogram_percentile(&arrival_to_callback, 99.9) / 1e3, latency_histogram_percentile(&arrival_to_callback, 100) / 1e3,
+               latency_histogram_percentile(&first_to_last, 50) / 1e3, latency_histogram_percentile(&first_to_last, 99) / 1e3,
+               latency_histogram_percentile(&first_to_last, 100) / 1e3);
+    }
+    StreamParserCycleCounts cycles;
+    if (stream_parser_get_cycle_counts(stream->parser, &cycles, 1) == STREAM_PARSER_OK) {
+        // Only in make profile builds
+        uint64_t total = cycles.callback_cycles;
+        for (int state = 0; state < STREAM_PARSER_STATE_COUNT; ++state) {
+            total += cycles.state_cycles[state];
+        }
+        const double share = total ? 100.0 / (double)total : 0.0;
+        printf("  cycles: %.0f/s, find header %.1f%%, length %.1f%%, type %.1f%%, body %.1f%%, checksum %.1f%%, trailer %.1f%%, callbacks %.1f%%\n",
+               total / elapsed, cycles.state_cycles[STREAM_PARSER_STATE_FIND_HEADER] * share,
+               cycles.state_cycles[STREAM_PARSER_STATE_LENGTH] * share, cycles.state_cycles[STREAM_PARSER_STATE_TYPE] * share,
+               cycles.state_cycles[STREAM_PARSER_STATE_BODY] * share, cycles.state_cycles[STREAM_PARSER_STATE_CHECKSUM] * share,
+               cycles.state_cycles[STREAM_PARSER_STATE_FIND_TRAILER] * share, cycles.callback_cycles * share);
+    }
+    for (uint32_t i = 0; i < stats.type_count; ++i) {
+        printf("  type %02x %02x %02x: %.1f packets/s\n", stats.types[i].type[0], stats.types[i].type[1],
+               stats.types[i].type[2], stats.types[i].packets / elapsed);
+    }
+    if (stats.other_type_packets) {
+        printf("  other types: %.1f packets/s\n", stats.other_type_packets / elapsed);
+    }
+    fflush(stdout);
+}
+
+static void usage() {
+    printf("Usage: program_name [sources...] [--baud <rate>] [--stats-interval <seconds>] [--latency] [output options]\n");
+    printf("Sources (each may be given several times, at least one is required):\n");
+    printf("  --port <tty>              serial port\n");
+    printf("  --tcp <host:port>         TCP connection\n");
+    printf("  --udp <[host:]port>       UDP socket to receive datagrams on\n");
+    printf("  --unix <path>             Unix stream socket\n");
+    printf("  --fifo <path>             named pipe\n");
+    printf("--baud applies to all serial ports (default %d)\n", DEFAULT_BAUD_RATE);
+    printf("--latency keeps latency histograms, summarized with the stats and printed in full on SIGUSR1 and at exit\n");
+    printf("--max-payload <n> is the largest payload accepted, in every mode, up to %d (default %d)\n",
+           STREAM_PARSER_MAX_PAYLOAD_SIZE, STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE);
+    printf("Output, in every mode:\n");
+    printf("  --output-format <format>  text (default), raw (uint32 length, uint32 source index, frame), jsonl or quiet;\n");
+    printf("                            with raw and jsonl everything else goes to stderr\n");
+    printf("  --flush-interval <s>      longest time packets, and bytes being recorded, wait in their buffers (default %g)\n", PACKET_SINK_DEFAULT_FLUSH_INTERVAL);
+    printf("  --trace                   print every byte read\n");
+    printf("Pipelined mode, reading, parsing and printing on separate threads:\n");
+    printf("  --io-threads <n>          threads reading the sources (default 1)\n");
+    printf("  --workers <n>             threads running the parsers (default 1)\n");
+    printf("  --pin-cpus <a,b,...>      pin the I/O threads, then the workers, then the sink to these CPUs\n");
+    printf("  --packet-slots <n>        packets that can wait for the printing thread (default 1024)\n");
+    printf("  --when-full <policy>      drop-newest, drop-oldest (default) or block when they're all taken\n");
+    printf("Recording and replaying:\n");
+    printf("  --record <file>           also write everything read to a capture file\n");
+    printf("       program_name --replay <file> [--replay-speed <factor>] [--stats-interval <seconds>]\n");
+    printf("                            parse a capture file, as fast as possible or at factor times the recorded pace\n");
+    printf("       program_name --parse-file <file> [--threads <n>]\n");
+    printf("                            parse a raw dump on n threads (default: one per CPU), same output as one parser\n");
+    printf("       program_name --self-test\n");
+    fflush(stdout);
+}
+
+// Prints a stream's latency histograms in full, as collected since the last stats line.
+static void print_latency(const Stream *const stream) {
+    LatencyHistogram arrival_to_callback;
+    LatencyHistogram first_to_last;
+    if (stream_parser_get_latency_histograms(stream->parser, &arrival_to_callback, &first_to_last, 0) != STREAM_PARSER_OK) {
+        return;
+    }
+    flush_text_packets();
+    printf("[%s] Latency from arrival of the last byte to the packet callback, in microseconds:\n", stream->name);
+    latency_histogram_write_percentiles(&arrival_to_callback, stdout, 1e3);
+    printf("[%s] Latency from arrival of the first byte to arrival of the last, in microseconds:\n", stream->name);
+    latency_histogram_write_percentiles(&first_to_last, stdout, 1e3);
+    fflush(stdout);
+}
+
+// Reads once from a ready source and runs the bytes through its parser.
+// Returns -1 once the source is gone.
+static int service_stream(Stream *const stream, uint8_t *const buffer) {
+    uint64_t arrival_ns = 0;
+    const ssize_t n = io_source_read(&stream->io, buffer, READ_BUFFER_SIZE, &arrival_ns);
+    if (n < 0) {
+        return -1;
+    }
+    if (recorder && n > 0) {
+        capture_writer_write(recorder, stream->record_source, arrival_ns, buffer, n);
+    }
+    if (trace_bytes) {
+        flush_text_packets();
+        for (ssize_t i = 0; i < n; ++i) {
+            printf("[%s] Processing byte... : %c  0x%x\n", stream->name, (char)buffer[i], (int)buffer[i]);
+        }
+        fflush(stdout);
+    }
+    if (n > 0) {
+        stream_parser_set_arrival_time(stream->parser, arrival_ns);
+        check_push_result(stream, stream_parser_push_bytes(stream->parser, buffer, n, NULL));
+    }
+    return 0;
+}
+
+static Stream *pipeline_streams;
+
+static void sink_callback(const int source_index, const uint8_t *const packet_buffer, int64_t packet_size, void *const sink_callback_data) {
+    (void)sink_callback_data; // Unused parameter
+    packet_callback(packet_buffer, packet_size, &pipeline_streams[source_index]);
+}
+
+static void print_pipeline_stats(Pipeline *const pipeline, const double elapsed, PipelineStageStats *const last) {
+    static const char *const stage_names[] = { "io", "worker", "sink" };
+    int slot = 0;
+    for (int stage = PIPELINE_STAGE_IO; stage <= PIPELINE_STAGE_SINK; ++stage) {
+        for (int index = 0; index < pipeline_stage_threads(pipeline, (PipelineStage)stage); ++index, ++slot) {
+            PipelineStageStats stats;
+            pipeline_get_stage_stats(pipeline, (PipelineStage)stage, index, &stats);
+            printf("Stage %s %d: %.0f items/s (%.0f B/s), stalls %llu, queued %lld, peak queue %lld\n",
+                   stage_names[stage], index, (stats.items - last[slot].items) / elapsed, (stats.bytes - last[slot].bytes) / elapsed,
+                   (unsigned long long)(stats.stalls - last[slot].stalls), (long long)stats.queue_depth, (long long)stats.peak_queue_depth);
+            last[slot] = stats;
+        }
+    }
+    PacketPoolStats pool;
+    pipeline_get_pool_stats(pipeline, &pool);
+    printf("Packet pool: in use %lld (peak %lld), dropped %llu newest %llu oldest, blocked %llu\n",
+           (long long)pool.in_use, (long long)pool.peak_in_use, (unsigned long long)pool.dropped_newest,
+           (unsigned long long)pool.dropped_oldest, (unsigned long long)pool.blocked);
+    fflush(stdout);
+}
+
+// Runs the sources through a Pipeline until they all close or we're interrupted.
+static int run_pipeline(Stream *const streams, const int stream_count, const PipelineConfig *const config, const double stats_interval) {
+    IoSource **const sources = (IoSource**)calloc((size_t)stream_count, sizeof(IoSource*));
+    PipelineStageStats *const last = (PipelineStageStats*)calloc((size_t)(config->io_threads + config->workers + 1), sizeof(PipelineStageStats));
+    if (!sources || !last) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < stream_count; ++i) {
+        sources[i] = &streams[i].io;
+    }
+    pipeline_streams = streams;
+    Pipeline *const pipeline = pipeline_open(config, sources, stream_count, sink_callback, NULL);
+    if (!pipeline) {
+        printf("Failed to set up the pipeline\n");
+        fflush(stdout);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < stream_count; ++i) {
+        streams[i].parser = pipeline_parser(pipeline, i);
+        report_errors(&streams[i]);
+        if (keep_latency) {
+            stream_parser_set_latency_histograms(streams[i].parser, 1);
+        }
+    }
+    // The "Listening on" lines go out before the packets and errors, which take the sink's buffer
+    fflush(stdout);
+    if (pipeline_start(pipeline) != 0) {
+        printf("Failed to start the pipeline threads\n");
+        fflush(stdout);
+        return EXIT_FAILURE;
+    }
+
+    double last_stats_time = monotonic_seconds();
+    while (keep_running && pipeline_running(pipeline)) {
+        const struct timespec tick = { 0, 50 * 1000 * 1000 };
+        nanosleep(&tick, NULL);
+        packet_sink_flush_if_due(sink);
+        if (print_latency_requested) {
+            print_latency_requested = 0;
+            for (int i = 0; i < stream_count; ++i) {
+                print_latency(&streams[i]);
+            }
+        }
+        const double now = monotonic_seconds();
+        if (stats_interval > 0 && now - last_stats_time >= stats_interval) {
+            for (int i = 0; i < stream_count; ++i) {
+                print_stats(&streams[i], now - last_stats_time);
+            }
+            print_pipeline_stats(pipeline, now - last_stats_time, last);
+            last_stats_time = now;
+        }
+    }
+
+    for (int i = 0; i < stream_count && keep_latency; ++i) {
+        print_latency(&streams[i]);
+    }
+    pipeline_close(pipeline);
+    flush_text_packets();
+    for (int i = 0; i < stream_count; ++i) {
+        io_source_close(&streams[i].io);
+    }
+    free(last);
+    free(sources);
+    printf("Exiting\n");
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+// Parses a capture file with one parser per recorded source, as fast as possible for speed 0,
+// otherwise at speed times the recorded pace.
+static int run_replay(const char *const path, const double speed, const double stats_interval) {
+    CaptureReader *const reader = capture_reader_open(path);
+    if (!reader) {
+        fflush(stdout);
+        return EXIT_FAILURE;
+    }
+    // Pointers, since the callbacks hold on to their Stream while the array grows
+    Stream **streams = NULL;
+    uint32_t stream_capacity = 0;
+    int result = EXIT_SUCCESS;
+    int64_t bytes = 0;
+    int64_t chunks = 0;
+    const double start = monotonic_seconds();
+    double last_stats_time = start;
+    CaptureRecord record;
+    int status = 0;
+    while (keep_running && (status = capture_reader_next(reader, &record)) == 1) {
+        if (record.type == CAPTURE_RECORD_SOURCE) {
+            if (record.source >= stream_capacity) {
+                // The reader keeps ids below CAPTURE_MAX_SOURCES, so this can't wrap
+                const uint32_t capacity = record.source + 16;
+                Stream **const grown = (Stream**)realloc(streams, capacity * sizeof(Stream*));
+                if (!grown) {
+                    printf("Out of memory\n");
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                memset(grown + stream_capacity, 0, (capacity - stream_capacity) * sizeof(Stream*));
+                streams = grown;
+                stream_capacity = capacity;
+            }
+            if (streams[record.source]) {
+                continue;
+            }
+            Stream *const stream = (Stream*)calloc(1, sizeof(Stream));
+            if (stream) {
+                stream->io.fd = -1;
+                stream->index = record.source;
+                stream->parser = stream_parser_open_ex(&parser_config);
+            }
+            if (!stream || !stream->parser) {
+                printf("Failed to open stream parser\n");
+                free(stream);
+                result = EXIT_FAILURE;
+                break;
+            }
+            snprintf(stream->name, sizeof stream->name, "%s", (const char*)record.data);
+            report_errors(stream);
+            stream_parser_register_packet_callback(stream->parser, packet_callback, stream);
+            streams[record.source] = stream;
+            printf("Replaying %s\n", stream->name);
+            fflush(stdout);
+            continue;
+        }
+
+        if (record.source >= stream_capacity || !streams[record.source]) {
+            printf("Error: %s has data for undeclared source %u\n", path, (unsigned)record.source);
+            result = EXIT_FAILURE;
             break;
         }
+        if (speed > 0) {
+            const double wait = start + (double)record.timestamp_ns / 1e9 / speed - monotonic_seconds();
+            if (wait > 0) {
+                const struct timespec delay = { (time_t)wait, (long)((wait - (double)(time_t)wait) * 1e9) };
+                nanosleep(&delay, NULL);
+            }
+        }
+        // Straight from the mapping, packets delivered in place point into the file
+        Stream *const stream = streams[record.source];
+        check_push_result(stream, stream_parser_push_bytes(stream->parser, record.data, record.length, NULL));
+        bytes += record.length;
+        ++chunks;
+        if (speed > 0) {
+            packet_sink_flush_if_due(sink);
+        }
+
+        if (stats_interval > 0) {
+            const double now = monotonic_seconds();
+            if (now - last_stats_time >= stats_interval) {
+                for (uint32_t i = 0; i < stream_capacity; ++i) {
+                    if (streams[i]) {
+                        print_stats(streams[i], now - last_stats_time);
+                    }
+                }
+                last_stats_time = now;
+            }
+        }
+    }
+    if (status < 0) {
+        printf("Warning: %s ends with a damaged or partial record\n", path);
     }
 
-    // Check if the port argument was provided
-    if (port != NULL) {
-        printf("Listening on serial port: %s\n", port);
-    } else {
-        printf("Error: Please specify the serial port using the --port argument.\n");
-        printf("Usage: program_name --port <port_name>\n");
+    const double elapsed = monotonic_seconds() - start;
+    flush_text_packets();
+    printf("Replayed %lld bytes in %lld chunks in %.3f s (%.1f MB/s)\n", (long long)bytes, (long long)chunks,
+           elapsed, elapsed > 0 ? (double)bytes / elapsed / 1e6 : 0.0);
+    // Quiet runs print no errors, so the counts of what was rejected since the last stats go out here
+    if (sink_format == PACKET_SINK_QUIET) {
+        const double now = monotonic_seconds();
+        for (uint32_t i = 0; i < stream_capacity; ++i) {
+            if (streams[i]) {
+                print_stats(streams[i], now - last_stats_time);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < stream_capacity; ++i) {
+        if (streams[i]) {
+            stream_parser_close(streams[i]->parser);
+            free(streams[i]);
+        }
+    }
+    free(streams);
+    capture_reader_close(reader);
+    printf("Exiting\n");
+    fflush(stdout);
+    return result;
+}
+
+// Parses a raw byte dump on several threads, printing packets exactly as a live run would.
+static int run_parse_file(const char *const path, const int threads) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("Error %i opening %s: %s\n", errno, path, strerror(errno));
         fflush(stdout);
         return EXIT_FAILURE;
     }
+    const uint8_t *data = NULL;
+    if (info.st_size > 0) {
+        void *const mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            printf("Error %i mapping %s: %s\n", errno, path, strerror(errno));
+            close(fd);
+            fflush(stdout);
+            return EXIT_FAILURE;
+        }
+        madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+        data = (const uint8_t*)mapping;
+    }
+    close(fd);
+
+    Stream stream;
+    memset(&stream, 0, sizeof stream);
+    stream.io.fd = -1;
+    snprintf(stream.name, sizeof stream.name, "file:%s", path);
+    ParallelParseConfig config = parallel_parse_default_config();
+    config.threads = threads;
+    config.parser = parser_config;
+    ParallelParseStats stats;
+    const double start = monotonic_seconds();
+    const int result = parallel_parse(&config, data, (int64_t)info.st_size, packet_callback, &stream, &stats);
+    const double elapsed = monotonic_seconds() - start;
+    flush_text_packets();
+    if (result != 0) {
+        printf("Failed to parse %s\n", path);
+    } else {
+        printf("Parsed %lld bytes in %lld chunks in %.3f s (%.1f MB/s): %lld packets, %lld bytes parsed twice at chunk boundaries\n",
+               (long long)stats.bytes, (long long)stats.chunks, elapsed, elapsed > 0 ? (double)stats.bytes / elapsed / 1e6 : 0.0,
+               (long long)stats.packets, (long long)stats.reparsed_bytes);
+    }
+    if (data) {
+        munmap((void*)data, (size_t)info.st_size);
+    }
+    fflush(stdout);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Parses a comma separated list of CPU numbers. Returns the count, or -1 on a malformed list.
+static int parse_cpu_list(const char *list, int *const cpus, const int capacity) {
+    int count = 0;
+    while (*list) {
+        char *end;
+        const long cpu = strtol(list, &end, 10);
+        if (end == list || cpu < 0 || count == capacity || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        cpus[count++] = (int)cpu;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--self-test") == 0) {
+            return run_self_test();
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            keep_latency = 1;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_bytes = 1;
+        }
+    }
 
-    const int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (fd < 0) {
-        perror("Error opening port");
+    Stream *const streams = (Stream*)calloc((size_t)argc, sizeof(Stream));
+    if (!streams) {
+        printf("Out of memory\n");
         return EXIT_FAILURE;
     }
+    int stream_count = 0;
+    int baud_rate = DEFAULT_BAUD_RATE;
+    double stats_interval = 0; // Seconds, 0 means no stats
+    int pipelined = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    double replay_speed = 0; // 0 means as fast as possible
+    const char *parse_path = NULL;
+    int parse_threads = 0; // 0 means one per CPU
+    PacketSinkFormat output_format = PACKET_SINK_TEXT;
+    double flush_interval = PACKET_SINK_DEFAULT_FLUSH_INTERVAL;
+    PipelineConfig pipeline_config = pipeline_default_config();
+    static int cpus[1024];
+    parser_config = stream_parser_default_config();
 
-    struct termios tty;
-    memset(&tty, 0, sizeof tty);
-    if (tcgetattr(fd, &tty) != 0) {
-        perror("Error from tcgetattr");
+    // First pass for the options, so that --baud may come after the ports it applies to
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--baud") == 0) {
+            baud_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-interval") == 0) {
+            stats_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay-speed") == 0) {
+            replay_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--parse-file") == 0) {
+            parse_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            parse_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output-format") == 0) {
+            if (packet_sink_parse_format(argv[++i], &output_format) != 0) {
+                printf("Error: Unknown --output-format: %s\n", argv[i]);
+                usage();
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--flush-interval") == 0) {
+            flush_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max-payload") == 0) {
+            parser_config.max_payload_size = atoll(argv[++i]);
+            if (parser_config.max_payload_size < 0 || parser_config.max_payload_size > STREAM_PARSER_MAX_PAYLOAD_SIZE) {
+                printf("Error: --max-payload must be between 0 and %d\n", STREAM_PARSER_MAX_PAYLOAD_SIZE);
+                usage();
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--io-threads") == 0) {
+            pipeline_config.io_threads = atoi(argv[++i]);
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            pipeline_config.workers = atoi(argv[++i]);
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--packet-slots") == 0) {
+            pipeline_config.pool.slot_count = atoll(argv[++i]);
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--when-full") == 0) {
+            static const char *const policies[] = { "drop-newest", "drop-oldest", "block" };
+            ++i;
+            int found = 0;
+            for (int policy = PACKET_POOL_DROP_NEWEST; policy <= PACKET_POOL_BLOCK; ++policy) {
+                if (strcmp(argv[i], policies[policy]) == 0) {
+                    pipeline_config.pool.exhaustion = (PacketPoolExhaustion)policy;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                printf("Error: Unknown --when-full policy: %s\n", argv[i]);
+                usage();
+                return EXIT_FAILURE;
+            }
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            pipeline_config.cpu_count = parse_cpu_list(argv[++i], cpus, (int)(sizeof cpus / sizeof cpus[0]));
+            pipeline_config.cpus = cpus;
+            pipelined = 1;
+            if (pipeline_config.cpu_count < 0) {
+                printf("Error: Invalid CPU list: %s\n", argv[i]);
+                usage();
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    pipeline_config.parser = parser_config;
+    if (pipeline_config.io_threads <= 0 || pipeline_config.workers <= 0) {
+        printf("Error: --io-threads and --workers need at least 1 thread\n");
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (record_path && pipelined) {
+        printf("Error: --record isn't supported in pipelined mode\n");
+        usage();
         return EXIT_FAILURE;
     }
 
-    cfsetospeed(&tty, B9600);
-    cfsetispeed(&tty, B9600);
+    if (parse_path && parse_threads < 0) {
+        printf("Error: --threads can't be negative\n");
+        usage();
+        return EXIT_FAILURE;
+    }
 
-    tty.c_cflag &= ~PARENB; // Clear parity bit, disabling parity
-    tty.c_cflag &= ~CSTOPB; // Clear stop field, only one stop bit used in communication
-    tty.c_cflag &= ~CSIZE; // Clear all bits that set the data size
-    tty.c_cflag |= CS8; // 8 bits per byte
-    tty.c_cflag &= ~CRTSCTS; // Disable RTS/CTS hardware flow control
-    tty.c_cflag |= CREAD | CLOCAL; // Turn on READ & ignore ctrl lines
+    // Machine readable packets keep stdout to themselves, the rest of the output moves to stderr
+    int sink_fd = STDOUT_FILENO;
+    if (output_format == PACKET_SINK_RAW || output_format == PACKET_SINK_JSONL) {
+        fflush(stdout);
+        sink_fd = dup(STDOUT_FILENO);
+        if (sink_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Error redirecting stdout");
+            return EXIT_FAILURE;
+        }
+    }
+    sink = packet_sink_open(sink_fd, output_format, PACKET_SINK_DEFAULT_BUFFER_SIZE, flush_interval);
+    sink_format = output_format;
+    if (!sink) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
 
-    tty.c_lflag &= ~ICANON;
-    tty.c_lflag &= ~ECHO; // Disable echo
-    tty.c_lflag &= ~ECHOE; // Disable erasure
-    tty.c_lflag &= ~ECHONL; // Disable new-line echo
-    tty.c_lflag &= ~ISIG; // Disable interpretation of INTR, QUIT and SUSP
+    if (parse_path) {
+        free(streams);
+        const int result = run_parse_file(parse_path, parse_threads);
+        packet_sink_close(sink);
+        return result;
+    }
 
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Turn off s/w flow ctrl
-    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL); // Disable any special handling of received bytes
+    if (replay_path) {
+        signal(SIGINT, int_handler);
+        signal(SIGTERM, int_handler);
+        const int result = run_replay(replay_path, replay_speed, stats_interval);
+        packet_sink_close(sink);
+        free(streams);
+        return result;
+    }
 
-    tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
-    tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
+    static const struct {
+        const char *flag;
+        IoSourceKind kind;
+    } source_flags[] = {
+        { "--port", IO_SOURCE_TTY }, { "--tcp", IO_SOURCE_TCP }, { "--udp", IO_SOURCE_UDP },
+        { "--unix", IO_SOURCE_UNIX }, { "--fifo", IO_SOURCE_FIFO },
+    };
+    for (int i = 1; i < argc - 1; i++) {
+        for (size_t f = 0; f < sizeof source_flags / sizeof source_flags[0]; ++f) {
+            if (strcmp(argv[i], source_flags[f].flag) != 0) {
+                continue;
+            }
+            Stream *const stream = &streams[stream_count];
+            if (io_source_open(&stream->io, source_flags[f].kind, argv[i + 1], baud_rate) != 0) {
+                fflush(stdout);
+                return EXIT_FAILURE;
+            }
+            snprintf(stream->name, sizeof stream->name, "%s:%s", io_source_kind_name(source_flags[f].kind), argv[i + 1]);
+            stream->index = (uint32_t)stream_count;
+            printf("Listening on %s\n", stream->name);
+            ++stream_count;
+            ++i;
+            break;
+        }
+    }
 
-    tty.c_cc[VTIME] = 1; // Wait for up to 1 deciseconds, returning as soon as any data is received
-    tty.c_cc[VMIN] = 0;
+    // Check if any source was provided
+    if (stream_count == 0) {
+        printf("Error: Please specify at least one source, for example the serial port using the --port argument.\n");
+        usage();
+        return EXIT_FAILURE;
+    }
 
-    {
-        const int tcsetattr_ret = tcsetattr(fd, TCSANOW, &tty);
-        if (tcsetattr_ret != 0) {
-            printf("Error from tcsetattr: %d\n", tcsetattr_ret);
+    if (record_path) {
+        recorder = capture_writer_open(record_path, flush_interval);
+        if (!recorder) {
             fflush(stdout);
             return EXIT_FAILURE;
         }
+        for (int i = 0; i < stream_count; ++i) {
+            streams[i].record_source = capture_writer_add_source(recorder, streams[i].name);
+        }
+        printf("Recording to %s\n", record_path);
     }
 
     signal(SIGINT, int_handler);
     signal(SIGTERM, int_handler);
+    signal(SIGUSR1, usr1_handler);
 
-    StreamParser *parser = stream_parser_open();
-    if (!parser) {
-        printf("Failed to open stream parser\n");
-        fflush(stdout);
+    if (pipelined) {
+        const int result = run_pipeline(streams, stream_count, &pipeline_config, stats_interval);
+        packet_sink_close(sink);
+        free(streams);
+        return result;
+    }
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Error from epoll_create1");
         return EXIT_FAILURE;
     }
-    stream_parser_register_error_callback(parser, error_callback, NULL);
-    stream_parser_register_packet_callback(parser, packet_callback, NULL);
 
-    while (keep_running) {
-        uint8_t byte = 0;
-        const int n = read(fd, &byte, 1);
-        if (n > 0) {
-            printf("Processing byte... : %c  0x%x\n", (char)byte, (int)byte);
+    for (int i = 0; i < stream_count; ++i) {
+        Stream *const stream = &streams[i];
+        stream->parser = stream_parser_open_ex(&parser_config);
+        if (!stream->parser) {
+            printf("Failed to open stream parser\n");
             fflush(stdout);
-            const StreamParserError error = stream_parser_push_byte(parser, byte);
-            if (error) {
-                printf("Error code returned by stream_parser_push_byte: %d\n", (int)error);
-                fflush(stdout);
-            }
-        } else if (n < 0 && errno != EAGAIN) {
-            printf("Error reading from serial port\n");
+            return EXIT_FAILURE;
+        }
+        report_errors(stream);
+        stream_parser_register_packet_callback(stream->parser, packet_callback, stream);
+        if (keep_latency && stream_parser_set_latency_histograms(stream->parser, 1) != STREAM_PARSER_OK) {
+            printf("Out of memory\n");
             fflush(stdout);
+            return EXIT_FAILURE;
+        }
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof event);
+        event.events = EPOLLIN;
+        event.data.ptr = stream;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stream->io.fd, &event) != 0) {
+            perror("Error from epoll_ctl");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The "Listening on" lines go out before the packets and errors, which take the sink's buffer
+    fflush(stdout);
+    static uint8_t buffer[READ_BUFFER_SIZE];
+    int open_streams = stream_count;
+    double last_stats_time = monotonic_seconds();
+    while (keep_running && open_streams > 0) {
+        // Only wake up without data when it's time to print stats, or to flush packets or the recording
+        int timeout_ms = packet_sink_flush_if_due(sink);
+        if (recorder) {
+            const int record_ms = capture_writer_flush_if_due(recorder);
+            if (record_ms >= 0 && (timeout_ms < 0 || record_ms < timeout_ms)) {
+                timeout_ms = record_ms;
+            }
+        }
+        if (stats_interval > 0) {
+            const double remaining = stats_interval - (monotonic_seconds() - last_stats_time);
+            const int stats_ms = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+            if (timeout_ms < 0 || stats_ms < timeout_ms) {
+                timeout_ms = stats_ms;
+            }
+        }
+
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        const int ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            perror("Error from epoll_wait");
             break;
         }
 
-        usleep(10000); // Small delay to avoid busy looping
+        // One read per ready source per round, so a busy source can't starve the others
+        for (int e = 0; e < ready; ++e) {
+            Stream *const stream = (Stream*)events[e].data.ptr;
+            if (service_stream(stream, buffer) != 0) {
+                flush_text_packets();
+                printf("[%s] Source closed\n", stream->name);
+                fflush(stdout);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->io.fd, NULL);
+                io_source_close(&stream->io);
+                --open_streams;
+            }
+        }
+        if (print_latency_requested) {
+            print_latency_requested = 0;
+            for (int i = 0; i < stream_count; ++i) {
+                print_latency(&streams[i]);
+            }
+        }
+
+        if (stats_interval > 0) {
+            const double now = monotonic_seconds();
+            if (now - last_stats_time >= stats_interval) {
+                for (int i = 0; i < stream_count; ++i) {
+                    print_stats(&streams[i], now - last_stats_time);
+                }
+                last_stats_time = now;
+            }
+        }
     }
 
-    stream_parser_close(parser);
-    close(fd);
+    for (int i = 0; i < stream_count; ++i) {
+        if (keep_latency) {
+            print_latency(&streams[i]);
+        }
+        stream_parser_close(streams[i].parser);
+        io_source_close(&streams[i].io);
+    }
+    capture_writer_close(recorder);
+    flush_text_packets();
+    close(epoll_fd);
+    free(streams);
     printf("Exiting\n");
     fflush(stdout);
+    packet_sink_close(sink);
     return EXIT_SUCCESS;
 }
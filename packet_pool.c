@@ -0,0 +1,360 @@
+#include "packet_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define POOL_ALIGNMENT 64
+#define ALIGN_UP(size) (((size) + POOL_ALIGNMENT - 1) & ~((size_t)POOL_ALIGNMENT - 1))
+
+#define DEFAULT_SLOT_COUNT 1024
+// The free list and generations are 32 bit
+#define MAX_SLOT_COUNT 0x7fffffff
+
+// Each slot's state is one 64 bit word so that every transition is a single compare and swap:
+// [generation 32 bits][DELIVERING][CLAIMED][reference count 30 bits]
+// The generation is bumped whenever the slot is freed or stolen, which is what makes old handles stale.
+#define STATE_DELIVERING (1ull << 31)
+#define STATE_CLAIMED (1ull << 30)
+#define STATE_REFS_MASK ((1ull << 30) - 1)
+#define STATE_GENERATION(state) ((uint32_t)((state) >> 32))
+#define STATE_FREE(generation) ((uint64_t)(generation) << 32)
+
+// Free slot indices are stored plus one, so that 0 means none
+#define FREE_LIST_END 0
+
+typedef struct {
+    _Atomic uint64_t state;
+    _Atomic uint32_t next_free;
+    int64_t packet_size;
+    uint8_t *data;
+} __attribute__((aligned(POOL_ALIGNMENT))) PoolSlot;
+
+// PACKET_POOL_DROP_OLDEST keeps the published packets in a FIFO of [generation 32 bits][slot 32 bits],
+// oldest first. Entries whose packet was claimed or freed since are skipped when they come up.
+#define AGE_ENTRY(slot, generation) ((uint64_t)(generation) << 32 | (uint64_t)(slot))
+#define AGE_ENTRY_SLOT(entry) ((uint32_t)(entry))
+#define AGE_ENTRY_GENERATION(entry) ((uint32_t)((entry) >> 32))
+
+// Everything lives in one block of memory: [struct PacketPool][slots][age FIFO][packet data]
+struct PacketPool {
+    PacketPoolConfig config;
+    PoolSlot *slots;
+    int64_t slot_stride;
+
+    // Treiber stack of free slots: [ABA tag 32 bits][slot index + 1, 32 bits]
+    _Atomic uint64_t free_head __attribute__((aligned(POOL_ALIGNMENT)));
+
+    _Atomic uint64_t acquired __attribute__((aligned(POOL_ALIGNMENT)));
+    _Atomic uint64_t dropped_newest;
+    _Atomic uint64_t dropped_oldest;
+    _Atomic uint64_t oversized;
+    _Atomic uint64_t blocked;
+    _Atomic int64_t peak_in_use;
+
+    // Released by consumers, so kept apart from the producer's counters
+    _Atomic int64_t in_use __attribute__((aligned(POOL_ALIGNMENT)));
+
+    // Ring of twice slot_count entries, PACKET_POOL_DROP_OLDEST only. Producers publish and steal,
+    // so only they take the lock.
+    pthread_mutex_t age_mutex __attribute__((aligned(POOL_ALIGNMENT)));
+    uint64_t *ages;
+    int64_t age_capacity;
+    int64_t age_head;
+    int64_t age_count;
+
+    // Only touched when PACKET_POOL_BLOCK has a producer waiting
+    _Atomic int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_freed;
+};
+
+static inline void counter_add(_Atomic uint64_t *const counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static void push_free(PacketPool *const pool, const uint32_t slot) {
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&pool->slots[slot].next_free, (uint32_t)head, memory_order_relaxed);
+        new_head = ((head >> 32) + 1) << 32 | (uint64_t)(slot + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head, memory_order_seq_cst, memory_order_relaxed));
+}
+
+// Returns the slot index, or -1 if the free list is empty.
+static int64_t pop_free(PacketPool *const pool) {
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+    for (;;) {
+        const uint32_t top = (uint32_t)head;
+        if (top == FREE_LIST_END) {
+            return -1;
+        }
+        const uint32_t next = atomic_load_explicit(&pool->slots[top - 1].next_free, memory_order_relaxed);
+        const uint64_t new_head = ((head >> 32) + 1) << 32 | (uint64_t)next;
+        if (atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head, memory_order_acquire, memory_order_acquire)) {
+            return (int64_t)top - 1;
+        }
+    }
+}
+
+// Turns a free slot into a new packet with a single reference owned by the producer.
+static void take_slot(PacketPool *const pool, const int64_t slot) {
+    PoolSlot *const pool_slot = &pool->slots[slot];
+    const uint64_t state = atomic_load_explicit(&pool_slot->state, memory_order_relaxed);
+    atomic_store_explicit(&pool_slot->state, STATE_FREE(STATE_GENERATION(state)) | STATE_DELIVERING | 1, memory_order_relaxed);
+    const int64_t in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    if (in_use > atomic_load_explicit(&pool->peak_in_use, memory_order_relaxed)) {
+        atomic_store_explicit(&pool->peak_in_use, in_use, memory_order_relaxed);
+    }
+}
+
+// The published packet an age entry stands for is still there and nobody claimed it
+static int is_stealable(const uint64_t state, const uint64_t entry) {
+    return STATE_GENERATION(state) == AGE_ENTRY_GENERATION(entry) && (state & STATE_REFS_MASK) != 0 &&
+           (state & (STATE_DELIVERING | STATE_CLAIMED)) == 0;
+}
+
+// Called with age_mutex held. A claimed or freed packet never becomes stealable again, so entries
+// that aren't stealable now can go. Every slot has at most one stealable entry, so this leaves at
+// least slot_count entries of room, and it takes at least that many pushes to fill them again.
+static void compact_ages(PacketPool *const pool) {
+    int64_t kept = 0;
+    for (int64_t i = 0; i < pool->age_count; ++i) {
+        const uint64_t entry = pool->ages[(pool->age_head + i) % pool->age_capacity];
+        const uint64_t state = atomic_load_explicit(&pool->slots[AGE_ENTRY_SLOT(entry)].state, memory_order_relaxed);
+        if (is_stealable(state, entry)) {
+            pool->ages[(pool->age_head + kept++) % pool->age_capacity] = entry;
+        }
+    }
+    pool->age_count = kept;
+}
+
+static void push_age(PacketPool *const pool, const uint32_t slot, const uint32_t generation) {
+    pthread_mutex_lock(&pool->age_mutex);
+    if (pool->age_count == pool->age_capacity) {
+        compact_ages(pool);
+    }
+    pool->ages[(pool->age_head + pool->age_count++) % pool->age_capacity] = AGE_ENTRY(slot, generation);
+    pthread_mutex_unlock(&pool->age_mutex);
+}
+
+// Takes over the oldest unclaimed packet's slot. Returns the slot index, or -1 if there's none.
+// Every entry leaves the FIFO once, so this is O(1) per published packet.
+static int64_t steal_oldest(PacketPool *const pool) {
+    int64_t stolen_slot = -1;
+    pthread_mutex_lock(&pool->age_mutex);
+    while (pool->age_count > 0 && stolen_slot < 0) {
+        const uint64_t entry = pool->ages[pool->age_head];
+        PoolSlot *const pool_slot = &pool->slots[AGE_ENTRY_SLOT(entry)];
+        uint64_t state = atomic_load_explicit(&pool_slot->state, memory_order_relaxed);
+        // Bumping the generation makes every outstanding handle to the old packet stale at once
+        const uint64_t stolen = STATE_FREE(AGE_ENTRY_GENERATION(entry) + 1) | STATE_DELIVERING | 1;
+        // A failed compare and swap means the packet was claimed, retained or released meanwhile, look again
+        while (is_stealable(state, entry) &&
+               !atomic_compare_exchange_weak_explicit(&pool_slot->state, &state, stolen, memory_order_acquire, memory_order_relaxed)) {
+        }
+        if (is_stealable(state, entry)) {
+            stolen_slot = (int64_t)AGE_ENTRY_SLOT(entry);
+        }
+        pool->age_head = (pool->age_head + 1) % pool->age_capacity;
+        --pool->age_count;
+    }
+    pthread_mutex_unlock(&pool->age_mutex);
+    return stolen_slot;
+}
+
+static int64_t wait_for_slot(PacketPool *const pool) {
+    counter_add(&pool->blocked);
+    pthread_mutex_lock(&pool->mutex);
+    atomic_fetch_add_explicit(&pool->waiters, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t slot;
+    while ((slot = pop_free(pool)) < 0) {
+        pthread_cond_wait(&pool->slot_freed, &pool->mutex);
+    }
+    atomic_fetch_sub_explicit(&pool->waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&pool->mutex);
+    return slot;
+}
+
+static void free_slot(PacketPool *const pool, const uint32_t slot) {
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+    push_free(pool, slot);
+    // push_free() is sequentially consistent, so either the waiter sees the slot or we see the waiter
+    if (atomic_load_explicit(&pool->waiters, memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->slot_freed);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// Drops one reference if the handle is still current, clearing clear_flags along the way.
+static void drop_reference(const PacketPoolRef ref, const uint64_t clear_flags) {
+    PacketPool *const pool = ref.pool;
+    PoolSlot *const pool_slot = &pool->slots[ref.slot];
+    uint64_t state = atomic_load_explicit(&pool_slot->state, memory_order_relaxed);
+    uint64_t new_state;
+    do {
+        if (STATE_GENERATION(state) != ref.generation || (state & STATE_REFS_MASK) == 0) {
+            return;
+        }
+        new_state = (state & ~clear_flags) - 1;
+        if ((new_state & STATE_REFS_MASK) == 0) {
+            new_state = STATE_FREE(ref.generation + 1);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&pool_slot->state, &state, new_state, memory_order_acq_rel, memory_order_relaxed));
+
+    if ((new_state & STATE_REFS_MASK) == 0) {
+        free_slot(pool, ref.slot);
+    }
+}
+
+// Sets flags and adds refs if the handle is still current. Returns 0 on success, -1 if stale.
+static int update_live(const PacketPoolRef ref, const uint64_t flags, const uint64_t refs) {
+    PoolSlot *const pool_slot = &ref.pool->slots[ref.slot];
+    uint64_t state = atomic_load_explicit(&pool_slot->state, memory_order_relaxed);
+    do {
+        if (STATE_GENERATION(state) != ref.generation || (state & STATE_REFS_MASK) == 0) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&pool_slot->state, &state, (state | flags) + refs,
+                                                    memory_order_acquire, memory_order_relaxed));
+    return 0;
+}
+
+PacketPoolConfig packet_pool_default_config(const int64_t slot_size) {
+    PacketPoolConfig config;
+    config.slot_count = DEFAULT_SLOT_COUNT;
+    config.slot_size = slot_size;
+    config.exhaustion = PACKET_POOL_DROP_NEWEST;
+    return config;
+}
+
+PacketPool *packet_pool_open(const PacketPoolConfig *const config) {
+    if (!config || config->slot_count <= 0 || config->slot_count > MAX_SLOT_COUNT || config->slot_size <= 0 ||
+        config->exhaustion < PACKET_POOL_DROP_NEWEST || config->exhaustion > PACKET_POOL_BLOCK) {
+        return NULL;
+    }
+    const size_t slot_stride = ALIGN_UP((size_t)config->slot_size);
+    const int64_t age_capacity = config->exhaustion == PACKET_POOL_DROP_OLDEST ? 2 * config->slot_count : 0;
+    const size_t header_size = ALIGN_UP(sizeof(PacketPool)) + (size_t)config->slot_count * sizeof(PoolSlot) +
+                               ALIGN_UP((size_t)age_capacity * sizeof(uint64_t));
+    const size_t size = header_size + (size_t)config->slot_count * slot_stride;
+    uint8_t *const memory = (uint8_t*)aligned_alloc(POOL_ALIGNMENT, size);
+    if (!memory) return NULL;
+    memset(memory, 0, header_size);
+
+    PacketPool *const pool = (PacketPool*)memory;
+    pool->config = *config;
+    pool->slots = (PoolSlot*)(memory + ALIGN_UP(sizeof(PacketPool)));
+    pool->slot_stride = (int64_t)slot_stride;
+    pool->ages = (uint64_t*)(pool->slots + config->slot_count);
+    pool->age_capacity = age_capacity;
+    uint8_t *const data = memory + header_size;
+    pthread_mutex_init(&pool->age_mutex, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->slot_freed, NULL);
+
+    // Pushed in reverse so that slots are handed out in address order
+    for (int64_t slot = config->slot_count - 1; slot >= 0; --slot) {
+        pool->slots[slot].data = data + slot * slot_stride;
+        push_free(pool, (uint32_t)slot);
+    }
+    return pool;
+}
+
+void packet_pool_close(PacketPool *pool) {
+    if (pool) {
+        pthread_cond_destroy(&pool->slot_freed);
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_mutex_destroy(&pool->age_mutex);
+        free(pool);
+    }
+}
+
+int64_t packet_pool_slot_size(const PacketPool *const pool) {
+    return pool ? pool->config.slot_size : 0;
+}
+
+int packet_pool_acquire(PacketPool *const pool, const uint8_t *const packet, const int64_t packet_size, PacketPoolRef *const ref) {
+    if (!pool || !ref || packet_size < 0) {
+        return -1;
+    }
+    if (packet_size > pool->config.slot_size) {
+        counter_add(&pool->oversized);
+        return -1;
+    }
+
+    int64_t slot = pop_free(pool);
+    if (slot >= 0) {
+        take_slot(pool, slot);
+    } else if (pool->config.exhaustion == PACKET_POOL_BLOCK) {
+        slot = wait_for_slot(pool);
+        take_slot(pool, slot);
+    } else if (pool->config.exhaustion == PACKET_POOL_DROP_OLDEST && (slot = steal_oldest(pool)) >= 0) {
+        // Still in use, just by a different packet now
+        counter_add(&pool->dropped_oldest);
+    } else {
+        counter_add(&pool->dropped_newest);
+        return -1;
+    }
+
+    PoolSlot *const pool_slot = &pool->slots[slot];
+    memcpy(pool_slot->data, packet, (size_t)packet_size);
+    pool_slot->packet_size = packet_size;
+    counter_add(&pool->acquired);
+
+    ref->pool = pool;
+    ref->slot = (uint32_t)slot;
+    ref->generation = STATE_GENERATION(atomic_load_explicit(&pool_slot->state, memory_order_relaxed));
+    return 0;
+}
+
+void packet_pool_publish(const PacketPoolRef ref) {
+    if (ref.pool) {
+        drop_reference(ref, STATE_DELIVERING);
+        // If the packet is gone already, its entry is just skipped later
+        if (ref.pool->config.exhaustion == PACKET_POOL_DROP_OLDEST) {
+            push_age(ref.pool, ref.slot, ref.generation);
+        }
+    }
+}
+
+int packet_pool_retain(const PacketPoolRef ref) {
+    return ref.pool ? update_live(ref, 0, 1) : -1;
+}
+
+int packet_pool_claim(const PacketPoolRef ref) {
+    return ref.pool ? update_live(ref, STATE_CLAIMED, 0) : -1;
+}
+
+void packet_pool_release(const PacketPoolRef ref) {
+    if (ref.pool) {
+        drop_reference(ref, 0);
+    }
+}
+
+const uint8_t *packet_pool_data(const PacketPoolRef ref, int64_t *const packet_size) {
+    if (!ref.pool) {
+        return NULL;
+    }
+    const PoolSlot *const pool_slot = &ref.pool->slots[ref.slot];
+    if (packet_size) {
+        *packet_size = pool_slot->packet_size;
+    }
+    return pool_slot->data;
+}
+
+void packet_pool_get_stats(PacketPool *const pool, PacketPoolStats *const stats) {
+    if (!pool || !stats) {
+        return;
+    }
+    stats->acquired = atomic_load_explicit(&pool->acquired, memory_order_relaxed);
+    stats->dropped_newest = atomic_load_explicit(&pool->dropped_newest, memory_order_relaxed);
+    stats->dropped_oldest = atomic_load_explicit(&pool->dropped_oldest, memory_order_relaxed);
+    stats->oversized = atomic_load_explicit(&pool->oversized, memory_order_relaxed);
+    stats->blocked = atomic_load_explicit(&pool->blocked, memory_order_relaxed);
+    stats->in_use = atomic_load_explicit(&pool->in_use, memory_order_relaxed);
+    stats->peak_in_use = atomic_load_explicit(&pool->peak_in_use, memory_order_relaxed);
+}
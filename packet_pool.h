@@ -0,0 +1,101 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Preallocated, reference counted packet slots, for handing packets to other threads
+// without a malloc and a copy per packet.
+//
+// A producer (the parser) copies each packet into a free slot and hands out a PacketPoolRef.
+// Whoever wants to keep the packet past the callback takes a reference with packet_pool_retain(),
+// passes the ref to other threads by value, and eventually drops it with packet_pool_release().
+// The slot goes back to the pool once the last reference is released.
+// All functions taking a PacketPoolRef may be called from any thread.
+typedef struct PacketPool PacketPool;
+
+// What happens when a packet arrives and every slot is taken
+typedef enum {
+    // The new packet is dropped
+    PACKET_POOL_DROP_NEWEST = 0,
+    // The oldest packet nobody has claimed yet (see packet_pool_claim()) is dropped and its slot
+    // reused. If every taken slot is claimed, the new packet is dropped instead.
+    PACKET_POOL_DROP_OLDEST,
+    // The producer waits until a slot is released. Consumers must never wait on the producer,
+    // or the two deadlock.
+    PACKET_POOL_BLOCK
+} PacketPoolExhaustion;
+
+typedef struct {
+    int64_t slot_count;                // Number of packets that can be held at the same time
+    int64_t slot_size;                 // Largest packet a slot holds, in bytes
+    PacketPoolExhaustion exhaustion;
+} PacketPoolConfig;
+
+// Handle to a packet in the pool. Small enough to pass around by value.
+// A handle goes stale once its slot is reused: retain and claim then fail, and release does nothing.
+typedef struct {
+    PacketPool *pool;
+    uint32_t slot;
+    uint32_t generation;
+} PacketPoolRef;
+
+typedef struct {
+    uint64_t acquired;        // Packets copied into a slot
+    uint64_t dropped_newest;  // Packets dropped because no slot was free
+    uint64_t dropped_oldest;  // Unclaimed packets dropped to make room for a new one
+    uint64_t oversized;       // Packets dropped because they don't fit in a slot
+    uint64_t blocked;         // Times the producer had to wait for a slot
+    int64_t in_use;           // Slots taken right now
+    int64_t peak_in_use;      // Most slots ever taken at the same time
+} PacketPoolStats;
+
+// Returns a configuration with a sensible number of slots of slot_size bytes.
+extern PacketPoolConfig packet_pool_default_config(int64_t slot_size);
+
+// Allocates the pool and all of its slots up front. Returns NULL on invalid configuration
+// or when memory ran out.
+extern PacketPool *packet_pool_open(const PacketPoolConfig *config);
+
+// Frees the pool. Every reference must have been released, and nobody may be waiting for a slot.
+extern void packet_pool_close(PacketPool *pool);
+
+// Largest packet a slot holds, 0 for a NULL pool.
+extern int64_t packet_pool_slot_size(const PacketPool *pool);
+
+// Producer side: copies a packet into a slot, applying the exhaustion policy if there is none.
+// On success ref holds the producer's reference, which has to be handed back with
+// packet_pool_publish(). Returns 0 on success, -1 if the packet was dropped.
+extern int packet_pool_acquire(PacketPool *pool, const uint8_t *packet, int64_t packet_size, PacketPoolRef *ref);
+
+// Producer side: drops the reference packet_pool_acquire() returned. From here on the packet
+// may be dropped by PACKET_POOL_DROP_OLDEST unless it has been claimed.
+extern void packet_pool_publish(PacketPoolRef ref);
+
+// Takes one more reference. Returns 0 on success, -1 if the handle is stale.
+extern int packet_pool_retain(PacketPoolRef ref);
+
+// Protects the packet from PACKET_POOL_DROP_OLDEST. A consumer receiving a ref from another
+// thread should claim it before touching the data- if this fails (-1) the packet was dropped,
+// the handle is stale and must not be used any further.
+extern int packet_pool_claim(PacketPoolRef ref);
+
+// Drops one reference. The slot is free again once the last one is gone.
+extern void packet_pool_release(PacketPoolRef ref);
+
+// The packet bytes and their count. Only valid while a reference is held, and for refs received
+// from another thread only after a successful packet_pool_claim().
+extern const uint8_t *packet_pool_data(PacketPoolRef ref, int64_t *packet_size);
+
+// Copies the pool's counters into stats.
+extern void packet_pool_get_stats(PacketPool *pool, PacketPoolStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACKET_POOL_H
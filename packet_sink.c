@@ -0,0 +1,322 @@
+#include "packet_sink.h"
+#include "icd_descriptor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Enough for any single piece the formats reserve at once
+#define MIN_BUFFER_SIZE 4096
+
+struct PacketSink {
+    pthread_mutex_t mutex;
+    int fd;
+    PacketSinkFormat format;
+    int failed;
+    uint64_t flush_interval_ns;
+    uint64_t oldest_ns; // When the oldest buffered byte was written, 0 if there is none
+    char *buffer;
+    int64_t used;
+    int64_t capacity;
+};
+
+// Two lowercase hex digits for every byte value, so formatting a byte is a 2 byte copy
+#define HEX_DIGIT(n) ((n) < 10 ? '0' + (n) : 'a' - 10 + (n))
+#define HEX_PAIR(n) { HEX_DIGIT((n) >> 4), HEX_DIGIT((n) & 15) }
+#define HEX_PAIRS_4(n) HEX_PAIR(n), HEX_PAIR((n) + 1), HEX_PAIR((n) + 2), HEX_PAIR((n) + 3)
+#define HEX_PAIRS_16(n) HEX_PAIRS_4(n), HEX_PAIRS_4((n) + 4), HEX_PAIRS_4((n) + 8), HEX_PAIRS_4((n) + 12)
+#define HEX_PAIRS_64(n) HEX_PAIRS_16(n), HEX_PAIRS_16((n) + 16), HEX_PAIRS_16((n) + 32), HEX_PAIRS_16((n) + 48)
+static const char hex_pairs[256][2] = { HEX_PAIRS_64(0), HEX_PAIRS_64(64), HEX_PAIRS_64(128), HEX_PAIRS_64(192) };
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int write_all(const int fd, const char *data, int64_t length) {
+    while (length > 0) {
+        const ssize_t written = write(fd, data, (size_t)length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// The functions below are called with the mutex held
+
+static int flush_locked(PacketSink *const sink) {
+    if (sink->used > 0 && !sink->failed && write_all(sink->fd, sink->buffer, sink->used) != 0) {
+        sink->failed = 1;
+    }
+    sink->used = 0;
+    sink->oldest_ns = 0;
+    return sink->failed ? -1 : 0;
+}
+
+// Makes room for length more bytes, at most MIN_BUFFER_SIZE
+static char *reserve(PacketSink *const sink, const int64_t length) {
+    if (sink->capacity - sink->used < length) {
+        flush_locked(sink);
+    }
+    return sink->buffer + sink->used;
+}
+
+static void append(PacketSink *const sink, const void *const data, const int64_t length) {
+    const char *bytes = (const char*)data;
+    int64_t left = length;
+    while (left > 0) {
+        if (sink->used == sink->capacity) {
+            flush_locked(sink);
+        }
+        const int64_t room = sink->capacity - sink->used;
+        const int64_t piece = left < room ? left : room;
+        memcpy(sink->buffer + sink->used, bytes, (size_t)piece);
+        sink->used += piece;
+        bytes += piece;
+        left -= piece;
+    }
+}
+
+static void append_string(PacketSink *const sink, const char *const string) {
+    append(sink, string, (int64_t)strlen(string));
+}
+
+static void append_decimal(PacketSink *const sink, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[sizeof digits - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    append(sink, digits + sizeof digits - count, count);
+}
+
+// Writes 2 * length hex digits to out
+static void format_hex(char *out, const uint8_t *in, int64_t length) {
+#ifdef __SSE2__
+    // 16 bytes at a time: split into nibbles, interleave high and low, and map 0-15 to '0'-'9', 'a'-'f'
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero_char = _mm_set1_epi8('0');
+    const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+    for (; length >= 16; length -= 16, in += 16, out += 32) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*)in);
+        const __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask);
+        const __m128i low = _mm_and_si128(bytes, low_mask);
+        __m128i first = _mm_unpacklo_epi8(high, low);
+        __m128i second = _mm_unpackhi_epi8(high, low);
+        first = _mm_add_epi8(_mm_add_epi8(first, zero_char), _mm_and_si128(_mm_cmpgt_epi8(first, nine), letter_gap));
+        second = _mm_add_epi8(_mm_add_epi8(second, zero_char), _mm_and_si128(_mm_cmpgt_epi8(second, nine), letter_gap));
+        _mm_storeu_si128((__m128i*)out, first);
+        _mm_storeu_si128((__m128i*)(out + 16), second);
+    }
+#endif
+    for (int64_t i = 0; i < length; ++i) {
+        memcpy(out + 2 * i, hex_pairs[in[i]], 2);
+    }
+}
+
+static void append_hex(PacketSink *const sink, const uint8_t *bytes, int64_t length) {
+    while (length > 0) {
+        int64_t piece = (sink->capacity - sink->used) / 2;
+        if (piece == 0) {
+            flush_locked(sink);
+            continue;
+        }
+        if (piece > length) {
+            piece = length;
+        }
+        format_hex(sink->buffer + sink->used, bytes, piece);
+        sink->used += 2 * piece;
+        bytes += piece;
+        length -= piece;
+    }
+}
+
+static void append_json_string(PacketSink *const sink, const char *string) {
+    for (; *string; ++string) {
+        const uint8_t c = (uint8_t)*string;
+        char *const out = reserve(sink, 6);
+        if (c == '"' || c == '\\') {
+            out[0] = '\\';
+            out[1] = (char)c;
+            sink->used += 2;
+        } else if (c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            memcpy(out + 4, hex_pairs[c], 2);
+            sink->used += 6;
+        } else {
+            out[0] = (char)c;
+            sink->used += 1;
+        }
+    }
+}
+
+static void write_text(PacketSink *const sink, const char *const source, const uint8_t *const packet, const int64_t packet_size) {
+    append_string(sink, "[");
+    append_string(sink, source);
+    append_string(sink, "] Received packet with length ");
+    append_decimal(sink, (uint64_t)packet_size);
+    append_string(sink, " bytes and contents: [");
+    for (int64_t i = 0; i < packet_size;) {
+        int64_t piece = (sink->capacity - sink->used) / 6;
+        if (piece == 0) {
+            flush_locked(sink);
+            continue;
+        }
+        if (piece > packet_size - i) {
+            piece = packet_size - i;
+        }
+        char *out = sink->buffer + sink->used;
+        for (const int64_t end = i + piece; i < end; ++i, out += 6) {
+            memcpy(out, " 0x", 3);
+            memcpy(out + 3, hex_pairs[packet[i]], 2);
+            out[5] = ',';
+        }
+        sink->used += 6 * piece;
+    }
+    // The last byte's comma is still in the buffer, since nothing was reserved after it
+    if (packet_size > 0) {
+        --sink->used;
+    }
+    append_string(sink, " ]\n");
+}
+
+static void write_raw(PacketSink *const sink, const uint32_t source_index, const uint8_t *const packet, const int64_t packet_size) {
+    uint8_t *const header = (uint8_t*)reserve(sink, 8);
+    for (int i = 0; i < 4; ++i) {
+        header[i] = (uint8_t)((uint64_t)packet_size >> (8 * i));
+        header[4 + i] = (uint8_t)(source_index >> (8 * i));
+    }
+    sink->used += 8;
+    append(sink, packet, packet_size);
+}
+
+static void write_jsonl(PacketSink *const sink, const char *const source, const uint8_t *const packet, const int64_t packet_size) {
+    // Packets are frames of the ICD in stream_parser.h
+    const int type_offset = 2 + ICD_STREAM_LENGTH_SIZE;
+    append_string(sink, "{\"source\":\"");
+    append_json_string(sink, source);
+    append_string(sink, "\",\"length\":");
+    append_decimal(sink, (uint64_t)packet_size);
+    append_string(sink, ",\"type\":\"");
+    if (packet_size >= type_offset + ICD_STREAM_TYPE_SIZE) {
+        append_hex(sink, packet + type_offset, ICD_STREAM_TYPE_SIZE);
+    }
+    append_string(sink, "\",\"data\":\"");
+    append_hex(sink, packet, packet_size);
+    append_string(sink, "\"}\n");
+}
+
+int packet_sink_parse_format(const char *const name, PacketSinkFormat *const format) {
+    static const char *const names[] = { "text", "raw", "jsonl", "quiet" };
+    for (int i = PACKET_SINK_TEXT; i <= PACKET_SINK_QUIET; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            *format = (PacketSinkFormat)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+PacketSink *packet_sink_open(const int fd, const PacketSinkFormat format, const int64_t buffer_size, const double flush_interval) {
+    PacketSink *const sink = (PacketSink*)calloc(1, sizeof(PacketSink));
+    if (!sink) {
+        return NULL;
+    }
+    sink->capacity = buffer_size < MIN_BUFFER_SIZE ? MIN_BUFFER_SIZE : buffer_size;
+    sink->buffer = (char*)malloc((size_t)sink->capacity);
+    if (!sink->buffer) {
+        free(sink);
+        return NULL;
+    }
+    pthread_mutex_init(&sink->mutex, NULL);
+    sink->fd = fd;
+    sink->format = format;
+    sink->flush_interval_ns = flush_interval > 0 ? (uint64_t)(flush_interval * 1e9) : 0;
+    return sink;
+}
+
+void packet_sink_write(PacketSink *const sink, const char *const source, const uint32_t source_index, const uint8_t *const packet, const int64_t packet_size) {
+    if (sink->format == PACKET_SINK_QUIET) {
+        return;
+    }
+    pthread_mutex_lock(&sink->mutex);
+    if (!sink->failed) {
+        switch (sink->format) {
+            case PACKET_SINK_RAW:
+                write_raw(sink, source_index, packet, packet_size);
+                break;
+            case PACKET_SINK_JSONL:
+                write_jsonl(sink, source, packet, packet_size);
+                break;
+            case PACKET_SINK_TEXT:
+            default:
+                write_text(sink, source, packet, packet_size);
+                break;
+        }
+        // Read the clock only once per flush
+        if (sink->oldest_ns == 0 && sink->used > 0) {
+            sink->oldest_ns = monotonic_ns();
+        }
+    }
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+void packet_sink_write_message(PacketSink *const sink, const char *const message, const int64_t length) {
+    if (sink->format != PACKET_SINK_TEXT) {
+        return;
+    }
+    pthread_mutex_lock(&sink->mutex);
+    if (!sink->failed) {
+        append(sink, message, length);
+        if (sink->oldest_ns == 0 && sink->used > 0) {
+            sink->oldest_ns = monotonic_ns();
+        }
+    }
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+int packet_sink_flush(PacketSink *const sink) {
+    pthread_mutex_lock(&sink->mutex);
+    const int result = flush_locked(sink);
+    pthread_mutex_unlock(&sink->mutex);
+    return result;
+}
+
+int packet_sink_flush_if_due(PacketSink *const sink) {
+    pthread_mutex_lock(&sink->mutex);
+    int wait_ms = -1;
+    if (sink->used > 0) {
+        const uint64_t waited = monotonic_ns() - sink->oldest_ns;
+        if (waited >= sink->flush_interval_ns) {
+            flush_locked(sink);
+        } else {
+            wait_ms = (int)((sink->flush_interval_ns - waited + 999999) / 1000000);
+        }
+    }
+    pthread_mutex_unlock(&sink->mutex);
+    return wait_ms;
+}
+
+void packet_sink_close(PacketSink *const sink) {
+    if (!sink) {
+        return;
+    }
+    flush_locked(sink);
+    pthread_mutex_destroy(&sink->mutex);
+    free(sink->buffer);
+    free(sink);
+}
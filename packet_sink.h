@@ -0,0 +1,51 @@
+#ifndef PACKET_SINK_H
+#define PACKET_SINK_H
+
+#include <stdint.h>
+
+// Writes the packets the CLI receives, in one of several formats, through a large buffer that goes
+// out in one write() when it fills up or when its oldest byte has waited flush_interval seconds.
+// Any thread may write packets and flush, the sink serializes them.
+
+typedef enum {
+    // "[source] Received packet with length <n> bytes and contents: [ 0x2f, 0x2a, ... ]" lines
+    PACKET_SINK_TEXT,
+    // Binary records, integers little endian: uint32 frame length, uint32 source index, then the frame
+    PACKET_SINK_RAW,
+    // One JSON object per line: {"source":"...","length":<n>,"type":"<hex>","data":"<hex of the frame>"}
+    PACKET_SINK_JSONL,
+    // Nothing, for runs that only want the stats
+    PACKET_SINK_QUIET
+} PacketSinkFormat;
+
+#define PACKET_SINK_DEFAULT_BUFFER_SIZE (1 << 20)
+#define PACKET_SINK_DEFAULT_FLUSH_INTERVAL 0.05
+
+typedef struct PacketSink PacketSink;
+
+// Looks up a format by its name: "text", "raw", "jsonl" or "quiet". Returns 0 on success, -1 if unknown.
+extern int packet_sink_parse_format(const char *name, PacketSinkFormat *format);
+
+// Starts writing to fd, which stays open after packet_sink_close(). Returns NULL if out of memory.
+extern PacketSink *packet_sink_open(int fd, PacketSinkFormat format, int64_t buffer_size, double flush_interval);
+
+// Formats a packet into the buffer. source names the source in text and JSON lines,
+// source_index tags raw records.
+extern void packet_sink_write(PacketSink *sink, const char *source, uint32_t source_index, const uint8_t *packet, int64_t packet_size);
+
+// Adds a message, like an error line, between the text packets so it keeps its place among them
+// without a flush. The other formats have no room for messages and ignore it.
+extern void packet_sink_write_message(PacketSink *sink, const char *message, int64_t length);
+
+// Writes out whatever is buffered. Returns 0 on success, -1 on write errors, after which
+// packets are dropped.
+extern int packet_sink_flush(PacketSink *sink);
+
+// Flushes if the oldest buffered byte has waited flush_interval. Returns the milliseconds until
+// the next flush is due, rounded up, or -1 if nothing is buffered.
+extern int packet_sink_flush_if_due(PacketSink *sink);
+
+// Flushes and frees the sink. NULL is fine.
+extern void packet_sink_close(PacketSink *sink);
+
+#endif // PACKET_SINK_H
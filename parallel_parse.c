@@ -0,0 +1,288 @@
+#include "parallel_parse.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEFAULT_CHUNK_SIZE (8 << 20)
+// Chunks are pushed in pieces of this size, and the stitching compares parsers between pieces
+#define CHECKPOINT_SIZE 4096
+
+typedef struct {
+    int64_t offset;         // In the buffer, or -1 - offset in the collector's copies
+    int64_t length;
+} FoundPacket;
+
+// Packet callback data of every parser. Either stores where each packet is, or, for the parser
+// that is known to be in sync, passes it on right away.
+typedef struct {
+    const uint8_t *base;
+    int64_t push_start;     // Piece being pushed
+    int64_t push_end;
+    FoundPacket *packets;
+    int64_t count;
+    int64_t capacity;
+    // Packets the parser assembled in its own buffer (split across pieces, or found again inside
+    // a rejected packet that was), which is reused for the next one
+    uint8_t *copies;
+    int64_t copies_used;
+    int64_t copies_capacity;
+    int failed;             // Memory ran out
+    StreamParserPacketCallback callback; // Set: packets go out right away instead of being stored
+    void *callback_data;
+    int64_t emitted;
+} Collector;
+
+typedef struct {
+    StreamParser *parser;
+    Collector *collector;
+} ParserPair;
+
+// One thread's share of a round
+typedef struct {
+    ParserPair pair;
+    const StreamParserConfig *config;
+    const uint8_t *base;
+    int64_t start;
+    int64_t end;
+    // Per checkpoint (the start of every piece, and the end of the chunk): bytes the parser held
+    // there, and how many packets it had found before it
+    int64_t *held_at;
+    int64_t *count_at;
+    int64_t checkpoints;
+    int failed;
+} ChunkScan;
+
+static const uint8_t *found_packet_data(const Collector *const collector, const FoundPacket *const packet) {
+    return packet->offset >= 0 ? collector->base + packet->offset : collector->copies + (-1 - packet->offset);
+}
+
+static void collect_packet(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data) {
+    Collector *const collector = (Collector*)packet_callback_data;
+    if (collector->callback) {
+        collector->callback(packet_buffer, packet_size, collector->callback_data);
+        ++collector->emitted;
+        return;
+    }
+
+    // Packets found whole in the piece point into it, the rest have to be copied
+    const uintptr_t address = (uintptr_t)packet_buffer;
+    int64_t offset;
+    if (address >= (uintptr_t)(collector->base + collector->push_start) && address < (uintptr_t)(collector->base + collector->push_end)) {
+        offset = (int64_t)(address - (uintptr_t)collector->base);
+    } else {
+        if (collector->copies_used + packet_size > collector->copies_capacity) {
+            int64_t capacity = collector->copies_capacity ? collector->copies_capacity * 2 : 65536;
+            while (capacity < collector->copies_used + packet_size) {
+                capacity *= 2;
+            }
+            uint8_t *const copies = (uint8_t*)realloc(collector->copies, (size_t)capacity);
+            if (!copies) {
+                collector->failed = 1;
+                return;
+            }
+            collector->copies = copies;
+            collector->copies_capacity = capacity;
+        }
+        memcpy(collector->copies + collector->copies_used, packet_buffer, (size_t)packet_size);
+        offset = -1 - collector->copies_used;
+        collector->copies_used += packet_size;
+    }
+
+    if (collector->count == collector->capacity) {
+        const int64_t capacity = collector->capacity ? collector->capacity * 2 : 1024;
+        FoundPacket *const packets = (FoundPacket*)realloc(collector->packets, (size_t)capacity * sizeof(FoundPacket));
+        if (!packets) {
+            collector->failed = 1;
+            return;
+        }
+        collector->packets = packets;
+        collector->capacity = capacity;
+    }
+    collector->packets[collector->count].offset = offset;
+    collector->packets[collector->count].length = packet_size;
+    ++collector->count;
+}
+
+static void push_piece(const ParserPair *const pair, const int64_t start, const int64_t end) {
+    pair->collector->push_start = start;
+    pair->collector->push_end = end;
+    stream_parser_push_bytes(pair->parser, pair->collector->base + start, end - start, NULL);
+}
+
+static int open_pair(ParserPair *const pair, const StreamParserConfig *const config, const uint8_t *const base) {
+    pair->parser = stream_parser_open_ex(config);
+    pair->collector = (Collector*)calloc(1, sizeof(Collector));
+    if (!pair->parser || !pair->collector) {
+        return -1;
+    }
+    pair->collector->base = base;
+    stream_parser_register_packet_callback(pair->parser, collect_packet, pair->collector);
+    return 0;
+}
+
+static void close_pair(ParserPair *const pair) {
+    stream_parser_close(pair->parser);
+    if (pair->collector) {
+        free(pair->collector->packets);
+        free(pair->collector->copies);
+        free(pair->collector);
+    }
+    pair->parser = NULL;
+    pair->collector = NULL;
+}
+
+static int64_t checkpoint_position(const ChunkScan *const scan, const int64_t checkpoint) {
+    const int64_t position = scan->start + checkpoint * CHECKPOINT_SIZE;
+    return position < scan->end ? position : scan->end;
+}
+
+// Parses a chunk from scratch, noting the parser's state at every checkpoint
+static void *scan_chunk(void *const arg) {
+    ChunkScan *const scan = (ChunkScan*)arg;
+    close_pair(&scan->pair);
+    if (open_pair(&scan->pair, scan->config, scan->base) != 0) {
+        scan->failed = 1;
+        return NULL;
+    }
+    for (int64_t checkpoint = 0; checkpoint < scan->checkpoints; ++checkpoint) {
+        scan->held_at[checkpoint] = stream_parser_buffered_bytes(scan->pair.parser);
+        scan->count_at[checkpoint] = scan->pair.collector->count;
+        if (checkpoint + 1 < scan->checkpoints) {
+            push_piece(&scan->pair, checkpoint_position(scan, checkpoint), checkpoint_position(scan, checkpoint + 1));
+        }
+    }
+    scan->failed = scan->pair.collector->failed;
+    return NULL;
+}
+
+// Continues the in-sync parser into a scanned chunk until it agrees with the chunk's own parser,
+// then takes that parser's packets from there and makes it the in-sync one.
+static void stitch_chunk(ParserPair *const in_sync, ChunkScan *const scan, ParallelParseStats *const stats) {
+    int64_t checkpoint = 0;
+    while (checkpoint + 1 < scan->checkpoints && stream_parser_buffered_bytes(in_sync->parser) != scan->held_at[checkpoint]) {
+        const int64_t start = checkpoint_position(scan, checkpoint);
+        const int64_t end = checkpoint_position(scan, checkpoint + 1);
+        push_piece(in_sync, start, end);
+        stats->reparsed_bytes += end - start;
+        ++checkpoint;
+    }
+    if (stream_parser_buffered_bytes(in_sync->parser) != scan->held_at[checkpoint]) {
+        // Never agreed, so the in-sync parser went through the whole chunk itself
+        return;
+    }
+
+    const Collector *const found = scan->pair.collector;
+    for (int64_t i = scan->count_at[checkpoint]; i < found->count; ++i) {
+        in_sync->collector->callback(found_packet_data(found, &found->packets[i]), found->packets[i].length, in_sync->collector->callback_data);
+        ++in_sync->collector->emitted;
+    }
+    const ParserPair previous = *in_sync;
+    *in_sync = scan->pair;
+    in_sync->collector->callback = previous.collector->callback;
+    in_sync->collector->callback_data = previous.collector->callback_data;
+    in_sync->collector->emitted = previous.collector->emitted;
+    scan->pair = previous;
+}
+
+ParallelParseConfig parallel_parse_default_config() {
+    ParallelParseConfig config;
+    memset(&config, 0, sizeof config);
+    config.threads = 0;
+    config.chunk_size = DEFAULT_CHUNK_SIZE;
+    config.parser = stream_parser_default_config();
+    return config;
+}
+
+int parallel_parse(const ParallelParseConfig *const config, const uint8_t *const buffer, const int64_t length,
+                   const StreamParserPacketCallback callback, void *const packet_callback_data, ParallelParseStats *const stats) {
+    ParallelParseStats local_stats;
+    ParallelParseStats *const out = stats ? stats : &local_stats;
+    memset(out, 0, sizeof *out);
+    if (!config || !callback || length < 0 || (!buffer && length > 0) || config->threads < 0 || config->chunk_size <= 0) {
+        return -1;
+    }
+    int threads = config->threads;
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    const int64_t max_checkpoints = (config->chunk_size + CHECKPOINT_SIZE - 1) / CHECKPOINT_SIZE + 1;
+    // Two rounds' worth: one being scanned, the other being stitched
+    ChunkScan *const scans = (ChunkScan*)calloc((size_t)threads * 2, sizeof(ChunkScan));
+    pthread_t *const thread_ids = (pthread_t*)calloc((size_t)threads, sizeof(pthread_t));
+    int64_t *const checkpoint_memory = (int64_t*)malloc((size_t)(threads * 2 * max_checkpoints * 2) * sizeof(int64_t));
+    // The parser that has seen the stream from the start, so it is known to be in sync
+    ParserPair in_sync = { NULL, NULL };
+    int result = (scans && thread_ids && checkpoint_memory && open_pair(&in_sync, &config->parser, buffer) == 0) ? 0 : -1;
+    if (result == 0) {
+        in_sync.collector->callback = callback;
+        in_sync.collector->callback_data = packet_callback_data;
+    }
+    for (int t = 0; result == 0 && t < threads * 2; ++t) {
+        scans[t].config = &config->parser;
+        scans[t].base = buffer;
+        scans[t].held_at = checkpoint_memory + (int64_t)t * max_checkpoints * 2;
+        scans[t].count_at = scans[t].held_at + max_checkpoints;
+    }
+
+    // The threads scan a round while this thread stitches the one before it and hands out its
+    // packets, so slow packet callbacks don't leave the other CPUs idle
+    ChunkScan *scanning = scans;
+    ChunkScan *scanned = scans + threads;
+    int scanned_chunks = 0;
+    int64_t round_start = 0;
+    while (result == 0 && (round_start < length || scanned_chunks > 0)) {
+        int chunks = 0;
+        for (int t = 0; t < threads; ++t) {
+            const int64_t start = round_start + (int64_t)t * config->chunk_size;
+            if (start >= length) {
+                break;
+            }
+            scanning[t].start = start;
+            scanning[t].end = (length - start < config->chunk_size) ? length : start + config->chunk_size;
+            scanning[t].checkpoints = (scanning[t].end - start + CHECKPOINT_SIZE - 1) / CHECKPOINT_SIZE + 1;
+            scanning[t].failed = 0;
+            ++chunks;
+        }
+        round_start += (int64_t)chunks * config->chunk_size;
+
+        int started = 0;
+        for (int t = 0; t < chunks; ++t, ++started) {
+            if (pthread_create(&thread_ids[t], NULL, scan_chunk, &scanning[t]) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        for (int t = 0; result == 0 && t < scanned_chunks; ++t) {
+            if (scanned[t].failed) {
+                result = -1;
+                break;
+            }
+            stitch_chunk(&in_sync, &scanned[t], out);
+        }
+        for (int t = 0; t < started; ++t) {
+            pthread_join(thread_ids[t], NULL);
+        }
+        out->chunks += chunks;
+
+        ChunkScan *const next = scanned;
+        scanned = scanning;
+        scanning = next;
+        scanned_chunks = chunks;
+    }
+
+    if (in_sync.collector) {
+        out->packets = in_sync.collector->emitted;
+    }
+    out->bytes = result == 0 ? length : 0;
+    for (int t = 0; scans && t < threads * 2; ++t) {
+        close_pair(&scans[t].pair);
+    }
+    close_pair(&in_sync);
+    free(checkpoint_memory);
+    free(thread_ids);
+    free(scans);
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef PARALLEL_PARSE_H
+#define PARALLEL_PARSE_H
+
+#include <stdint.h>
+#include "stream_parser.h"
+
+// Offline parsing of a large in-memory buffer (typically a mapped dump file) on several threads.
+//
+// The buffer is processed in rounds of one chunk per thread. Every thread parses its chunk with a
+// fresh parser, as if the stream started there, so it resyncs on the first header candidate that
+// passes the length, checksum and trailer checks. The chunks of a round are then stitched in order
+// on the calling thread, while the threads scan the next round: the parser that knows the true
+// state at a chunk boundary keeps going into the next chunk until it holds exactly as many bytes as
+// that chunk's own parser did at the same position (see stream_parser_buffered_bytes()). From there
+// on both produce the same packets, so the rest of the chunk's packets are taken as they are. In
+// practice that happens within the first packet or two, and the packets come out exactly as from
+// one parser fed the whole buffer, in the same order.
+typedef struct {
+    int threads;              // 0 means one per online CPU
+    int64_t chunk_size;       // Bytes each thread parses per round
+    StreamParserConfig parser;
+} ParallelParseConfig;
+
+typedef struct {
+    int64_t bytes;
+    int64_t packets;
+    int64_t chunks;
+    // Bytes parsed a second time at chunk boundaries, until the stitching parsers agreed
+    int64_t reparsed_bytes;
+} ParallelParseStats;
+
+extern ParallelParseConfig parallel_parse_default_config();
+
+// Parses buffer[0, length) and calls callback for every packet, in stream order, on the calling
+// thread. packet_buffer is only valid during the call, as with a StreamParser. stats may be NULL.
+// Returns 0 on success, -1 on invalid arguments or when threads or memory couldn't be had.
+extern int parallel_parse(const ParallelParseConfig *config, const uint8_t *buffer, int64_t length,
+                          StreamParserPacketCallback callback, void *packet_callback_data, ParallelParseStats *stats);
+
+#endif // PARALLEL_PARSE_H
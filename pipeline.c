@@ -0,0 +1,733 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#include "pipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define CACHE_LINE 64
+#define DEFAULT_RING_CHUNKS 8
+#define DEFAULT_CHUNK_SIZE 16384
+#define MAX_EPOLL_EVENTS 64
+// Upper bound on how long an idle thread sleeps before looking at the stop flag again
+#define IDLE_TIMEOUT_MS 100
+// Packets the sink takes from one worker before moving on to the next
+#define SINK_BATCH 64
+
+// Lets a consumer sleep when its queues are empty without the producer paying a syscall per item:
+// the producer only writes the eventfd when the consumer announced it's about to sleep.
+typedef struct {
+    _Atomic int sleeping;
+    int fd;
+} Waker;
+
+// Counters written by one thread and read by any, like the parser's stats
+typedef struct {
+    _Atomic uint64_t items;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t stalls;
+    _Atomic int64_t peak_queue_depth;
+} __attribute__((aligned(CACHE_LINE))) StageCounters;
+
+typedef struct {
+    int64_t length;
+    uint64_t arrival_ns;
+    uint8_t *data;
+} Chunk;
+
+typedef struct IoThread IoThread;
+typedef struct Worker Worker;
+
+typedef struct {
+    int index;
+    IoSource *source;
+    StreamParser *parser;
+    IoThread *io_thread;
+    Worker *worker;
+
+    // Ring of chunks, written by the I/O thread and read by the worker
+    Chunk *chunks;
+    uint64_t ring_mask;
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE)));
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE)));
+
+    // Set by the I/O thread while the source isn't being read because the ring is full
+    _Atomic int paused;
+    // Set by the I/O thread once the source is gone and the last chunk is in the ring
+    _Atomic int closed;
+    // Worker side: closed and drained
+    int finished;
+} Source;
+
+// Packet on its way to the sink
+typedef struct {
+    PacketPoolRef packet;
+    int source_index;
+} SinkEntry;
+
+struct IoThread {
+    Pipeline *pipeline;
+    pthread_t thread;
+    int cpu;
+    Source **sources;
+    int source_count;
+    Waker waker; // Workers use it to say a paused source has room again
+    StageCounters counters;
+};
+
+struct Worker {
+    Pipeline *pipeline;
+    pthread_t thread;
+    int cpu;
+    Source **sources;
+    int source_count;
+    Waker waker;
+
+    // Ring of packets for the sink, written by this worker and read by the sink
+    SinkEntry *sink_entries;
+    uint64_t sink_mask;
+    _Atomic uint64_t sink_head __attribute__((aligned(CACHE_LINE)));
+    _Atomic uint64_t sink_tail __attribute__((aligned(CACHE_LINE)));
+    _Atomic int done;
+
+    StageCounters counters;
+};
+
+struct Pipeline {
+    PipelineConfig config;
+    Source *sources;
+    int source_count;
+    IoThread *io_threads;
+    Worker *workers;
+    PacketPool *pool;
+
+    PipelineSinkCallback sink_callback;
+    void *sink_callback_data;
+    pthread_t sink_thread;
+    int sink_cpu;
+    Waker sink_waker;
+    StageCounters sink_counters;
+    _Atomic int sink_done;
+
+    _Atomic int stop;
+    int started;
+};
+
+static inline void counter_add(_Atomic uint64_t *const counter, const uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static inline void track_depth(StageCounters *const counters, const int64_t depth) {
+    if (depth > atomic_load_explicit(&counters->peak_queue_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&counters->peak_queue_depth, depth, memory_order_relaxed);
+    }
+}
+
+static int waker_init(Waker *const waker) {
+    atomic_init(&waker->sleeping, 0);
+    waker->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return waker->fd < 0 ? -1 : 0;
+}
+
+static void waker_destroy(Waker *const waker) {
+    if (waker->fd >= 0) {
+        close(waker->fd);
+        waker->fd = -1;
+    }
+}
+
+static void waker_drain(Waker *const waker) {
+    uint64_t value;
+    if (read(waker->fd, &value, sizeof value) < 0) {
+        // Nothing pending
+    }
+}
+
+static void waker_notify(Waker *const waker) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&waker->sleeping, memory_order_relaxed)) {
+        const uint64_t one = 1;
+        if (write(waker->fd, &one, sizeof one) < 0) {
+            // Counter full, the consumer is getting woken up anyway
+        }
+    }
+}
+
+// The consumer announces it's going to sleep, then has to check for work once more before calling waker_sleep()
+static void waker_prepare(Waker *const waker) {
+    atomic_store_explicit(&waker->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void waker_sleep(Waker *const waker, const int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = waker->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout_ms);
+    atomic_store_explicit(&waker->sleeping, 0, memory_order_relaxed);
+    waker_drain(waker);
+}
+
+static void waker_cancel(Waker *const waker) {
+    atomic_store_explicit(&waker->sleeping, 0, memory_order_relaxed);
+}
+
+static void pin_thread(const int cpu, const char *const stage) {
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (error) {
+        printf("Failed to pin %s thread to CPU %d: %s\n", stage, cpu, strerror(error));
+        fflush(stdout);
+    }
+}
+
+static uint64_t round_up_pow2(const uint64_t value) {
+    uint64_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+static int ring_full(Source *const source) {
+    return atomic_load_explicit(&source->head, memory_order_relaxed) - atomic_load_explicit(&source->tail, memory_order_acquire) > source->ring_mask;
+}
+
+static void pause_source(IoThread *const io_thread, const int epoll_fd, Source *const source) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->source->fd, NULL);
+    atomic_store_explicit(&source->paused, 1, memory_order_relaxed);
+    counter_add(&io_thread->counters.stalls, 1);
+}
+
+static int resume_source(const int epoll_fd, Source *const source) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    atomic_store_explicit(&source->paused, 0, memory_order_relaxed);
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->source->fd, &event);
+}
+
+static void close_source(Source *const source) {
+    atomic_store_explicit(&source->closed, 1, memory_order_release);
+    waker_notify(&source->worker->waker);
+}
+
+static void *io_thread_main(void *const arg) {
+    IoThread *const io_thread = (IoThread*)arg;
+    Pipeline *const pipeline = io_thread->pipeline;
+    pin_thread(io_thread->cpu, "I/O");
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The waker
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, io_thread->waker.fd, &event) != 0) {
+        perror("Error setting up I/O thread epoll");
+        for (int i = 0; i < io_thread->source_count; ++i) {
+            close_source(io_thread->sources[i]);
+        }
+        return NULL;
+    }
+    int open_sources = 0;
+    for (int i = 0; i < io_thread->source_count; ++i) {
+        if (resume_source(epoll_fd, io_thread->sources[i]) == 0) {
+            ++open_sources;
+        } else {
+            close_source(io_thread->sources[i]);
+        }
+    }
+    // The waker is only written to when a worker frees room in a paused source's ring
+    atomic_store_explicit(&io_thread->waker.sleeping, 1, memory_order_relaxed);
+
+    while (open_sources > 0 && !atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        const int ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, IDLE_TIMEOUT_MS);
+        if (ready < 0 && errno != EINTR) {
+            perror("Error from epoll_wait");
+            break;
+        }
+        for (int e = 0; e < ready; ++e) {
+            Source *const source = (Source*)events[e].data.ptr;
+            if (!source) {
+                waker_drain(&io_thread->waker);
+                for (int i = 0; i < io_thread->source_count; ++i) {
+                    Source *const paused = io_thread->sources[i];
+                    if (atomic_load_explicit(&paused->paused, memory_order_relaxed) && !atomic_load_explicit(&paused->closed, memory_order_relaxed) &&
+                        !ring_full(paused)) {
+                        resume_source(epoll_fd, paused);
+                    }
+                }
+                continue;
+            }
+            if (ring_full(source)) {
+                pause_source(io_thread, epoll_fd, source);
+                // The worker may have made room before it could see the pause
+                atomic_thread_fence(memory_order_seq_cst);
+                if (!ring_full(source)) {
+                    resume_source(epoll_fd, source);
+                }
+                continue;
+            }
+
+            // One read per ready source per round, straight into the ring
+            const uint64_t head = atomic_load_explicit(&source->head, memory_order_relaxed);
+            Chunk *const chunk = &source->chunks[head & source->ring_mask];
+            const ssize_t n = io_source_read(source->source, chunk->data, (size_t)pipeline->config.chunk_size, &chunk->arrival_ns);
+            if (n < 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->source->fd, NULL);
+                close_source(source);
+                --open_sources;
+            } else if (n > 0) {
+                chunk->length = n;
+                atomic_store_explicit(&source->head, head + 1, memory_order_release);
+                counter_add(&io_thread->counters.items, 1);
+                counter_add(&io_thread->counters.bytes, (uint64_t)n);
+                track_depth(&io_thread->counters, (int64_t)(head + 1 - atomic_load_explicit(&source->tail, memory_order_relaxed)));
+                waker_notify(&source->worker->waker);
+            }
+        }
+    }
+
+    // Sources still open when stopping end here too, so workers don't wait on them
+    for (int i = 0; i < io_thread->source_count; ++i) {
+        if (!atomic_load_explicit(&io_thread->sources[i]->closed, memory_order_relaxed)) {
+            close_source(io_thread->sources[i]);
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+// Called on the worker thread for every packet one of its parsers collects
+static void forward_to_sink(const PacketPoolRef packet, void *const pooled_packet_callback_data) {
+    Source *const source = (Source*)pooled_packet_callback_data;
+    Worker *const worker = source->worker;
+    Pipeline *const pipeline = worker->pipeline;
+
+    const uint64_t head = atomic_load_explicit(&worker->sink_head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&worker->sink_tail, memory_order_acquire) > worker->sink_mask) {
+        if (pipeline->config.pool.exhaustion != PACKET_POOL_BLOCK || atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) {
+            counter_add(&worker->counters.stalls, 1);
+            return;
+        }
+        waker_notify(&pipeline->sink_waker);
+        sched_yield();
+    }
+    packet_pool_retain(packet);
+    SinkEntry *const entry = &worker->sink_entries[head & worker->sink_mask];
+    entry->packet = packet;
+    entry->source_index = source->index;
+    atomic_store_explicit(&worker->sink_head, head + 1, memory_order_release);
+    track_depth(&worker->counters, (int64_t)(head + 1 - atomic_load_explicit(&worker->sink_tail, memory_order_relaxed)));
+    waker_notify(&pipeline->sink_waker);
+}
+
+// Parses at most one chunk of every source. Returns the number of chunks parsed, -1 once all sources are finished.
+static int worker_round(Worker *const worker) {
+    int parsed = 0;
+    int active = 0;
+    for (int i = 0; i < worker->source_count; ++i) {
+        Source *const source = worker->sources[i];
+        if (source->finished) {
+            continue;
+        }
+        ++active;
+        const uint64_t tail = atomic_load_explicit(&source->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&source->head, memory_order_acquire)) {
+            // closed is set after the last chunk was published, so look at head again after it
+            if (atomic_load_explicit(&source->closed, memory_order_acquire) &&
+                tail == atomic_load_explicit(&source->head, memory_order_acquire)) {
+                source->finished = 1;
+            }
+            continue;
+        }
+        const Chunk *const chunk = &source->chunks[tail & source->ring_mask];
+        stream_parser_set_arrival_time(source->parser, chunk->arrival_ns);
+        stream_parser_push_bytes(source->parser, chunk->data, chunk->length, NULL);
+        counter_add(&worker->counters.items, 1);
+        counter_add(&worker->counters.bytes, (uint64_t)chunk->length);
+        atomic_store_explicit(&source->tail, tail + 1, memory_order_release);
+        ++parsed;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&source->paused, memory_order_relaxed)) {
+            waker_notify(&source->io_thread->waker);
+        }
+    }
+    return active == 0 ? -1 : parsed;
+}
+
+static void *worker_main(void *const arg) {
+    Worker *const worker = (Worker*)arg;
+    Pipeline *const pipeline = worker->pipeline;
+    pin_thread(worker->cpu, "worker");
+
+    while (!atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) {
+        const int parsed = worker_round(worker);
+        if (parsed < 0) {
+            break;
+        }
+        if (parsed == 0) {
+            waker_prepare(&worker->waker);
+            if (worker_round(worker) != 0) {
+                waker_cancel(&worker->waker);
+                continue;
+            }
+            waker_sleep(&worker->waker, IDLE_TIMEOUT_MS);
+        }
+    }
+    atomic_store_explicit(&worker->done, 1, memory_order_release);
+    waker_notify(&pipeline->sink_waker);
+    return NULL;
+}
+
+// Delivers up to SINK_BATCH packets from every worker. Returns the number of packets taken.
+static int sink_round(Pipeline *const pipeline) {
+    int taken = 0;
+    for (int w = 0; w < pipeline->config.workers; ++w) {
+        Worker *const worker = &pipeline->workers[w];
+        uint64_t tail = atomic_load_explicit(&worker->sink_tail, memory_order_relaxed);
+        const uint64_t head = atomic_load_explicit(&worker->sink_head, memory_order_acquire);
+        for (int n = 0; tail != head && n < SINK_BATCH; ++tail, ++n, ++taken) {
+            const SinkEntry *const entry = &worker->sink_entries[tail & worker->sink_mask];
+            if (packet_pool_claim(entry->packet) != 0) {
+                counter_add(&pipeline->sink_counters.stalls, 1);
+                continue;
+            }
+            int64_t packet_size;
+            const uint8_t *const packet = packet_pool_data(entry->packet, &packet_size);
+            if (pipeline->sink_callback) {
+                pipeline->sink_callback(entry->source_index, packet, packet_size, pipeline->sink_callback_data);
+            }
+            packet_pool_release(entry->packet);
+            counter_add(&pipeline->sink_counters.items, 1);
+            counter_add(&pipeline->sink_counters.bytes, (uint64_t)packet_size);
+        }
+        atomic_store_explicit(&worker->sink_tail, tail, memory_order_release);
+    }
+    return taken;
+}
+
+static int workers_done(Pipeline *const pipeline) {
+    for (int w = 0; w < pipeline->config.workers; ++w) {
+        if (!atomic_load_explicit(&pipeline->workers[w].done, memory_order_acquire)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *sink_main(void *const arg) {
+    Pipeline *const pipeline = (Pipeline*)arg;
+    pin_thread(pipeline->sink_cpu, "sink");
+
+    // Runs until the workers are done even when stopping, since a worker may be waiting for the
+    // sink to release pool slots
+    for (;;) {
+        if (sink_round(pipeline) > 0) {
+            continue;
+        }
+        // Workers publish everything before done, so one more round after seeing it catches the rest
+        if (workers_done(pipeline)) {
+            if (sink_round(pipeline) == 0) {
+                break;
+            }
+            continue;
+        }
+        waker_prepare(&pipeline->sink_waker);
+        if (sink_round(pipeline) > 0 || workers_done(pipeline)) {
+            waker_cancel(&pipeline->sink_waker);
+            continue;
+        }
+        waker_sleep(&pipeline->sink_waker, IDLE_TIMEOUT_MS);
+    }
+    atomic_store_explicit(&pipeline->sink_done, 1, memory_order_release);
+    return NULL;
+}
+
+PipelineConfig pipeline_default_config() {
+    PipelineConfig config;
+    memset(&config, 0, sizeof config);
+    config.io_threads = 1;
+    config.workers = 1;
+    config.ring_chunks = DEFAULT_RING_CHUNKS;
+    config.chunk_size = DEFAULT_CHUNK_SIZE;
+    config.parser = stream_parser_default_config();
+    config.pool = packet_pool_default_config(0);
+    config.pool.exhaustion = PACKET_POOL_DROP_OLDEST;
+    return config;
+}
+
+static int cpu_for_thread(const PipelineConfig *const config, const int thread_index) {
+    return (config->cpus && thread_index < config->cpu_count) ? config->cpus[thread_index] : -1;
+}
+
+Pipeline *pipeline_open(const PipelineConfig *const config, IoSource *const *const sources, const int source_count,
+                        const PipelineSinkCallback callback, void *const sink_callback_data) {
+    if (!config || !sources || source_count <= 0 || config->io_threads <= 0 || config->workers <= 0 ||
+        config->ring_chunks <= 0 || config->chunk_size <= 0) {
+        return NULL;
+    }
+    Pipeline *const pipeline = (Pipeline*)calloc(1, sizeof(Pipeline));
+    if (!pipeline) return NULL;
+    pipeline->config = *config;
+    pipeline->source_count = source_count;
+    pipeline->sink_callback = callback;
+    pipeline->sink_callback_data = sink_callback_data;
+    pipeline->sink_cpu = cpu_for_thread(config, config->io_threads + config->workers);
+    pipeline->sink_waker.fd = -1;
+
+    pipeline->config.pool.slot_size = (int64_t)config->parser.max_payload_size + STREAM_PARSER_FRAME_OVERHEAD;
+    pipeline->pool = packet_pool_open(&pipeline->config.pool);
+    pipeline->sources = (Source*)calloc((size_t)source_count, sizeof(Source));
+    pipeline->io_threads = (IoThread*)calloc((size_t)config->io_threads, sizeof(IoThread));
+    pipeline->workers = (Worker*)calloc((size_t)config->workers, sizeof(Worker));
+    if (!pipeline->pool || !pipeline->sources || !pipeline->io_threads || !pipeline->workers ||
+        waker_init(&pipeline->sink_waker) != 0) {
+        pipeline_close(pipeline);
+        return NULL;
+    }
+
+    // Sources are dealt out round robin, and every thread gets an array of the ones it owns
+    const uint64_t sink_slots = round_up_pow2((uint64_t)pipeline->config.pool.slot_count);
+    for (int t = 0; t < config->io_threads; ++t) {
+        IoThread *const io_thread = &pipeline->io_threads[t];
+        io_thread->pipeline = pipeline;
+        io_thread->cpu = cpu_for_thread(config, t);
+        io_thread->waker.fd = -1;
+        io_thread->sources = (Source**)calloc((size_t)source_count, sizeof(Source*));
+        if (!io_thread->sources || waker_init(&io_thread->waker) != 0) {
+            pipeline_close(pipeline);
+            return NULL;
+        }
+    }
+    for (int w = 0; w < config->workers; ++w) {
+        Worker *const worker = &pipeline->workers[w];
+        worker->pipeline = pipeline;
+        worker->cpu = cpu_for_thread(config, config->io_threads + w);
+        worker->waker.fd = -1;
+        worker->sources = (Source**)calloc((size_t)source_count, sizeof(Source*));
+        worker->sink_entries = (SinkEntry*)calloc(sink_slots, sizeof(SinkEntry));
+        worker->sink_mask = sink_slots - 1;
+        if (!worker->sources || !worker->sink_entries || waker_init(&worker->waker) != 0) {
+            pipeline_close(pipeline);
+            return NULL;
+        }
+    }
+
+    const uint64_t ring_chunks = round_up_pow2((uint64_t)config->ring_chunks);
+    for (int i = 0; i < source_count; ++i) {
+        Source *const source = &pipeline->sources[i];
+        source->index = i;
+        source->source = sources[i];
+        source->io_thread = &pipeline->io_threads[i % config->io_threads];
+        source->worker = &pipeline->workers[i % config->workers];
+        source->io_thread->sources[source->io_thread->source_count++] = source;
+        source->worker->sources[source->worker->source_count++] = source;
+        source->ring_mask = ring_chunks - 1;
+        source->parser = stream_parser_open_ex(&config->parser);
+        source->chunks = (Chunk*)calloc(ring_chunks, sizeof(Chunk));
+        uint8_t *const data = (uint8_t*)malloc(ring_chunks * (size_t)config->chunk_size);
+        if (!source->parser || !source->chunks || !data ||
+            stream_parser_register_pooled_packet_callback(source->parser, pipeline->pool, forward_to_sink, source) != STREAM_PARSER_OK) {
+            free(data);
+            pipeline_close(pipeline);
+            return NULL;
+        }
+        for (uint64_t c = 0; c < ring_chunks; ++c) {
+            source->chunks[c].data = data + c * (size_t)config->chunk_size;
+        }
+    }
+    return pipeline;
+}
+
+StreamParser *pipeline_parser(Pipeline *const pipeline, const int source_index) {
+    if (!pipeline || source_index < 0 || source_index >= pipeline->source_count) {
+        return NULL;
+    }
+    return pipeline->sources[source_index].parser;
+}
+
+int pipeline_start(Pipeline *const pipeline) {
+    if (!pipeline || pipeline->started) {
+        return -1;
+    }
+    pipeline->started = 1;
+    // Consumers first, so nothing produced waits for a thread that doesn't exist yet
+    if (pthread_create(&pipeline->sink_thread, NULL, sink_main, pipeline) != 0) {
+        pipeline->started = 0;
+        return -1;
+    }
+    int started_workers = 0;
+    int started_io_threads = 0;
+    for (; started_workers < pipeline->config.workers; ++started_workers) {
+        Worker *const worker = &pipeline->workers[started_workers];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            break;
+        }
+    }
+    if (started_workers == pipeline->config.workers) {
+        for (; started_io_threads < pipeline->config.io_threads; ++started_io_threads) {
+            IoThread *const io_thread = &pipeline->io_threads[started_io_threads];
+            if (pthread_create(&io_thread->thread, NULL, io_thread_main, io_thread) != 0) {
+                break;
+            }
+        }
+    }
+    if (started_io_threads == pipeline->config.io_threads) {
+        return 0;
+    }
+
+    // Tear down whatever started
+    atomic_store_explicit(&pipeline->stop, 1, memory_order_relaxed);
+    for (int t = 0; t < started_io_threads; ++t) {
+        pthread_join(pipeline->io_threads[t].thread, NULL);
+    }
+    for (int w = 0; w < started_workers; ++w) {
+        waker_notify(&pipeline->workers[w].waker);
+        pthread_join(pipeline->workers[w].thread, NULL);
+    }
+    waker_notify(&pipeline->sink_waker);
+    pthread_join(pipeline->sink_thread, NULL);
+    pipeline->started = 0;
+    return -1;
+}
+
+int pipeline_running(Pipeline *const pipeline) {
+    return pipeline && pipeline->started && !atomic_load_explicit(&pipeline->sink_done, memory_order_acquire);
+}
+
+void pipeline_stop(Pipeline *const pipeline) {
+    if (!pipeline || !pipeline->started) {
+        return;
+    }
+    atomic_store_explicit(&pipeline->stop, 1, memory_order_relaxed);
+    for (int t = 0; t < pipeline->config.io_threads; ++t) {
+        const uint64_t one = 1;
+        if (write(pipeline->io_threads[t].waker.fd, &one, sizeof one) < 0) {
+            // Wakes up within IDLE_TIMEOUT_MS anyway
+        }
+        pthread_join(pipeline->io_threads[t].thread, NULL);
+    }
+    for (int w = 0; w < pipeline->config.workers; ++w) {
+        waker_notify(&pipeline->workers[w].waker);
+        pthread_join(pipeline->workers[w].thread, NULL);
+    }
+    waker_notify(&pipeline->sink_waker);
+    pthread_join(pipeline->sink_thread, NULL);
+    pipeline->started = 0;
+}
+
+void pipeline_close(Pipeline *pipeline) {
+    if (!pipeline) {
+        return;
+    }
+    pipeline_stop(pipeline);
+    if (pipeline->workers) {
+        for (int w = 0; w < pipeline->config.workers; ++w) {
+            Worker *const worker = &pipeline->workers[w];
+            // Packets the sink never got to still hold a reference
+            if (worker->sink_entries) {
+                const uint64_t head = atomic_load_explicit(&worker->sink_head, memory_order_relaxed);
+                for (uint64_t tail = atomic_load_explicit(&worker->sink_tail, memory_order_relaxed); tail != head; ++tail) {
+                    packet_pool_release(worker->sink_entries[tail & worker->sink_mask].packet);
+                }
+            }
+            free(worker->sink_entries);
+            free(worker->sources);
+            if (worker->pipeline) {
+                waker_destroy(&worker->waker);
+            }
+        }
+    }
+    if (pipeline->io_threads) {
+        for (int t = 0; t < pipeline->config.io_threads; ++t) {
+            free(pipeline->io_threads[t].sources);
+            if (pipeline->io_threads[t].pipeline) {
+                waker_destroy(&pipeline->io_threads[t].waker);
+            }
+        }
+    }
+    if (pipeline->sources) {
+        for (int i = 0; i < pipeline->source_count; ++i) {
+            stream_parser_close(pipeline->sources[i].parser);
+            if (pipeline->sources[i].chunks) {
+                free(pipeline->sources[i].chunks[0].data);
+            }
+            free(pipeline->sources[i].chunks);
+        }
+    }
+    waker_destroy(&pipeline->sink_waker);
+    packet_pool_close(pipeline->pool);
+    free(pipeline->sources);
+    free(pipeline->io_threads);
+    free(pipeline->workers);
+    free(pipeline);
+}
+
+int pipeline_stage_threads(const Pipeline *const pipeline, const PipelineStage stage) {
+    if (!pipeline) {
+        return 0;
+    }
+    switch (stage) {
+        case PIPELINE_STAGE_IO: return pipeline->config.io_threads;
+        case PIPELINE_STAGE_WORKER: return pipeline->config.workers;
+        case PIPELINE_STAGE_SINK: return 1;
+    }
+    return 0;
+}
+
+static void read_counters(const StageCounters *const counters, PipelineStageStats *const stats) {
+    stats->items = atomic_load_explicit(&counters->items, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&counters->bytes, memory_order_relaxed);
+    stats->stalls = atomic_load_explicit(&counters->stalls, memory_order_relaxed);
+    stats->peak_queue_depth = atomic_load_explicit(&counters->peak_queue_depth, memory_order_relaxed);
+    stats->queue_depth = 0;
+}
+
+static int64_t ring_depth(_Atomic uint64_t *const head, _Atomic uint64_t *const tail) {
+    // Tail first, so a concurrent push and pop can't make it look negative
+    const uint64_t read_tail = atomic_load_explicit(tail, memory_order_acquire);
+    return (int64_t)(atomic_load_explicit(head, memory_order_acquire) - read_tail);
+}
+
+int pipeline_get_stage_stats(Pipeline *const pipeline, const PipelineStage stage, const int index, PipelineStageStats *const stats) {
+    if (!pipeline || !stats || index < 0 || index >= pipeline_stage_threads(pipeline, stage)) {
+        return -1;
+    }
+    if (stage == PIPELINE_STAGE_IO) {
+        IoThread *const io_thread = &pipeline->io_threads[index];
+        read_counters(&io_thread->counters, stats);
+        for (int i = 0; i < io_thread->source_count; ++i) {
+            stats->queue_depth += ring_depth(&io_thread->sources[i]->head, &io_thread->sources[i]->tail);
+        }
+    } else if (stage == PIPELINE_STAGE_WORKER) {
+        Worker *const worker = &pipeline->workers[index];
+        read_counters(&worker->counters, stats);
+        stats->queue_depth = ring_depth(&worker->sink_head, &worker->sink_tail);
+    } else {
+        read_counters(&pipeline->sink_counters, stats);
+    }
+    return 0;
+}
+
+void pipeline_get_pool_stats(Pipeline *const pipeline, PacketPoolStats *const stats) {
+    if (pipeline) {
+        packet_pool_get_stats(pipeline->pool, stats);
+    }
+}
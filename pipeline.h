@@ -0,0 +1,90 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include "io_source.h"
+#include "packet_pool.h"
+#include "stream_parser.h"
+
+// Multi-threaded ingest: I/O threads -> parser workers -> one sink thread.
+//
+// Every source belongs to one I/O thread and one worker. The I/O thread reads straight into the
+// source's own single-producer single-consumer ring of chunks, and the worker parses them from there.
+// A source whose ring is full stops being read (backpressure stays on that one link, the kernel
+// buffers it) until its worker catches up, so a hot link can't starve the others. Workers take at
+// most one chunk per source per round for the same reason.
+// Parsed packets are copied into a shared PacketPool and handed to the sink thread through one
+// ring per worker, and the sink calls the sink callback with them. A slow sink only costs packets
+// (according to the pool's exhaustion policy), never reads.
+typedef struct Pipeline Pipeline;
+
+// Called on the sink thread for every packet. packet_buffer is only valid during the call.
+typedef void (*PipelineSinkCallback)(int source_index, const uint8_t *const packet_buffer, int64_t packet_size, void *const sink_callback_data);
+
+typedef struct {
+    int io_threads;               // At least 1
+    int workers;                  // At least 1
+    // CPUs to pin threads to, in order: I/O threads, workers, the sink. Threads past the end
+    // of the list (or all of them for cpu_count 0) aren't pinned.
+    const int *cpus;
+    int cpu_count;
+    int64_t ring_chunks;          // Chunks each source's ring holds, rounded up to a power of 2
+    // Largest read per syscall. UDP datagrams longer than this are truncated.
+    int64_t chunk_size;
+    StreamParserConfig parser;    // Used for every source's parser
+    // Shared by all workers. Its slot_size is derived from the parser configuration.
+    PacketPoolConfig pool;
+} PipelineConfig;
+
+typedef enum {
+    PIPELINE_STAGE_IO,
+    PIPELINE_STAGE_WORKER,
+    PIPELINE_STAGE_SINK
+} PipelineStage;
+
+// Counters of one thread of a stage.
+typedef struct {
+    uint64_t items;            // Chunks read (I/O), chunks parsed (worker) or packets delivered (sink)
+    uint64_t bytes;            // Bytes in those items
+    // Backpressure events. I/O: times a source was paused on a full ring.
+    // Worker: packets dropped on a full sink queue. Sink: packets the pool dropped before delivery.
+    uint64_t stalls;
+    int64_t queue_depth;       // Items waiting in the queues this thread feeds (none for the sink)
+    int64_t peak_queue_depth;  // Largest queue_depth seen by a single queue
+} PipelineStageStats;
+
+extern PipelineConfig pipeline_default_config();
+
+// Creates the pipeline for already opened sources, without starting any thread.
+// The sources stay owned by the caller but must not be read from anyone else.
+// Returns NULL on invalid configuration or when memory ran out.
+extern Pipeline *pipeline_open(const PipelineConfig *config, IoSource *const *sources, int source_count, PipelineSinkCallback callback, void *sink_callback_data);
+
+// Parser of a source, for registering error callbacks before pipeline_start() (they are called on
+// the worker's thread) and for stream_parser_get_stats() from any one thread at any time.
+extern StreamParser *pipeline_parser(Pipeline *pipeline, int source_index);
+
+// Starts all threads. Returns 0 on success, -1 otherwise.
+extern int pipeline_start(Pipeline *pipeline);
+
+// Nonzero until every source was closed and everything read from them went through the sink.
+extern int pipeline_running(Pipeline *pipeline);
+
+// Stops all threads and waits for them. Chunks not parsed yet are dropped, packets already
+// parsed still go through the sink.
+extern void pipeline_stop(Pipeline *pipeline);
+
+// Stops the pipeline if needed and frees it. Doesn't close the sources.
+extern void pipeline_close(Pipeline *pipeline);
+
+// Number of threads in a stage.
+extern int pipeline_stage_threads(const Pipeline *pipeline, PipelineStage stage);
+
+// Copies the counters of thread index of a stage into stats. Can be called from any thread.
+// Returns 0 on success, -1 for an invalid stage or index.
+extern int pipeline_get_stage_stats(Pipeline *pipeline, PipelineStage stage, int index, PipelineStageStats *stats);
+
+// Counters of the packet pool shared by the workers.
+extern void pipeline_get_pool_stats(Pipeline *pipeline, PacketPoolStats *stats);
+
+#endif // PIPELINE_H
@@ -1,280 +1,813 @@
 #include "stream_parser.h"
 #include "crc32.h"
+#include "icd_descriptor.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef STREAM_PARSER_USDT
+#include <sys/sdt.h>
+#endif
+#if defined(STREAM_PARSER_CYCLE_COUNTS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 #define ERROR_CONTEXT_SIZE 512
-#define GENERAL_USE_BUFFER_SIZE 512
-#define DATA_BUFFER_SIZE 64 // Max packet size according to our ICD is 49
+
+// In incremental CRC mode, bulk pushes let up to this many body bytes pile up before folding them
+// into the running CRC, so that the wide CRC kernels get blocks worth their setup cost. It also
+// bounds the CRC work left to do when the last checksum byte arrives.
+#define CRC_FOLD_BLOCK 256
+
+// Room for copies of staged packets in a batch when there's no byte limit to size it by
+#define DEFAULT_BATCH_ARENA_SIZE 16384
+
+// Frame layout, from the ICD in icd_descriptor.h:
+// header 2 bytes, length 2 bytes, message type 3 bytes, payload, checksum 4 bytes, trailer 2 bytes.
+#define HEADER_0 ICD_STREAM_HEADER_0
+#define HEADER_1 ICD_STREAM_HEADER_1
+#define TRAILER_0 ICD_STREAM_TRAILER_0
+#define TRAILER_1 ICD_STREAM_TRAILER_1
+#define TYPE_OFFSET (2 + ICD_STREAM_LENGTH_SIZE)
+#define BODY_OFFSET (TYPE_OFFSET + ICD_STREAM_TYPE_SIZE)
+#define CHECKSUM_SIZE ICD_CHECKSUM_SIZE(ICD_STREAM_CHECKSUM)
+#define TRAILER_SIZE 2
+#define MIN_PACKET_LENGTH ICD_FRAME_OVERHEAD(ICD_STREAM_LENGTH_SIZE, ICD_STREAM_TYPE_SIZE, ICD_STREAM_CHECKSUM)
+
+// The state machine reads the length and type as 2 and 3 byte fields and checks a CRC32
+_Static_assert(ICD_STREAM_LENGTH_SIZE == 2 && ICD_STREAM_TYPE_SIZE == 3 && ICD_STREAM_CHECKSUM == ICD_CHECKSUM_CRC32,
+               "stream_parser.c handles only this layout, other ICDs go through icd_parser.h");
+_Static_assert(STREAM_PARSER_FRAME_OVERHEAD == MIN_PACKET_LENGTH, "STREAM_PARSER_FRAME_OVERHEAD doesn't match the ICD");
+_Static_assert(STREAM_PARSER_MAX_PAYLOAD_SIZE == ICD_STREAM_MAX_PAYLOAD_SIZE, "STREAM_PARSER_MAX_PAYLOAD_SIZE doesn't match the ICD");
+
+// Static tracepoints for perf and bpftrace, provider "stream_parser", built in with
+// -DSTREAM_PARSER_USDT (make profile, when sys/sdt.h is installed), where each is a single nop
+// until a tracer attaches. Without it they compile to nothing.
+// The arguments of disabled probes are never evaluated, sizeof only marks them as used.
+#ifdef STREAM_PARSER_USDT
+#define PROBE2(name, a, b) STAP_PROBE2(stream_parser, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(stream_parser, name, a, b, c)
+#else
+#define PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+// What the callback probes and the cycle counts call user code for
+#define CALLBACK_PACKET 0
+#define CALLBACK_BATCH 1
+#define CALLBACK_ERROR 2
+
+// Cycle counts: one per state, then the callbacks
+#define CYCLE_BUCKETS (STREAM_PARSER_STATE_COUNT + 1)
+#define CYCLE_BUCKET_CALLBACKS STREAM_PARSER_STATE_COUNT
+
+// Everything the parser needs lives in one block of memory, laid out as:
+// [struct StreamParser][packet buffer][error context]
+// with each part starting on its own cache line.
+#define ALIGN_UP(size) (((size) + STREAM_PARSER_ALIGNMENT - 1) & ~((size_t)STREAM_PARSER_ALIGNMENT - 1))
 
 // Define the internal state of the parser
 typedef enum {
-    STATE_FIND_HEADER,
-    STATE_LENGTH,
-    STATE_TYPE,
-    STATE_BODY,
-    STATE_CHECKSUM,
-    STATE_FIND_TRAILER
+    STATE_FIND_HEADER = STREAM_PARSER_STATE_FIND_HEADER,
+    STATE_LENGTH = STREAM_PARSER_STATE_LENGTH,
+    STATE_TYPE = STREAM_PARSER_STATE_TYPE,
+    STATE_BODY = STREAM_PARSER_STATE_BODY,
+    STATE_CHECKSUM = STREAM_PARSER_STATE_CHECKSUM,
+    STATE_FIND_TRAILER = STREAM_PARSER_STATE_FIND_TRAILER
 } ParserState;
 
+// Counters behind stream_parser_get_stats(). Only the thread pushing bytes writes them,
+// any other thread may read them, so they are atomics updated with relaxed plain
+// load + store (no locked instructions). They get cache lines of their own so that a
+// monitoring thread reading them doesn't keep stealing the lines the parser works in.
+typedef struct {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t packets_out;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t header_skipped_bytes;
+    _Atomic uint64_t length_rejects;
+    _Atomic uint64_t crc_mismatches;
+    _Atomic uint64_t trailer_failures;
+    _Atomic uint64_t type_rejects;
+    _Atomic uint64_t resyncs;
+    _Atomic uint64_t recovered_packets;
+    _Atomic uint64_t other_type_packets;
+    // 0 means a free slot, otherwise TYPE_KEY_PRESENT | the 3 type bytes. Published with release
+    // once the slot's counter is ready, so readers only need to acquire the key.
+    _Atomic uint32_t type_keys[STREAM_PARSER_STATS_MAX_TYPES];
+    _Atomic uint64_t type_packets[STREAM_PARSER_STATS_MAX_TYPES];
+} __attribute__((aligned(STREAM_PARSER_ALIGNMENT))) StatCounters;
+
+#define TYPE_KEY_PRESENT 0x01000000u
+
+// Fills the unused part of the type handler table. Type keys are only 24 bits, so it matches nothing.
+#define NO_TYPE_KEY 0xFFFFFFFFu
+
+typedef struct {
+    StreamParserPacketCallback callback;
+    void *data;
+} TypeHandler;
+
 // Define the struct StreamParser
 struct StreamParser {
     uint8_t *packet_buffer;
     int64_t packet_buffer_index;
     ParserState state;
-    uint16_t packet_length;
+    uint32_t packet_length;
+    // Largest packet (payload + MIN_PACKET_LENGTH) that fits in packet_buffer
+    int64_t max_packet_length;
+    // Nonzero if stream_parser_close() has to free the memory (stream_parser_open_ex()),
+    // zero for caller provided storage (stream_parser_init()).
+    int owns_memory;
+
+    StreamParserCrcMode crc_mode;
+    // Running CRC of packet_buffer[0, crc_folded), only maintained in STREAM_PARSER_CRC_INCREMENTAL mode.
+    CRC32_State crc_state;
+    int64_t crc_folded;
 
     StreamParserErrorCallback error_callback;
     void *error_callback_data;
 
+    StreamParserErrorEventCallback error_event_callback;
+    void *error_event_callback_data;
+
+    // Run of HEADER_NOT_FOUND_YET bytes not reported yet, when coalescing them
+    int coalesce_header_errors;
+    int64_t skipped_bytes;
+    uint8_t last_skipped_byte;
+
     StreamParserPacketCallback packet_callback;
     void *packet_callback_data;
 
+    // Packets waiting for the batch callback
+    StreamParserPacketBatchCallback packet_batch_callback;
+    void *packet_batch_callback_data;
+    StreamParserPacketView *batch;
+    size_t batch_count;
+    size_t batch_capacity;
+    int64_t batch_bytes;
+    int64_t batch_max_bytes;
+    // Copies of packets that were collected in packet_buffer, which the next packet overwrites
+    uint8_t *batch_arena;
+    int64_t batch_arena_used;
+    int64_t batch_arena_size;
+
+    // Per type packet handlers. Keys are the 3 type bytes, sorted, padded with NO_TYPE_KEY so
+    // that they can be compared 4 at a time. handlers[i] goes with type_keys[i].
+    uint32_t type_keys[STREAM_PARSER_MAX_TYPE_HANDLERS] __attribute__((aligned(16)));
+    TypeHandler type_handlers[STREAM_PARSER_MAX_TYPE_HANDLERS];
+    int type_handler_count;
+    TypeHandler default_type_handler;
+    int reject_unknown_types;
+
+    PacketPool *packet_pool;
+    StreamParserPooledPacketCallback pooled_packet_callback;
+    void *pooled_packet_callback_data;
+
+    // Only written to when a string error callback is registered
     char *error_context;
-    char *general_use_buffer;
+
+    // Set when bytes were skipped or a packet was rejected, cleared by the next header
+    int out_of_sync;
+    // Rejected frames are scanned again for a header, see stream_parser_set_rescan_rejected()
+    int rescan_rejected;
+    // Set by a reject when rescanning: bytes of the rejected frame, still in packet_buffer
+    int64_t rejected_length;
+    // The frame being collected started inside bytes that are being rescanned
+    int frame_recovering;
+    // Set while rescan_rejected() runs, so process_byte() can tell its bytes from new ones
+    int rescanning;
+    // Arrival time of the bytes being pushed, and of the first byte of the frame in packet_buffer
+    uint64_t arrival_ns;
+    uint64_t frame_first_ns;
+    StreamParserTimedPacketCallback timed_packet_callback;
+    void *timed_packet_callback_data;
+    // Only allocated when enabled: the arrival to callback and first to last byte histograms,
+    // then their values at the last reset
+    LatencyHistogram *latency;
+    // Slot of the last packet type counted, most streams repeat the same type a lot
+    int last_type_slot;
+
+    StatCounters stats;
+    // Values at the last stream_parser_get_stats() reset. Only the monitoring thread touches these.
+    StreamParserStats stats_baseline;
+
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+    // Time stamp counter when cycles were last charged to a bucket, 0 outside of pushes
+    uint64_t cycle_mark;
+    _Atomic uint64_t cycles[CYCLE_BUCKETS];
+    // Values at the last stream_parser_get_cycle_counts() reset
+    uint64_t cycles_baseline[CYCLE_BUCKETS];
+#endif
 };
 
-static void append_to_error_context(StreamParser *const parser, const char *const string_to_append) {
-    const int64_t length = strlen(parser->error_context);
-    if (length >= ERROR_CONTEXT_SIZE) {
-        return; // No room to append error message
+static inline void stat_add(_Atomic uint64_t *const counter, const uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+#endif
+
+// Cycle accounting: a push starts the clock, and every change of state, callback and the end of
+// the push charge the cycles since the last charge to a bucket. Nothing without
+// -DSTREAM_PARSER_CYCLE_COUNTS.
+static inline void cycles_start(StreamParser *const parser) {
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+    parser->cycle_mark = read_cycles();
+#else
+    (void)parser;
+#endif
+}
+
+static inline void cycles_charge(StreamParser *const parser, const int bucket) {
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+    if (parser->cycle_mark) {
+        const uint64_t now = read_cycles();
+        stat_add(&parser->cycles[bucket], now - parser->cycle_mark);
+        parser->cycle_mark = now;
     }
-    strncat(parser->error_context + length, string_to_append, ERROR_CONTEXT_SIZE - length - 1);
+#else
+    (void)parser;
+    (void)bucket;
+#endif
+}
+
+static inline void cycles_stop(StreamParser *const parser) {
+    cycles_charge(parser, (int)parser->state);
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+    parser->cycle_mark = 0;
+#endif
+}
+
+static inline void set_state(StreamParser *const parser, const ParserState state) {
+    PROBE3(state_change, parser, (int)parser->state, (int)state);
+    cycles_charge(parser, (int)parser->state);
+    parser->state = state;
+}
+
+// Around calls into user code, so that their time is told apart from the parser's
+static inline void callback_entry(StreamParser *const parser, const int kind) {
+    cycles_charge(parser, (int)parser->state);
+    PROBE2(callback_entry, parser, kind);
 }
 
-static void clear_error_context(StreamParser *const parser) {
-    parser->error_context[0] = '\0';
+static inline void callback_exit(StreamParser *const parser, const int kind) {
+    PROBE2(callback_exit, parser, kind);
+    cycles_charge(parser, CYCLE_BUCKET_CALLBACKS);
 }
 
-// Helper function to create a string context
-static void string_context(StreamParser *const parser) {
-    if (!parser->error_callback) return;
+static inline uint32_t packet_type_key(const uint8_t *const packet) {
+    return ((uint32_t)packet[TYPE_OFFSET] << 16) | ((uint32_t)packet[TYPE_OFFSET + 1] << 8) | (uint32_t)packet[TYPE_OFFSET + 2];
+}
 
-    parser->general_use_buffer[0] = '\0';
-    snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "State: %d, Buffer Index: %zu, Packet Length: %u, Buffer Content: ",
-             parser->state, parser->packet_buffer_index, parser->packet_length);
+// Returns the index of the type's handler, or -1 if it has none.
+static inline int find_type_handler(const StreamParser *const parser, const uint32_t key) {
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi32((int)key);
+    for (int i = 0; i < parser->type_handler_count; i += 4) {
+        const __m128i keys = _mm_load_si128((const __m128i*)&parser->type_keys[i]);
+        const int match = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(keys, needle)));
+        if (match) {
+            return i + __builtin_ctz((unsigned)match);
+        }
+    }
+    return -1;
+#else
+    int low = 0;
+    int high = parser->type_handler_count;
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        if (parser->type_keys[middle] < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low < parser->type_handler_count && parser->type_keys[low] == key) ? low : -1;
+#endif
+}
 
-    append_to_error_context(parser, parser->general_use_buffer);
+static void count_packet_type(StreamParser *const parser, const uint8_t *const packet) {
+    const uint32_t key = TYPE_KEY_PRESENT | packet_type_key(packet);
+    StatCounters *const stats = &parser->stats;
+    if (atomic_load_explicit(&stats->type_keys[parser->last_type_slot], memory_order_relaxed) == key) {
+        stat_add(&stats->type_packets[parser->last_type_slot], 1);
+        return;
+    }
+    for (int slot = 0; slot < STREAM_PARSER_STATS_MAX_TYPES; ++slot) {
+        const uint32_t slot_key = atomic_load_explicit(&stats->type_keys[slot], memory_order_relaxed);
+        if (slot_key == 0) {
+            // New type. The counter is already zero, publishing the key makes it visible.
+            stat_add(&stats->type_packets[slot], 1);
+            atomic_store_explicit(&stats->type_keys[slot], key, memory_order_release);
+        } else if (slot_key != key) {
+            continue;
+        } else {
+            stat_add(&stats->type_packets[slot], 1);
+        }
+        parser->last_type_slot = slot;
+        return;
+    }
+    stat_add(&stats->other_type_packets, 1);
+}
 
-    for (int64_t i = 0; i < parser->packet_buffer_index && i < DATA_BUFFER_SIZE; ++i) {
-        parser->general_use_buffer[0] = '\0';
-        snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "0x%02X ", parser->packet_buffer[i]);
-        append_to_error_context(parser, parser->general_use_buffer);
+static void flush_batch(StreamParser *const parser) {
+    if (parser->batch_count) {
+        callback_entry(parser, CALLBACK_BATCH);
+        parser->packet_batch_callback(parser->batch, parser->batch_count, parser->packet_batch_callback_data);
+        callback_exit(parser, CALLBACK_BATCH);
+        parser->batch_count = 0;
+        parser->batch_bytes = 0;
+        parser->batch_arena_used = 0;
+    }
+}
+
+static void batch_packet(StreamParser *const parser, const uint8_t *packet, const int64_t packet_length) {
+    if (packet == parser->packet_buffer) {
+        if (parser->batch_arena_used + packet_length > parser->batch_arena_size) {
+            flush_batch(parser);
+        }
+        uint8_t *const copy = parser->batch_arena + parser->batch_arena_used;
+        memcpy(copy, packet, (size_t)packet_length);
+        parser->batch_arena_used += packet_length;
+        packet = copy;
+    }
+    StreamParserPacketView *const view = &parser->batch[parser->batch_count++];
+    view->packet_buffer = packet;
+    view->packet_size = packet_length;
+    parser->batch_bytes += packet_length;
+    if (parser->batch_count == parser->batch_capacity || (parser->batch_max_bytes && parser->batch_bytes >= parser->batch_max_bytes)) {
+        flush_batch(parser);
+    }
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Every accepted packet goes out through here, whether from the staging buffer or in place.
+static void deliver_packet(StreamParser *const parser, const uint8_t *const packet, const int64_t packet_length) {
+    PROBE2(packet_accept, parser, packet_length);
+    stat_add(&parser->stats.packets_out, 1);
+    stat_add(&parser->stats.bytes_out, (uint64_t)packet_length);
+    if (parser->frame_recovering) {
+        stat_add(&parser->stats.recovered_packets, 1);
+    }
+    count_packet_type(parser, packet);
+
+    // A packet delivered in place arrived whole with the bytes being pushed
+    StreamParserPacketTimes times;
+    times.first_byte_ns = (packet == parser->packet_buffer) ? parser->frame_first_ns : parser->arrival_ns;
+    times.last_byte_ns = parser->arrival_ns;
+    if (parser->latency && times.last_byte_ns) {
+        const uint64_t now = monotonic_ns();
+        latency_histogram_record(&parser->latency[0], now > times.last_byte_ns ? now - times.last_byte_ns : 0);
+        // Arrival times set out of order, or stepped back by a clock change, count as no wait
+        latency_histogram_record(&parser->latency[1], times.last_byte_ns > times.first_byte_ns ? times.last_byte_ns - times.first_byte_ns : 0);
+    }
+
+    callback_entry(parser, CALLBACK_PACKET);
+    if (parser->packet_callback) {
+        parser->packet_callback(packet, packet_length, parser->packet_callback_data);
+    }
+    if (parser->timed_packet_callback) {
+        parser->timed_packet_callback(packet, packet_length, &times, parser->timed_packet_callback_data);
+    }
+    if (parser->type_handler_count || parser->default_type_handler.callback) {
+        const int handler = find_type_handler(parser, packet_type_key(packet));
+        const TypeHandler *const type_handler = (handler >= 0) ? &parser->type_handlers[handler] : &parser->default_type_handler;
+        if (type_handler->callback) {
+            type_handler->callback(packet, packet_length, type_handler->data);
+        }
+    }
+    if (parser->packet_batch_callback) {
+        batch_packet(parser, packet, packet_length);
+    }
+    if (parser->pooled_packet_callback) {
+        PacketPoolRef ref;
+        if (packet_pool_acquire(parser->packet_pool, packet, packet_length, &ref) == 0) {
+            parser->pooled_packet_callback(ref, parser->pooled_packet_callback_data);
+            packet_pool_publish(ref);
+        }
+    }
+    callback_exit(parser, CALLBACK_PACKET);
+}
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// Appends to a bounded string the way strncat() would, keeping what fits
+static void append_string(char *const buffer, const size_t buffer_size, size_t *const length, const char *string) {
+    while (*string && *length + 1 < buffer_size) {
+        buffer[(*length)++] = *string++;
+    }
+    buffer[*length] = '\0';
+}
+
+static int has_error_listener(const StreamParser *const parser) {
+    return parser->error_callback != NULL || parser->error_event_callback != NULL;
+}
+
+// Describes the error that just happened at the parser's current position.
+static StreamParserErrorEvent make_error_event(const StreamParser *const parser, const StreamParserError code,
+                                               const StreamParserErrorReason reason, const uint8_t byte) {
+    StreamParserErrorEvent event;
+    memset(&event, 0, sizeof event);
+    event.code = code;
+    event.reason = reason;
+    event.state = (StreamParserState)parser->state;
+    event.byte = byte;
+    event.buffer_index = parser->packet_buffer_index;
+    event.packet_length = parser->packet_length;
+    event.skipped_bytes = (reason == STREAM_PARSER_REASON_HEADER_NOT_FOUND) ? 1 : 0;
+    return event;
+}
+
+// Hands an error to whoever listens. The string is only formatted if someone asked for strings.
+static void report_error(StreamParser *const parser, const StreamParserErrorEvent *const event) {
+    callback_entry(parser, CALLBACK_ERROR);
+    if (parser->error_event_callback) {
+        parser->error_event_callback(event, parser->error_event_callback_data);
+    }
+    if (parser->error_callback) {
+        stream_parser_format_error(parser, event, parser->error_context, ERROR_CONTEXT_SIZE);
+        parser->error_callback(event->code, parser->error_context, parser->error_callback_data);
+    }
+    callback_exit(parser, CALLBACK_ERROR);
+}
+
+// Reports the pending run of coalesced HEADER_NOT_FOUND_YET bytes as one event.
+static void flush_skipped_bytes(StreamParser *const parser) {
+    if (parser->skipped_bytes == 0) {
+        return;
+    }
+    if (has_error_listener(parser)) {
+        StreamParserErrorEvent event;
+        memset(&event, 0, sizeof event);
+        event.code = STREAM_PARSER_HEADER_NOT_FOUND_YET;
+        event.reason = STREAM_PARSER_REASON_HEADER_NOT_FOUND;
+        event.state = STREAM_PARSER_STATE_FIND_HEADER;
+        event.byte = parser->last_skipped_byte;
+        event.skipped_bytes = parser->skipped_bytes;
+        report_error(parser, &event);
+    }
+    parser->skipped_bytes = 0;
+}
+
+// A byte that didn't continue a header. Either reported right away or added to the current run.
+static void header_not_found(StreamParser *const parser, const uint8_t byte) {
+    PROBE2(header_skip, parser, 1);
+    stat_add(&parser->stats.header_skipped_bytes, 1);
+    parser->out_of_sync = 1;
+    if (parser->coalesce_header_errors) {
+        ++parser->skipped_bytes;
+        parser->last_skipped_byte = byte;
+    } else if (has_error_listener(parser)) {
+        const StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_HEADER_NOT_FOUND_YET, STREAM_PARSER_REASON_HEADER_NOT_FOUND, byte);
+        report_error(parser, &event);
+    }
+}
+
+// A header was collected: the run of garbage before it is over.
+static void header_found(StreamParser *const parser) {
+    flush_skipped_bytes(parser);
+    if (parser->out_of_sync) {
+        stat_add(&parser->stats.resyncs, 1);
+        parser->out_of_sync = 0;
+    }
+}
+
+// A '/' that may start a frame was just stored. Bytes being rescanned came in no later than the
+// rejected frame's first byte, which is the best time known for them.
+static inline void frame_started(StreamParser *const parser) {
+    if (!parser->frame_recovering) {
+        parser->frame_first_ns = parser->arrival_ns;
     }
 }
 
 static void reset_state(StreamParser *const parser) {
     parser->packet_buffer_index = 0;
-    parser->state = STATE_FIND_HEADER;
+    set_state(parser, STATE_FIND_HEADER);
     parser->packet_length = 0;
-
-    // For runtime determinism
-    memset(parser->packet_buffer, 0, DATA_BUFFER_SIZE);
-    memset(parser->error_context, 0, ERROR_CONTEXT_SIZE);
-    memset(parser->general_use_buffer, 0, GENERAL_USE_BUFFER_SIZE);
+    parser->frame_recovering = 0;
+    // The buffers aren't cleared- nothing past packet_buffer_index is ever read,
+    // and the error context is rewritten from scratch for every error.
 }
 
-StreamParser *stream_parser_open() {
-    StreamParser *parser = (StreamParser*)calloc(1, sizeof(StreamParser));
-    if (!parser) return NULL;
+// Drops the frame being collected after it failed a check. When rescanning, its bytes stay in
+// packet_buffer for the caller of process_byte() to scan again.
+static void reject_frame(StreamParser *const parser) {
+    if (parser->rescan_rejected) {
+        parser->rejected_length = parser->packet_buffer_index;
+    }
+    reset_state(parser);
+}
 
-    parser->packet_buffer = (uint8_t*)calloc(DATA_BUFFER_SIZE, sizeof(uint8_t));
-    if (!parser->packet_buffer) {
-        free(parser);
-        return NULL;
+// Bytes that can't start a header, skipped in one go. Same bookkeeping as header_not_found()
+// for each of them, for when nobody listens to the errors one by one.
+static void skip_header_bytes(StreamParser *const parser, const int64_t count, const uint8_t last_byte) {
+    PROBE2(header_skip, parser, count);
+    if (parser->coalesce_header_errors) {
+        parser->skipped_bytes += count;
+        parser->last_skipped_byte = last_byte;
     }
+    stat_add(&parser->stats.header_skipped_bytes, (uint64_t)count);
+    parser->out_of_sync = 1;
+}
 
-    parser->error_context = (char*)calloc(ERROR_CONTEXT_SIZE, sizeof(char));
-    if (!parser->error_context) {
-        free(parser->packet_buffer);
-        free(parser);
-        return NULL;
+StreamParserConfig stream_parser_default_config() {
+    StreamParserConfig config;
+    memset(&config, 0, sizeof config);
+    config.max_payload_size = STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE;
+    return config;
+}
+
+static int config_is_valid(const StreamParserConfig *const config) {
+    return config->max_payload_size >= 0 && config->max_payload_size <= STREAM_PARSER_MAX_PAYLOAD_SIZE;
+}
+
+static size_t packet_buffer_size(const StreamParserConfig *const config) {
+    return ALIGN_UP((size_t)config->max_payload_size + MIN_PACKET_LENGTH);
+}
+
+size_t stream_parser_sizeof(const StreamParserConfig *config) {
+    const StreamParserConfig default_config = stream_parser_default_config();
+    if (!config) {
+        config = &default_config;
     }
+    if (!config_is_valid(config)) {
+        return 0;
+    }
+    return ALIGN_UP(sizeof(StreamParser)) + packet_buffer_size(config) + ALIGN_UP(ERROR_CONTEXT_SIZE);
+}
 
-    parser->general_use_buffer = (char*)calloc(GENERAL_USE_BUFFER_SIZE, sizeof(char)); 
-    if (!parser->general_use_buffer) {
-        free(parser->error_context);
-        free(parser->packet_buffer);
-        free(parser);
+StreamParser *stream_parser_init(void *const storage, const size_t storage_size, const StreamParserConfig *config) {
+    const StreamParserConfig default_config = stream_parser_default_config();
+    if (!config) {
+        config = &default_config;
+    }
+    const size_t required_size = stream_parser_sizeof(config);
+    if (!storage || required_size == 0 || storage_size < required_size ||
+        ((uintptr_t)storage % STREAM_PARSER_ALIGNMENT) != 0) {
         return NULL;
     }
 
+    // Zeroes the callbacks and all the buffers in one go
+    memset(storage, 0, required_size);
+
+    uint8_t *const memory = (uint8_t*)storage;
+    StreamParser *const parser = (StreamParser*)memory;
+    size_t offset = ALIGN_UP(sizeof(StreamParser));
+    parser->packet_buffer = memory + offset;
+    offset += packet_buffer_size(config);
+    parser->error_context = (char*)(memory + offset);
+
+    parser->max_packet_length = config->max_payload_size + MIN_PACKET_LENGTH;
+    parser->owns_memory = 0;
+    // The defaults documented at stream_parser_open()
+    parser->crc_mode = STREAM_PARSER_CRC_DEFERRED;
+    parser->rescan_rejected = 1;
+    for (int i = 0; i < STREAM_PARSER_MAX_TYPE_HANDLERS; ++i) {
+        parser->type_keys[i] = NO_TYPE_KEY;
+    }
     reset_state(parser);
-    parser->error_callback = NULL;
-    parser->error_callback_data = NULL;
-    parser->packet_callback_data = NULL;
 
     return parser;
 }
 
+StreamParser *stream_parser_open_ex(const StreamParserConfig *const config) {
+    const size_t size = stream_parser_sizeof(config);
+    if (size == 0) return NULL;
+
+    void *const memory = aligned_alloc(STREAM_PARSER_ALIGNMENT, size);
+    if (!memory) return NULL;
+
+    StreamParser *const parser = stream_parser_init(memory, size, config);
+    if (!parser) {
+        free(memory);
+        return NULL;
+    }
+    parser->owns_memory = 1;
+
+    return parser;
+}
+
+StreamParser *stream_parser_open() {
+    return stream_parser_open_ex(NULL);
+}
+
 void stream_parser_close(StreamParser *parser) {
     if (parser) {
-        free(parser->general_use_buffer);
-        free(parser->error_context);
-        free(parser->packet_buffer);
+        free(parser->batch);
+        free(parser->latency);
+    }
+    if (parser && parser->owns_memory) {
         free(parser);
     }
 }
 
-// header + trailer 4 bytes, length 2 bytes, message type 3 bytes, checksum 4 bytes.
-#define MIN_PACKET_LENGTH 13
+// Compares the checksum collected in the packet buffer against the CRC32 of the packet.
+// Called once the last checksum byte has been collected.
+static StreamParserError verify_checksum(StreamParser *const parser, const uint8_t last_byte) {
+    CRC32_State hash_engine;
+    if (parser->crc_mode == STREAM_PARSER_CRC_INCREMENTAL) {
+        // Everything before the checksum was already folded in as it arrived,
+        // except at most CRC_FOLD_BLOCK bytes left over by bulk pushes
+        const int64_t body_end = parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE);
+        crc32_update(&parser->crc_state, parser->packet_buffer + parser->crc_folded, body_end - parser->crc_folded);
+        parser->crc_folded = body_end;
+        hash_engine = parser->crc_state;
+    } else {
+        hash_engine = crc32_create_engine();
+        // The checksum is of the entire messsage including the header and trailer
+        // except for the hash itself which isn't included in the calculation.
+        crc32_update(&hash_engine, parser->packet_buffer, parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE)); // Everything before checksum
+    }
+    // Need to manually fill in the trailer bytes for this CRC32 calculation
+    // because we haven't collected the trailer bytes yet.
+    // Don't worry- we'll also verify the trailer bytes in the next state.
+    static const uint8_t trailer_bytes[] = { TRAILER_0, TRAILER_1 };
+    crc32_update(&hash_engine, trailer_bytes, 2);
+    const uint32_t calculated_checksum = crc32_finalize(&hash_engine);
+    const uint8_t *const checksum = parser->packet_buffer + parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE);
+    const uint32_t received_checksum = ((uint32_t)checksum[0]) | ((uint32_t)checksum[1] << 8) |
+                                       ((uint32_t)checksum[2] << 16) | ((uint32_t)checksum[3] << 24);
 
-StreamParserError stream_parser_push_byte(StreamParser *const parser, const uint8_t byte) {
-    if (!parser) {
-        if (parser->error_callback) {
-            clear_error_context(parser);
-            parser->general_use_buffer[0] = '\0';
-            snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_INVALID_ARG: parser: %p, byte: %03o\n", (void*)parser, byte);
-            append_to_error_context(parser, parser->general_use_buffer);
-            string_context(parser);
-            parser->error_callback(STREAM_PARSER_INVALID_ARG, parser->error_context, parser->error_callback_data);
+    if (calculated_checksum != received_checksum) {
+        PROBE3(reject_checksum, parser, calculated_checksum, received_checksum);
+        stat_add(&parser->stats.crc_mismatches, 1);
+        parser->out_of_sync = 1;
+        if (has_error_listener(parser)) {
+            StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_INVALID_PACKET, STREAM_PARSER_REASON_CHECKSUM_MISMATCH, last_byte);
+            event.expected_crc = calculated_checksum;
+            event.received_crc = received_checksum;
+            report_error(parser, &event);
         }
+        reject_frame(parser);
+        return STREAM_PARSER_INVALID_PACKET;
+    }
 
-        return STREAM_PARSER_INVALID_ARG;
+    // Checksum is valid. Transition to STATE_FIND_TRAILER.
+    set_state(parser, STATE_FIND_TRAILER);
+    return STREAM_PARSER_OK;
+}
+
+// Folds a byte that is about to be collected into the running CRC, unless a bulk push
+// left bytes before it unfolded, in which case it will be folded along with those.
+static inline void fold_byte(StreamParser *const parser, const uint8_t byte) {
+    if (parser->crc_mode == STREAM_PARSER_CRC_INCREMENTAL && parser->crc_folded == parser->packet_buffer_index) {
+        crc32_update_byte(&parser->crc_state, byte);
+        ++parser->crc_folded;
     }
+}
 
+// The state machine itself. The parser pointer is already known to be valid.
+static StreamParserError process_byte(StreamParser *const parser, const uint8_t byte) {
     StreamParserError err_ret = STREAM_PARSER_OK;
 
     // Handle states
     switch (parser->state) {
         case STATE_FIND_HEADER:
-            if (parser->packet_buffer_index == 0 && byte == '/') {
+            if (parser->packet_buffer_index == 0 && byte == HEADER_0) {
                 parser->packet_buffer[parser->packet_buffer_index++] = byte;
-            } else if (parser->packet_buffer_index == 1 && byte == '*') {
+                frame_started(parser);
+            } else if (parser->packet_buffer_index == 1 && byte == HEADER_1) {
                 parser->packet_buffer[parser->packet_buffer_index++] = byte;
-                parser->state = STATE_LENGTH;
+                set_state(parser, STATE_LENGTH);
+                if (parser->crc_mode == STREAM_PARSER_CRC_INCREMENTAL) {
+                    parser->crc_state = crc32_create_engine();
+                    crc32_update(&parser->crc_state, parser->packet_buffer, 2);
+                    parser->crc_folded = 2;
+                }
+                header_found(parser);
             } else {
                 err_ret = STREAM_PARSER_HEADER_NOT_FOUND_YET;
-                if (parser->error_callback) {
-                    clear_error_context(parser);
-                    snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_HEADER_NOT_FOUND_YET: Expected '/' and '*', received: 0x%x\n", (int)byte);
-                    append_to_error_context(parser, parser->general_use_buffer);
-                    string_context(parser);
-                    parser->error_callback(STREAM_PARSER_HEADER_NOT_FOUND_YET, parser->error_context, parser->error_callback_data);
-                }
+                header_not_found(parser, byte);
                 // Special case- the second byte actually turned out to be the beginning of the header
                 // This is actually quite likely since the protocl's trailer: */ can accidentally be
                 // interpreted as the beginning of the header, in which case this state machine will be
                 // stuck forever.
-                if (byte == '/') {
-                    parser->packet_buffer[0] = '/';
+                if (byte == HEADER_0) {
+                    parser->packet_buffer[0] = HEADER_0;
                     parser->packet_buffer_index = 1;
+                    // A new '/' only starts a recovered frame if it was itself rescanned
+                    parser->frame_recovering = parser->rescanning;
+                    frame_started(parser);
                 }
                 else {
                     parser->packet_buffer_index = 0; // Reset to continue searching for header
+                    parser->frame_recovering = 0;
                 }
             }
             break;
         case STATE_LENGTH: {
+            fold_byte(parser, byte);
             parser->packet_buffer[parser->packet_buffer_index++] = byte;
-            if (parser->packet_buffer_index == 4) { // Header + 2 length bytes
+            if (parser->packet_buffer_index == TYPE_OFFSET) { // Header + 2 length bytes
                 const int64_t payload_length = ((uint32_t)parser->packet_buffer[2]) | (((uint32_t)(parser->packet_buffer[3])) << 8);
                 parser->packet_length = payload_length + MIN_PACKET_LENGTH;
-                if (parser->packet_length < MIN_PACKET_LENGTH || parser->packet_length > DATA_BUFFER_SIZE) {
+                if (parser->packet_length < MIN_PACKET_LENGTH || parser->packet_length > parser->max_packet_length) {
                     err_ret = STREAM_PARSER_INVALID_PACKET;
-                    if (parser->error_callback) {
-                        clear_error_context(parser);
-                        snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_INVALID_PACKET: Invalid packet length: %u\n", parser->packet_length);
-                        append_to_error_context(parser, parser->general_use_buffer);
-                        string_context(parser);
-                        parser->error_callback(STREAM_PARSER_INVALID_PACKET, parser->error_context, parser->error_callback_data);
+                    PROBE2(reject_length, parser, parser->packet_length);
+                    stat_add(&parser->stats.length_rejects, 1);
+                    parser->out_of_sync = 1;
+                    if (has_error_listener(parser)) {
+                        const StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_INVALID_PACKET, STREAM_PARSER_REASON_INVALID_LENGTH, byte);
+                        report_error(parser, &event);
                     }
-                    reset_state(parser);
+                    reject_frame(parser);
                 } else {
-                    parser->state = STATE_TYPE;
+                    set_state(parser, STATE_TYPE);
                 }
             }
             break;
         }
         case STATE_TYPE:
+            fold_byte(parser, byte);
             parser->packet_buffer[parser->packet_buffer_index++] = byte;
-            if (parser->packet_buffer_index == 7) { // Header + 2 length bytes + 3 type bytes
+            if (parser->packet_buffer_index == BODY_OFFSET) { // Header + 2 length bytes + 3 type bytes
                 // Type bytes are successfully captured.
-                if (parser->packet_length <= MIN_PACKET_LENGTH) {
+                if (parser->reject_unknown_types && find_type_handler(parser, packet_type_key(parser->packet_buffer)) < 0) {
+                    err_ret = STREAM_PARSER_INVALID_PACKET;
+                    PROBE2(reject_type, parser, packet_type_key(parser->packet_buffer));
+                    stat_add(&parser->stats.type_rejects, 1);
+                    parser->out_of_sync = 1;
+                    if (has_error_listener(parser)) {
+                        const StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_INVALID_PACKET, STREAM_PARSER_REASON_UNKNOWN_TYPE, byte);
+                        report_error(parser, &event);
+                    }
+                    reject_frame(parser);
+                } else if (parser->packet_length <= MIN_PACKET_LENGTH) {
                     // Stop the body state from stealing one byte in the case
                     // of a packet that has an empty body.
-                    parser->state = STATE_CHECKSUM;
+                    set_state(parser, STATE_CHECKSUM);
                 } else {
-                    parser->state = STATE_BODY;
+                    set_state(parser, STATE_BODY);
                 }
             }
             break;
         case STATE_BODY:
+            fold_byte(parser, byte);
             parser->packet_buffer[parser->packet_buffer_index++] = byte;
             // Calculate the expected end of the body, taking into account header, length, type, checksum, and trailer bytes
-            if (parser->packet_buffer_index == parser->packet_length - (4 + 2)) { // Subtract 4 bytes for checksum and 2 bytes for trailer
+            if (parser->packet_buffer_index == parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE)) {
                 // The body is now complete. Transition to STATE_CHECKSUM.
-                parser->state = STATE_CHECKSUM;
+                set_state(parser, STATE_CHECKSUM);
             }
             break;
-        case STATE_CHECKSUM: {
+        case STATE_CHECKSUM:
             parser->packet_buffer[parser->packet_buffer_index++] = byte;
-            if (parser->packet_buffer_index == parser->packet_length - 2) { // Reached end of checksum, 2 bytes left for trailer
-                CRC32_State hash_engine = crc32_create_engine();
-                // The checksum is of the entire messsage including the header and trailer
-                // except for the hash itself which isn't included in the calculation.
-                crc32_update(&hash_engine, parser->packet_buffer, parser->packet_length - 6); // Everything before checksum
-                // Need to manually fill in the trailer bytes for this CRC32 calculation
-                // because we haven't collected the trailer bytes yet.
-                // Don't worry- we'll also verify the trailer bytes in the next state.
-                static const uint8_t trailer_bytes[] = { '*', '/' };
-                crc32_update(&hash_engine, trailer_bytes, 2);
-                const uint32_t calculated_checksum = crc32_finalize(&hash_engine);
-                const uint32_t received_checksum = ((uint32_t)parser->packet_buffer[parser->packet_length - 6]) |
-                                             ((uint32_t)parser->packet_buffer[parser->packet_length - 5] << 8) |
-                                             ((uint32_t)parser->packet_buffer[parser->packet_length - 4] << 16) |
-                                             ((uint32_t)parser->packet_buffer[parser->packet_length - 3] << 24);
-
-                if (calculated_checksum != received_checksum) {
-                    err_ret = STREAM_PARSER_INVALID_PACKET;
-                    if (parser->error_callback) {
-                        clear_error_context(parser);
-                        snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_INVALID_PACKET: Checksum mismatch. Expected: %08X, Received: %08X\n", calculated_checksum, received_checksum);
-                        append_to_error_context(parser, parser->general_use_buffer);
-                        string_context(parser);
-                        parser->error_callback(STREAM_PARSER_INVALID_PACKET, parser->error_context, parser->error_callback_data);
-                    }
-                    reset_state(parser);
-                } else {
-                    // Checksum is valid. Transition to STATE_FIND_TRAILER.
-                    parser->state = STATE_FIND_TRAILER;
-                }
+            if (parser->packet_buffer_index == parser->packet_length - TRAILER_SIZE) { // Reached end of checksum, 2 bytes left for trailer
+                err_ret = verify_checksum(parser, byte);
             }
             break;
-        }
         case STATE_FIND_TRAILER:
             parser->packet_buffer[parser->packet_buffer_index++] = byte;
-            if (parser->packet_buffer_index == parser->packet_length - 1 && byte == '*') {
+            if (parser->packet_buffer_index == parser->packet_length - 1 && byte == TRAILER_0) {
                 // First trailer byte received, wait for the second
-            } else if (parser->packet_buffer_index == parser->packet_length && byte == '/') {
+            } else if (parser->packet_buffer_index == parser->packet_length && byte == TRAILER_1) {
                 // Complete packet received, including trailer
                 
                 // $$$$$$$$$$$ Behold! The most important line of code $$$$$$$$$$$$$$$$$
-                parser->packet_callback(parser->packet_buffer, parser->packet_length, parser->packet_callback_data);
+                deliver_packet(parser, parser->packet_buffer, parser->packet_length);
 
                 reset_state(parser);
             } else {
                 // Trailer not found or incorrect trailer sequence
                 err_ret = STREAM_PARSER_INVALID_PACKET;
-                if (parser->error_callback) {
-                    clear_error_context(parser);
-                    snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_INVALID_PACKET: Incorrect trailer sequence or incomplete packet\n");
-                    append_to_error_context(parser, parser->general_use_buffer);
-                    string_context(parser);
-                    parser->error_callback(STREAM_PARSER_INVALID_PACKET, parser->error_context, parser->error_callback_data);
+                PROBE2(reject_trailer, parser, byte);
+                stat_add(&parser->stats.trailer_failures, 1);
+                parser->out_of_sync = 1;
+                if (has_error_listener(parser)) {
+                    const StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_INVALID_PACKET, STREAM_PARSER_REASON_BAD_TRAILER, byte);
+                    report_error(parser, &event);
                 }
-                reset_state(parser);
+                reject_frame(parser);
             }
             break;
         default:
             err_ret = STREAM_PARSER_INTERNAL_ERROR;
-            if (parser->error_callback) {
-                clear_error_context(parser);
-                snprintf(parser->general_use_buffer, GENERAL_USE_BUFFER_SIZE, "STREAM_PARSER_INTERNAL_ERROR: Unknown state\n");
-                append_to_error_context(parser, parser->general_use_buffer);
-                string_context(parser);
-                parser->error_callback(STREAM_PARSER_INVALID_PACKET, parser->error_context, parser->error_callback_data);
+            if (has_error_listener(parser)) {
+                const StreamParserErrorEvent event = make_error_event(parser, STREAM_PARSER_INTERNAL_ERROR, STREAM_PARSER_REASON_UNKNOWN_STATE, byte);
+                report_error(parser, &event);
             }
             reset_state(parser);
     }
@@ -282,6 +815,475 @@ StreamParserError stream_parser_push_byte(StreamParser *const parser, const uint
     return err_ret;
 }
 
+// Orders error codes by how much they tell the caller, so that the push functions
+// can report the most significant thing that happened during the call.
+static int error_severity(const StreamParserError error) {
+    switch (error) {
+        case STREAM_PARSER_OK: return 0;
+        case STREAM_PARSER_HEADER_NOT_FOUND_YET: return 1;
+        case STREAM_PARSER_INVALID_PACKET: return 2;
+        default: return 3;
+    }
+}
+
+// Runs the bytes of a rejected frame after its '/' through the state machine again, straight from
+// packet_buffer: the frame being collected is written behind the byte being read, so the bytes
+// still to be scanned are never overwritten. Returns the most significant error seen.
+static StreamParserError rescan_rejected(StreamParser *const parser) {
+    StreamParserError err_ret = STREAM_PARSER_OK;
+    uint8_t *const bytes = parser->packet_buffer;
+    int64_t read = 1;
+    const int64_t end = parser->rejected_length;
+    parser->rejected_length = 0;
+    parser->rescanning = 1;
+    while (read < end) {
+        if (parser->state == STATE_FIND_HEADER && parser->packet_buffer_index == 0) {
+            if (parser->coalesce_header_errors || !has_error_listener(parser)) {
+                const uint8_t *const slash = (const uint8_t*)memchr(bytes + read, HEADER_0, (size_t)(end - read));
+                const int64_t next = slash ? (int64_t)(slash - bytes) : end;
+                if (next > read) {
+                    skip_header_bytes(parser, next - read, bytes[next - 1]);
+                    if (error_severity(STREAM_PARSER_HEADER_NOT_FOUND_YET) > error_severity(err_ret)) {
+                        err_ret = STREAM_PARSER_HEADER_NOT_FOUND_YET;
+                    }
+                    read = next;
+                    continue;
+                }
+            }
+            parser->frame_recovering = 1;
+        }
+        const StreamParserError err = process_byte(parser, bytes[read++]);
+        if (error_severity(err) > error_severity(err_ret)) {
+            err_ret = err;
+        }
+        if (parser->rejected_length) {
+            // Rejected again. Its bytes after the '/' go back to where they came from, right
+            // before the ones not scanned yet, and get scanned along with them.
+            const int64_t rejected = parser->rejected_length;
+            parser->rejected_length = 0;
+            memmove(bytes + read - (rejected - 1), bytes + 1, (size_t)(rejected - 1));
+            read -= rejected - 1;
+        }
+    }
+    parser->rescanning = 0;
+    return err_ret;
+}
+
+StreamParserError stream_parser_push_byte(StreamParser *const parser, const uint8_t byte) {
+    if (!parser) {
+        // No parser means no error callback to report to either.
+        return STREAM_PARSER_INVALID_ARG;
+    }
+
+    cycles_start(parser);
+    stat_add(&parser->stats.bytes_in, 1);
+    StreamParserError err = process_byte(parser, byte);
+    if (parser->rejected_length) {
+        const StreamParserError rescan_err = rescan_rejected(parser);
+        if (error_severity(rescan_err) > error_severity(err)) {
+            err = rescan_err;
+        }
+    }
+    flush_batch(parser);
+    cycles_stop(parser);
+    return err;
+}
+
+// Validates a packet that sits whole in the caller's buffer and hands it to the packet
+// callback straight from there, skipping the staging buffer. Returns the packet length
+// if it was delivered, or 0 if the bytes have to go through the state machine instead:
+// the packet is cut off by the end of the buffer, or it is invalid, in which case the
+// state machine reports the exact same error the byte-at-a-time path would.
+static int64_t deliver_in_place(StreamParser *const parser, const uint8_t *const frame, const int64_t available) {
+    cycles_charge(parser, (int)parser->state);
+    if (available < MIN_PACKET_LENGTH || frame[0] != HEADER_0 || frame[1] != HEADER_1) {
+        return 0;
+    }
+    const int64_t packet_length = (((uint32_t)frame[2]) | (((uint32_t)frame[3]) << 8)) + MIN_PACKET_LENGTH;
+    if (packet_length > parser->max_packet_length || packet_length > available) {
+        return 0;
+    }
+    if (parser->reject_unknown_types && find_type_handler(parser, packet_type_key(frame)) < 0) {
+        return 0;
+    }
+    if (frame[packet_length - 2] != TRAILER_0 || frame[packet_length - 1] != TRAILER_1) {
+        return 0;
+    }
+    // The CRC covers everything except the checksum itself, trailer included
+    CRC32_State hash_engine = crc32_create_engine();
+    const uint8_t *const checksum = frame + packet_length - (CHECKSUM_SIZE + TRAILER_SIZE);
+    crc32_update(&hash_engine, frame, checksum - frame);
+    crc32_update(&hash_engine, frame + packet_length - TRAILER_SIZE, TRAILER_SIZE);
+    const uint32_t received_checksum = ((uint32_t)checksum[0]) | ((uint32_t)checksum[1] << 8) |
+                                       ((uint32_t)checksum[2] << 16) | ((uint32_t)checksum[3] << 24);
+    if (crc32_finalize(&hash_engine) != received_checksum) {
+        return 0;
+    }
+    // Validating the frame in place is the work the checksum state does for staged frames
+    cycles_charge(parser, STATE_CHECKSUM);
+
+    header_found(parser);
+    deliver_packet(parser, frame, packet_length);
+    return packet_length;
+}
+
+int64_t stream_parser_buffered_bytes(const StreamParser *const parser) {
+    return parser ? parser->packet_buffer_index : 0;
+}
+
+void stream_parser_set_arrival_time(StreamParser *const parser, const uint64_t arrival_ns) {
+    if (parser) {
+        parser->arrival_ns = arrival_ns;
+    }
+}
+
+StreamParserError stream_parser_push_bytes(StreamParser *const parser, const uint8_t *const buffer, const int64_t length, int64_t *const consumed) {
+    if (consumed) {
+        *consumed = 0;
+    }
+    if (!parser || length < 0 || (!buffer && length > 0)) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+
+    cycles_start(parser);
+    stat_add(&parser->stats.bytes_in, (uint64_t)length);
+
+    StreamParserError err_ret = STREAM_PARSER_OK;
+    int64_t i = 0;
+    // Bytes before this were already seen once, and are being scanned again after a reject
+    int64_t rescan_end = 0;
+    while (i < length) {
+        StreamParserError err = STREAM_PARSER_OK;
+
+        if (parser->state == STATE_FIND_HEADER && parser->packet_buffer_index == 0) {
+            // Hunting for the header. memchr() is vectorized by any decent libc, so skip straight
+            // to the next '/' candidate. Each skipped byte is exactly a HEADER_NOT_FOUND_YET of the
+            // byte-at-a-time path, so only take the shortcut when nobody wants to hear about them
+            // one by one.
+            if (parser->coalesce_header_errors || !has_error_listener(parser)) {
+                const uint8_t *const slash = (const uint8_t*)memchr(buffer + i, HEADER_0, (size_t)(length - i));
+                const int64_t next = slash ? (int64_t)(slash - buffer) : length;
+                if (next > i) {
+                    if (error_severity(STREAM_PARSER_HEADER_NOT_FOUND_YET) > error_severity(err_ret)) {
+                        err_ret = STREAM_PARSER_HEADER_NOT_FOUND_YET;
+                    }
+                    skip_header_bytes(parser, next - i, buffer[next - 1]);
+                    i = next;
+                }
+                if (i == length) {
+                    break;
+                }
+            }
+            // A whole valid packet starting right here is handed out without copying it
+            parser->frame_recovering = i < rescan_end;
+            const int64_t delivered = (buffer[i] == HEADER_0) ? deliver_in_place(parser, buffer + i, length - i) : 0;
+            if (delivered > 0) {
+                i += delivered;
+                parser->frame_recovering = 0;
+            } else {
+                err = process_byte(parser, buffer[i++]);
+            }
+        } else if (parser->state == STATE_FIND_HEADER && buffer[i] == HEADER_0) {
+            // "//": the held '/' turned out not to start a header, exactly as process_byte() would
+            // find. Drop it and look at this '/' as a fresh candidate, so a packet right behind it
+            // is still delivered in place.
+            err = STREAM_PARSER_HEADER_NOT_FOUND_YET;
+            header_not_found(parser, HEADER_0);
+            parser->packet_buffer_index = 0;
+            parser->frame_recovering = 0;
+        } else if (parser->state == STATE_BODY || parser->state == STATE_CHECKSUM) {
+            // The length is known, so the rest of the body and the checksum can be taken in one block.
+            const int64_t checksum_end = parser->packet_length - TRAILER_SIZE;
+            int64_t block = checksum_end - parser->packet_buffer_index;
+            if (block > length - i) {
+                block = length - i;
+            }
+            memcpy(parser->packet_buffer + parser->packet_buffer_index, buffer + i, (size_t)block);
+            parser->packet_buffer_index += block;
+            if (parser->crc_mode == STREAM_PARSER_CRC_INCREMENTAL) {
+                // Only the body is covered by the checksum
+                const int64_t body_end = parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE);
+                const int64_t body_collected = (parser->packet_buffer_index < body_end) ? parser->packet_buffer_index : body_end;
+                if (body_collected - parser->crc_folded >= CRC_FOLD_BLOCK) {
+                    crc32_update(&parser->crc_state, parser->packet_buffer + parser->crc_folded, body_collected - parser->crc_folded);
+                    parser->crc_folded = body_collected;
+                }
+            }
+            i += block;
+            if (parser->packet_buffer_index >= parser->packet_length - (CHECKSUM_SIZE + TRAILER_SIZE)) {
+                set_state(parser, STATE_CHECKSUM);
+            }
+            if (parser->packet_buffer_index == checksum_end) {
+                err = verify_checksum(parser, buffer[i - 1]);
+            }
+        } else {
+            err = process_byte(parser, buffer[i++]);
+        }
+
+        if (parser->rejected_length) {
+            const int64_t rejected = parser->rejected_length;
+            if (rejected <= i) {
+                // The whole rejected frame is in this buffer, so scan it again from there
+                parser->rejected_length = 0;
+                if (i > rescan_end) {
+                    rescan_end = i;
+                }
+                i -= rejected - 1;
+            } else {
+                const StreamParserError rescan_err = rescan_rejected(parser);
+                if (error_severity(rescan_err) > error_severity(err)) {
+                    err = rescan_err;
+                }
+            }
+        }
+        if (error_severity(err) > error_severity(err_ret)) {
+            err_ret = err;
+        }
+    }
+
+    // A bulk push is a natural point to report the garbage seen so far
+    flush_skipped_bytes(parser);
+    flush_batch(parser);
+    cycles_stop(parser);
+
+    if (consumed) {
+        *consumed = i;
+    }
+    return err_ret;
+}
+
+// Writes the 7 framing bytes in front of the payload
+static void encode_header(const uint8_t type[3], const int64_t payload_size, uint8_t *const header) {
+    header[0] = HEADER_0;
+    header[1] = HEADER_1;
+    header[2] = (uint8_t)(payload_size & 0xFF);
+    header[3] = (uint8_t)((payload_size >> 8) & 0xFF);
+    header[TYPE_OFFSET] = type[0];
+    header[TYPE_OFFSET + 1] = type[1];
+    header[TYPE_OFFSET + 2] = type[2];
+}
+
+// Writes the checksum and the trailer. The checksum covers everything but itself, trailer included.
+static void encode_trailer(const uint8_t *const header, const uint8_t *const payload, const int64_t payload_size, uint8_t *const trailer) {
+    static const uint8_t trailer_bytes[2] = { TRAILER_0, TRAILER_1 };
+    CRC32_State hash_engine = crc32_create_engine();
+    crc32_update(&hash_engine, header, BODY_OFFSET);
+    crc32_update(&hash_engine, payload, payload_size);
+    crc32_update(&hash_engine, trailer_bytes, 2);
+    const uint32_t checksum = crc32_finalize(&hash_engine);
+    trailer[0] = (uint8_t)checksum;
+    trailer[1] = (uint8_t)(checksum >> 8);
+    trailer[2] = (uint8_t)(checksum >> 16);
+    trailer[3] = (uint8_t)(checksum >> 24);
+    trailer[CHECKSUM_SIZE] = TRAILER_0;
+    trailer[CHECKSUM_SIZE + 1] = TRAILER_1;
+}
+
+static int encode_args_valid(const uint8_t type[3], const uint8_t *const payload, const int64_t payload_size) {
+    return type && payload_size >= 0 && payload_size <= STREAM_PARSER_MAX_PAYLOAD_SIZE && (payload || payload_size == 0);
+}
+
+int64_t stream_parser_encode(const uint8_t type[3], const uint8_t *const payload, const int64_t payload_size, uint8_t *const buffer, const int64_t buffer_size) {
+    if (!encode_args_valid(type, payload, payload_size) || !buffer || buffer_size < payload_size + STREAM_PARSER_FRAME_OVERHEAD) {
+        return -1;
+    }
+    encode_header(type, payload_size, buffer);
+    if (payload_size > 0 && payload != buffer + BODY_OFFSET) {
+        memmove(buffer + BODY_OFFSET, payload, (size_t)payload_size);
+    }
+    encode_trailer(buffer, buffer + BODY_OFFSET, payload_size, buffer + BODY_OFFSET + payload_size);
+    return payload_size + STREAM_PARSER_FRAME_OVERHEAD;
+}
+
+int stream_parser_encode_iov(const uint8_t type[3], const uint8_t *const payload, const int64_t payload_size,
+                             StreamParserFrameParts *const parts, struct iovec iov[3]) {
+    if (!encode_args_valid(type, payload, payload_size) || !parts || !iov) {
+        return -1;
+    }
+    encode_header(type, payload_size, parts->header);
+    encode_trailer(parts->header, payload, payload_size, parts->trailer);
+    iov[0].iov_base = parts->header;
+    iov[0].iov_len = sizeof parts->header;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = (size_t)payload_size;
+    iov[2].iov_base = parts->trailer;
+    iov[2].iov_len = sizeof parts->trailer;
+    return 3;
+}
+
+int64_t stream_parser_encode_batch(const StreamParserEncodeItem *const items, const size_t count, uint8_t *const buffer,
+                                   const int64_t buffer_size, size_t *const encoded) {
+    if (encoded) {
+        *encoded = 0;
+    }
+    if ((!items && count > 0) || (!buffer && buffer_size > 0) || buffer_size < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!encode_args_valid(items[i].type, items[i].payload, items[i].payload_size)) {
+            return -1;
+        }
+    }
+
+    int64_t length = 0;
+    size_t i = 0;
+    for (; i < count && buffer_size - length >= items[i].payload_size + STREAM_PARSER_FRAME_OVERHEAD; ++i) {
+        length += stream_parser_encode(items[i].type, items[i].payload, items[i].payload_size, buffer + length, buffer_size - length);
+    }
+    if (encoded) {
+        *encoded = i;
+    }
+    return length;
+}
+
+void stream_parser_set_crc_mode(StreamParser *const parser, const StreamParserCrcMode mode) {
+    if (parser) {
+        parser->crc_mode = mode;
+        // A packet in flight may not have a running CRC to continue from
+        reset_state(parser);
+    }
+}
+
+void stream_parser_set_rescan_rejected(StreamParser *const parser, const int enabled) {
+    if (parser) {
+        parser->rescan_rejected = enabled;
+    }
+}
+
+void stream_parser_set_coalesce_header_errors(StreamParser *const parser, const int enabled) {
+    if (parser) {
+        flush_skipped_bytes(parser);
+        parser->coalesce_header_errors = enabled;
+    }
+}
+
+static const char *error_code_name(const StreamParserError code) {
+    switch (code) {
+        case STREAM_PARSER_OK: return "STREAM_PARSER_OK";
+        case STREAM_PARSER_INTERNAL_ERROR: return "STREAM_PARSER_INTERNAL_ERROR";
+        case STREAM_PARSER_INVALID_ARG: return "STREAM_PARSER_INVALID_ARG";
+        case STREAM_PARSER_HEADER_NOT_FOUND_YET: return "STREAM_PARSER_HEADER_NOT_FOUND_YET";
+        case STREAM_PARSER_INVALID_PACKET: return "STREAM_PARSER_INVALID_PACKET";
+        default: return "STREAM_PARSER_UNKNOWN_ERROR";
+    }
+}
+
+int64_t stream_parser_format_error(const StreamParser *const parser, const StreamParserErrorEvent *const event, char *const buffer, const size_t buffer_size) {
+    if (!event || !buffer || buffer_size == 0) {
+        return 0;
+    }
+
+    char line[256];
+    switch (event->reason) {
+        case STREAM_PARSER_REASON_HEADER_NOT_FOUND:
+            if (event->skipped_bytes > 1) {
+                snprintf(line, sizeof line, "%s: Expected '/' and '*', skipped %lld bytes, last received: 0x%x\n",
+                         error_code_name(event->code), (long long)event->skipped_bytes, (int)event->byte);
+            } else {
+                snprintf(line, sizeof line, "%s: Expected '/' and '*', received: 0x%x\n", error_code_name(event->code), (int)event->byte);
+            }
+            break;
+        case STREAM_PARSER_REASON_INVALID_LENGTH:
+            snprintf(line, sizeof line, "%s: Invalid packet length: %u\n", error_code_name(event->code), event->packet_length);
+            break;
+        case STREAM_PARSER_REASON_CHECKSUM_MISMATCH:
+            snprintf(line, sizeof line, "%s: Checksum mismatch. Expected: %08X, Received: %08X\n",
+                     error_code_name(event->code), event->expected_crc, event->received_crc);
+            break;
+        case STREAM_PARSER_REASON_BAD_TRAILER:
+            snprintf(line, sizeof line, "%s: Incorrect trailer sequence or incomplete packet\n", error_code_name(event->code));
+            break;
+        case STREAM_PARSER_REASON_UNKNOWN_STATE:
+            snprintf(line, sizeof line, "%s: Unknown state\n", error_code_name(event->code));
+            break;
+        case STREAM_PARSER_REASON_UNKNOWN_TYPE:
+            snprintf(line, sizeof line, "%s: No handler for packet type\n", error_code_name(event->code));
+            break;
+        default:
+            snprintf(line, sizeof line, "%s\n", error_code_name(event->code));
+            break;
+    }
+
+    size_t length = 0;
+    buffer[0] = '\0';
+    append_string(buffer, buffer_size, &length, line);
+    snprintf(line, sizeof line, "State: %d, Buffer Index: %lld, Packet Length: %u, Buffer Content: ",
+             (int)event->state, (long long)event->buffer_index, event->packet_length);
+    append_string(buffer, buffer_size, &length, line);
+
+    // The collected bytes are only still there while the error callback runs
+    if (parser) {
+        for (int64_t i = 0; i < event->buffer_index && i < parser->max_packet_length && length + 1 < buffer_size; ++i) {
+            const uint8_t byte = parser->packet_buffer[i];
+            const char hex[] = { '0', 'x', hex_digits[byte >> 4], hex_digits[byte & 0x0F], ' ', '\0' };
+            append_string(buffer, buffer_size, &length, hex);
+        }
+    }
+    return (int64_t)length;
+}
+
+StreamParserError stream_parser_get_stats(StreamParser *const parser, StreamParserStats *const stats, const int reset) {
+    if (!parser || !stats) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+
+    const StatCounters *const counters = &parser->stats;
+    StreamParserStats now;
+    memset(&now, 0, sizeof now);
+    now.bytes_in = atomic_load_explicit(&counters->bytes_in, memory_order_relaxed);
+    now.packets_out = atomic_load_explicit(&counters->packets_out, memory_order_relaxed);
+    now.bytes_out = atomic_load_explicit(&counters->bytes_out, memory_order_relaxed);
+    now.header_skipped_bytes = atomic_load_explicit(&counters->header_skipped_bytes, memory_order_relaxed);
+    now.length_rejects = atomic_load_explicit(&counters->length_rejects, memory_order_relaxed);
+    now.crc_mismatches = atomic_load_explicit(&counters->crc_mismatches, memory_order_relaxed);
+    now.trailer_failures = atomic_load_explicit(&counters->trailer_failures, memory_order_relaxed);
+    now.type_rejects = atomic_load_explicit(&counters->type_rejects, memory_order_relaxed);
+    now.resyncs = atomic_load_explicit(&counters->resyncs, memory_order_relaxed);
+    now.recovered_packets = atomic_load_explicit(&counters->recovered_packets, memory_order_relaxed);
+    now.other_type_packets = atomic_load_explicit(&counters->other_type_packets, memory_order_relaxed);
+    for (int slot = 0; slot < STREAM_PARSER_STATS_MAX_TYPES; ++slot) {
+        const uint32_t key = atomic_load_explicit(&counters->type_keys[slot], memory_order_acquire);
+        if (key == 0) {
+            break; // Slots are taken in order
+        }
+        now.types[slot].type[0] = (uint8_t)(key >> 16);
+        now.types[slot].type[1] = (uint8_t)(key >> 8);
+        now.types[slot].type[2] = (uint8_t)key;
+        now.types[slot].packets = atomic_load_explicit(&counters->type_packets[slot], memory_order_relaxed);
+        now.type_count = slot + 1;
+    }
+
+    // Report what happened since the last reset
+    const StreamParserStats *const base = &parser->stats_baseline;
+    *stats = now;
+    stats->bytes_in -= base->bytes_in;
+    stats->packets_out -= base->packets_out;
+    stats->bytes_out -= base->bytes_out;
+    stats->header_skipped_bytes -= base->header_skipped_bytes;
+    stats->length_rejects -= base->length_rejects;
+    stats->crc_mismatches -= base->crc_mismatches;
+    stats->trailer_failures -= base->trailer_failures;
+    stats->type_rejects -= base->type_rejects;
+    stats->resyncs -= base->resyncs;
+    stats->recovered_packets -= base->recovered_packets;
+    stats->other_type_packets -= base->other_type_packets;
+    for (uint32_t slot = 0; slot < base->type_count; ++slot) {
+        stats->types[slot].packets -= base->types[slot].packets;
+    }
+
+    if (reset) {
+        parser->stats_baseline = now;
+    }
+    return STREAM_PARSER_OK;
+}
+
+void stream_parser_register_error_event_callback(StreamParser *const parser, const StreamParserErrorEventCallback callback, void *const error_event_callback_data) {
+    if (parser) {
+        parser->error_event_callback = callback;
+        parser->error_event_callback_data = error_event_callback_data;
+    }
+}
+
 void stream_parser_register_error_callback(StreamParser *const parser, const StreamParserErrorCallback callback, void *const error_callback_data) {
     if (parser) {
         parser->error_callback = callback;
@@ -295,3 +1297,182 @@ void stream_parser_register_packet_callback(StreamParser *const parser, const St
         parser->packet_callback_data = packet_callback_data;
     }
 }
+
+void stream_parser_register_timed_packet_callback(StreamParser *const parser, const StreamParserTimedPacketCallback callback, void *const timed_packet_callback_data) {
+    if (parser) {
+        parser->timed_packet_callback = callback;
+        parser->timed_packet_callback_data = timed_packet_callback_data;
+    }
+}
+
+StreamParserError stream_parser_set_latency_histograms(StreamParser *const parser, const int enabled) {
+    if (!parser) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    if (!enabled) {
+        free(parser->latency);
+        parser->latency = NULL;
+    } else if (!parser->latency) {
+        parser->latency = (LatencyHistogram*)calloc(4, sizeof(LatencyHistogram));
+        if (!parser->latency) {
+            return STREAM_PARSER_INTERNAL_ERROR;
+        }
+    }
+    return STREAM_PARSER_OK;
+}
+
+// Copies a histogram the pushing thread records into, minus its value at the last reset
+static void take_histogram(LatencyHistogram *const out, const LatencyHistogram *const live, LatencyHistogram *const baseline, const int reset) {
+    LatencyHistogram now;
+    latency_histogram_copy(&now, live);
+    if (out) {
+        memcpy(out, &now, sizeof now);
+        latency_histogram_subtract(out, baseline);
+    }
+    if (reset) {
+        memcpy(baseline, &now, sizeof now);
+    }
+}
+
+StreamParserError stream_parser_get_latency_histograms(StreamParser *const parser, LatencyHistogram *const arrival_to_callback, LatencyHistogram *const first_to_last, const int reset) {
+    if (!parser || !parser->latency) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    take_histogram(arrival_to_callback, &parser->latency[0], &parser->latency[2], reset);
+    take_histogram(first_to_last, &parser->latency[1], &parser->latency[3], reset);
+    return STREAM_PARSER_OK;
+}
+
+StreamParserError stream_parser_get_cycle_counts(StreamParser *const parser, StreamParserCycleCounts *const counts, const int reset) {
+#ifdef STREAM_PARSER_CYCLE_COUNTS
+    if (!parser || !counts) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    uint64_t now[CYCLE_BUCKETS];
+    for (int bucket = 0; bucket < CYCLE_BUCKETS; ++bucket) {
+        now[bucket] = atomic_load_explicit(&parser->cycles[bucket], memory_order_relaxed);
+    }
+    for (int state = 0; state < STREAM_PARSER_STATE_COUNT; ++state) {
+        counts->state_cycles[state] = now[state] - parser->cycles_baseline[state];
+    }
+    counts->callback_cycles = now[CYCLE_BUCKET_CALLBACKS] - parser->cycles_baseline[CYCLE_BUCKET_CALLBACKS];
+    if (reset) {
+        memcpy(parser->cycles_baseline, now, sizeof now);
+    }
+    return STREAM_PARSER_OK;
+#else
+    (void)parser;
+    (void)reset;
+    if (counts) {
+        memset(counts, 0, sizeof *counts);
+    }
+    return STREAM_PARSER_INVALID_ARG;
+#endif
+}
+
+StreamParserError stream_parser_register_type_handler(StreamParser *const parser, const uint8_t type[3],
+                                                      const StreamParserPacketCallback callback, void *const type_handler_data) {
+    if (!parser || !type) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    const uint32_t key = ((uint32_t)type[0] << 16) | ((uint32_t)type[1] << 8) | (uint32_t)type[2];
+    int position = 0;
+    while (position < parser->type_handler_count && parser->type_keys[position] < key) {
+        ++position;
+    }
+    const int present = position < parser->type_handler_count && parser->type_keys[position] == key;
+
+    if (!callback) {
+        if (present) {
+            // Close the gap, the slot freed at the end goes back to padding
+            const int moved = parser->type_handler_count - position - 1;
+            memmove(&parser->type_keys[position], &parser->type_keys[position + 1], (size_t)moved * sizeof(uint32_t));
+            memmove(&parser->type_handlers[position], &parser->type_handlers[position + 1], (size_t)moved * sizeof(TypeHandler));
+            parser->type_keys[--parser->type_handler_count] = NO_TYPE_KEY;
+        }
+        return STREAM_PARSER_OK;
+    }
+    if (!present) {
+        if (parser->type_handler_count == STREAM_PARSER_MAX_TYPE_HANDLERS) {
+            return STREAM_PARSER_INVALID_ARG;
+        }
+        const int moved = parser->type_handler_count - position;
+        memmove(&parser->type_keys[position + 1], &parser->type_keys[position], (size_t)moved * sizeof(uint32_t));
+        memmove(&parser->type_handlers[position + 1], &parser->type_handlers[position], (size_t)moved * sizeof(TypeHandler));
+        parser->type_keys[position] = key;
+        ++parser->type_handler_count;
+    }
+    parser->type_handlers[position].callback = callback;
+    parser->type_handlers[position].data = type_handler_data;
+    return STREAM_PARSER_OK;
+}
+
+void stream_parser_register_default_type_handler(StreamParser *const parser, const StreamParserPacketCallback callback, void *const default_type_handler_data) {
+    if (parser) {
+        parser->default_type_handler.callback = callback;
+        parser->default_type_handler.data = default_type_handler_data;
+    }
+}
+
+void stream_parser_set_reject_unknown_types(StreamParser *const parser, const int enabled) {
+    if (parser) {
+        parser->reject_unknown_types = enabled;
+    }
+}
+
+StreamParserError stream_parser_register_packet_batch_callback(StreamParser *const parser, const StreamParserPacketBatchCallback callback,
+                                                              void *const packet_batch_callback_data, const size_t max_packets,
+                                                              const int64_t max_bytes) {
+    if (!parser || max_bytes < 0) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    free(parser->batch);
+    parser->batch = NULL;
+    parser->packet_batch_callback = NULL;
+    parser->packet_batch_callback_data = NULL;
+    parser->batch_count = 0;
+    parser->batch_bytes = 0;
+    parser->batch_arena_used = 0;
+    if (!callback) {
+        return STREAM_PARSER_OK;
+    }
+
+    // Views and the arena for staged packets share one allocation
+    const size_t capacity = max_packets ? max_packets : STREAM_PARSER_DEFAULT_BATCH_PACKETS;
+    int64_t arena_size = max_bytes ? max_bytes : DEFAULT_BATCH_ARENA_SIZE;
+    if (arena_size < parser->max_packet_length) {
+        arena_size = parser->max_packet_length;
+    }
+    if (capacity > (SIZE_MAX - (size_t)arena_size) / sizeof(StreamParserPacketView)) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    uint8_t *const memory = (uint8_t*)malloc(capacity * sizeof(StreamParserPacketView) + (size_t)arena_size);
+    if (!memory) {
+        return STREAM_PARSER_INTERNAL_ERROR;
+    }
+    parser->batch = (StreamParserPacketView*)memory;
+    parser->batch_capacity = capacity;
+    parser->batch_max_bytes = max_bytes;
+    parser->batch_arena = memory + capacity * sizeof(StreamParserPacketView);
+    parser->batch_arena_size = arena_size;
+    parser->packet_batch_callback = callback;
+    parser->packet_batch_callback_data = packet_batch_callback_data;
+    return STREAM_PARSER_OK;
+}
+
+StreamParserError stream_parser_register_pooled_packet_callback(StreamParser *const parser, PacketPool *const pool,
+                                                                const StreamParserPooledPacketCallback callback,
+                                                                void *const pooled_packet_callback_data) {
+    if (!parser) {
+        return STREAM_PARSER_INVALID_ARG;
+    }
+    if (callback) {
+        if (!pool || packet_pool_slot_size(pool) < parser->max_packet_length) {
+            return STREAM_PARSER_INVALID_ARG;
+        }
+    }
+    parser->packet_pool = callback ? pool : NULL;
+    parser->pooled_packet_callback = callback;
+    parser->pooled_packet_callback_data = pooled_packet_callback_data;
+    return STREAM_PARSER_OK;
+}
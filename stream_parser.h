@@ -7,6 +7,9 @@ extern "C" {
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
+#include "packet_pool.h"
+#include "latency_histogram.h"
 
 // Forward declaration of the opaque struct.
 typedef struct StreamParser StreamParser;
@@ -20,16 +23,153 @@ typedef enum {
     STREAM_PARSER_INVALID_PACKET // Covers checksum failure as well
 } StreamParserError;
 
+// How the packet checksum is computed
+typedef enum {
+    // Bytes are folded into a running CRC as they arrive, so checking the checksum once the last
+    // byte is in costs the same no matter how big the packet is. The low latency option for large
+    // packets on slow links, at some cost in throughput.
+    STREAM_PARSER_CRC_INCREMENTAL = 0,
+    // The whole packet is hashed in one go once the last checksum byte arrives. This is the
+    // default, the faster of the two in most of make bench's scenarios.
+    STREAM_PARSER_CRC_DEFERRED
+} StreamParserCrcMode;
+
+// States of the parser state machine, in the order a packet goes through them
+typedef enum {
+    STREAM_PARSER_STATE_FIND_HEADER,
+    STREAM_PARSER_STATE_LENGTH,
+    STREAM_PARSER_STATE_TYPE,
+    STREAM_PARSER_STATE_BODY,
+    STREAM_PARSER_STATE_CHECKSUM,
+    STREAM_PARSER_STATE_FIND_TRAILER,
+    STREAM_PARSER_STATE_COUNT
+} StreamParserState;
+
+// What exactly went wrong, finer grained than StreamParserError
+typedef enum {
+    STREAM_PARSER_REASON_NONE = 0,
+    STREAM_PARSER_REASON_HEADER_NOT_FOUND,
+    STREAM_PARSER_REASON_INVALID_LENGTH,
+    STREAM_PARSER_REASON_CHECKSUM_MISMATCH,
+    STREAM_PARSER_REASON_BAD_TRAILER,
+    STREAM_PARSER_REASON_UNKNOWN_STATE,
+    STREAM_PARSER_REASON_UNKNOWN_TYPE
+} StreamParserErrorReason;
+
+// Everything known about an error, without any string formatting.
+typedef struct {
+    StreamParserError code;
+    StreamParserErrorReason reason;
+    StreamParserState state;  // State the parser was in when the error happened
+    uint8_t byte;             // The byte that caused the error (last one of the run when coalesced)
+    int64_t buffer_index;     // Number of bytes of the rejected packet collected so far
+    uint32_t packet_length;   // Packet length declared by the length field, 0 if not known yet
+    uint32_t expected_crc;    // Checksum mismatches only: CRC calculated over the packet
+    uint32_t received_crc;    // Checksum mismatches only: CRC found in the packet
+    int64_t skipped_bytes;    // HEADER_NOT_FOUND_YET only: bytes this event stands for
+} StreamParserErrorEvent;
+
+// Number of distinct packet types counted individually in StreamParserStats
+#define STREAM_PARSER_STATS_MAX_TYPES 16
+
+typedef struct {
+    uint8_t type[3];
+    uint64_t packets;
+} StreamParserTypeCount;
+
+// Snapshot of the parser's counters, see stream_parser_get_stats()
+typedef struct {
+    uint64_t bytes_in;              // Bytes pushed into the parser
+    uint64_t packets_out;           // Valid packets handed to the packet callback
+    uint64_t bytes_out;             // Total size of those packets
+    uint64_t header_skipped_bytes;  // Bytes thrown away while hunting for a header
+    uint64_t length_rejects;        // Packets rejected for their length field
+    uint64_t crc_mismatches;        // Packets rejected for their checksum
+    uint64_t trailer_failures;      // Packets rejected for their trailer
+    uint64_t type_rejects;          // Packets rejected for a type without a handler, see stream_parser_set_reject_unknown_types()
+    uint64_t resyncs;               // Headers found after skipped bytes or a rejected packet
+    uint64_t recovered_packets;     // Packets found inside the bytes of a rejected packet, see stream_parser_set_rescan_rejected()
+    uint64_t other_type_packets;    // Packets of types that didn't fit in the types table
+    uint32_t type_count;            // Number of valid entries in types, in order of first appearance
+    StreamParserTypeCount types[STREAM_PARSER_STATS_MAX_TYPES];
+} StreamParserStats;
+
 // Callback function type for error reporting.
 typedef void (*StreamParserErrorCallback)(const StreamParserError error, const char *message, void *const error_callback_data);
 
+// Callback function type for structured error reporting. Much cheaper than StreamParserErrorCallback
+// since nothing is formatted unless the callback calls stream_parser_format_error() itself.
+// The event is only valid during the call.
+typedef void (*StreamParserErrorEventCallback)(const StreamParserErrorEvent *const event, void *const error_event_callback_data);
+
 // Callback function for any collected packet
 typedef void (*StreamParserPacketCallback)(const uint8_t *const packet_buffer, int64_t packet_size, void *const packet_callback_data);
 
+// When a packet's bytes arrived, see stream_parser_set_arrival_time()
+typedef struct {
+    uint64_t first_byte_ns;   // The header's '/'
+    uint64_t last_byte_ns;    // The trailer's '/'
+} StreamParserPacketTimes;
+
+// Callback function for collected packets along with their arrival times, see stream_parser_register_timed_packet_callback()
+typedef void (*StreamParserTimedPacketCallback)(const uint8_t *const packet_buffer, int64_t packet_size, const StreamParserPacketTimes *const times, void *const timed_packet_callback_data);
+
+// One packet of a batch, see stream_parser_register_packet_batch_callback()
+typedef struct {
+    const uint8_t *packet_buffer;
+    int64_t packet_size;
+} StreamParserPacketView;
+
+// Callback function for collected packets, delivered several at a time
+typedef void (*StreamParserPacketBatchCallback)(const StreamParserPacketView *const packets, size_t packet_count, void *const packet_batch_callback_data);
+
+// Callback function for collected packets copied into a PacketPool, see stream_parser_register_pooled_packet_callback()
+typedef void (*StreamParserPooledPacketCallback)(const PacketPoolRef packet, void *const pooled_packet_callback_data);
+
+// Number of packet types stream_parser_register_type_handler() can tell apart
+#define STREAM_PARSER_MAX_TYPE_HANDLERS 32
+
+// Payload size limit used by stream_parser_open(), keeps packets within 64 bytes.
+#define STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE 51
+// The length field is a uint16, so the ICD can't describe anything bigger.
+#define STREAM_PARSER_MAX_PAYLOAD_SIZE 65535
+// Alignment required of storage passed to stream_parser_init()
+#define STREAM_PARSER_ALIGNMENT 64
+
+typedef struct {
+    // Largest payload (body only) accepted, between 0 and STREAM_PARSER_MAX_PAYLOAD_SIZE.
+    // Packets declaring a longer payload are rejected as STREAM_PARSER_INVALID_PACKET.
+    int64_t max_payload_size;
+} StreamParserConfig;
+
+// Returns the configuration stream_parser_open() uses. Start from it and change what you need.
+extern StreamParserConfig stream_parser_default_config();
+
 // Function to open and initialize the parser.
+// Defaults: payloads up to STREAM_PARSER_DEFAULT_MAX_PAYLOAD_SIZE bytes, STREAM_PARSER_CRC_DEFERRED,
+// and rejected packets rescanned for a header, so one corrupted packet doesn't take the packets it
+// swallowed down with it (see stream_parser_set_rescan_rejected() to turn that off).
 extern StreamParser *stream_parser_open();
 
-// Function to close and free the parser.
+// Same as stream_parser_open() with a custom configuration (NULL means the default one).
+// The parser state and all of its buffers are placed in a single cache-aligned allocation.
+// Returns NULL if the configuration is invalid or memory ran out.
+extern StreamParser *stream_parser_open_ex(const StreamParserConfig *config);
+
+// Number of bytes of storage a parser with this configuration (NULL means default) needs,
+// or 0 if the configuration is invalid.
+extern size_t stream_parser_sizeof(const StreamParserConfig *config);
+
+// Initializes a parser inside caller provided storage, without touching the heap.
+// storage must be aligned to STREAM_PARSER_ALIGNMENT and at least stream_parser_sizeof(config) bytes.
+// Returns NULL on invalid arguments. The storage stays owned by the caller, but stream_parser_close()
+// must still be called: it frees what the parser allocates on request, the packet batch
+// (stream_parser_register_packet_batch_callback()) and the latency histograms
+// (stream_parser_set_latency_histograms()), and leaves the storage alone.
+extern StreamParser *stream_parser_init(void *storage, size_t storage_size, const StreamParserConfig *config);
+
+// Function to close and free the parser. For a parser made with stream_parser_init(), frees only
+// what it allocated on request, never the storage.
 extern void stream_parser_close(StreamParser *parser);
 
 // Function to push a byte into the parser state machine
@@ -37,6 +177,98 @@ extern void stream_parser_close(StreamParser *parser);
 // Upon collecting entire packet- calls the packet_callback if initialized
 extern StreamParserError stream_parser_push_byte(StreamParser *parser, uint8_t byte);
 
+// Function to push a whole buffer of bytes into the parser state machine.
+// Produces exactly the same packets and error callbacks as calling stream_parser_push_byte()
+// on each byte in order, but skips to header candidates with a vectorized scan and
+// collects packet bodies in blocks instead of running the state machine per byte.
+// The whole buffer is always consumed; the number of bytes fed to the parser is written
+// to consumed (may be NULL). Returns STREAM_PARSER_INVALID_ARG for bad arguments,
+// otherwise the most significant error code seen during the call
+// (STREAM_PARSER_INVALID_PACKET over STREAM_PARSER_HEADER_NOT_FOUND_YET over STREAM_PARSER_OK).
+extern StreamParserError stream_parser_push_bytes(StreamParser *parser, const uint8_t *buffer, int64_t length, int64_t *consumed);
+
+// Bytes of an unfinished frame the parser holds on to (a '/' that may start a header counts too),
+// so the frame began that many bytes before the next byte pushed. 0 means the parser is waiting
+// for a header. Two parsers with the same configuration that hold the same number of bytes at the
+// same position of a stream produce the same packets from there on.
+extern int64_t stream_parser_buffered_bytes(const StreamParser *parser);
+
+// Tells the parser when the bytes pushed from now on arrived, in CLOCK_MONOTONIC nanoseconds, as
+// taken by whoever read them (ideally the kernel's receive timestamp). Call it before each push.
+// Packet times and latency histograms are derived from it, a parser that is never told records none.
+extern void stream_parser_set_arrival_time(StreamParser *parser, uint64_t arrival_ns);
+
+
+// Bytes a frame adds around its payload: header 2, length 2, type 3, checksum 4, trailer 2.
+#define STREAM_PARSER_FRAME_OVERHEAD 13
+
+// Encodes a payload into a frame the parser accepts (given a large enough max_payload_size).
+// buffer must hold payload_size + STREAM_PARSER_FRAME_OVERHEAD bytes. The payload may already sit
+// at buffer + 7, in which case it isn't copied. Returns the frame length, or -1 if the payload is
+// longer than STREAM_PARSER_MAX_PAYLOAD_SIZE, the buffer is too small or an argument is NULL.
+extern int64_t stream_parser_encode(const uint8_t type[3], const uint8_t *payload, int64_t payload_size, uint8_t *buffer, int64_t buffer_size);
+
+// Framing bytes for stream_parser_encode_iov(), the caller keeps them alive until the write is done.
+typedef struct {
+    uint8_t header[7];   // "/*", length, type
+    uint8_t trailer[6];  // Checksum, "*/"
+} StreamParserFrameParts;
+
+// Encodes a frame as 3 iovecs (header, payload, trailer) for writev()/sendmsg(), without copying
+// the payload: iov[1] points at the caller's payload. Returns 3, or -1 on the same errors as
+// stream_parser_encode().
+extern int stream_parser_encode_iov(const uint8_t type[3], const uint8_t *payload, int64_t payload_size, StreamParserFrameParts *parts, struct iovec iov[3]);
+
+// One packet for stream_parser_encode_batch()
+typedef struct {
+    uint8_t type[3];
+    const uint8_t *payload;
+    int64_t payload_size;
+} StreamParserEncodeItem;
+
+// Encodes packets back to back into one buffer, as many as fit, in order.
+// The number of packets encoded is written to encoded (may be NULL).
+// Returns the number of bytes written, or -1 if an item is invalid (nothing is encoded then).
+extern int64_t stream_parser_encode_batch(const StreamParserEncodeItem *items, size_t count, uint8_t *buffer, int64_t buffer_size, size_t *encoded);
+
+
+// Choose how the checksum is computed. Both modes accept and reject exactly the same packets.
+// Drops any partially collected packet.
+extern void stream_parser_set_crc_mode(StreamParser *parser, StreamParserCrcMode mode);
+
+
+// Copies the parser's counters into stats. The counters are cheap enough to always be on.
+// Safe to call from a monitoring thread while another thread is pushing bytes, as long as
+// only one thread at a time calls this function on a given parser.
+// Counts are since the last call with reset nonzero (or since the parser was opened).
+extern StreamParserError stream_parser_get_stats(StreamParser *parser, StreamParserStats *stats, int reset);
+
+
+// Register structured error callback function.
+// If called twice- replaces previous callback.
+// If called with (parser, NULL, NULL), removes callback.
+// Can be registered alongside the string error callback, in which case this one is called first.
+extern void stream_parser_register_error_event_callback(StreamParser *parser, StreamParserErrorEventCallback callback, void *error_event_callback_data);
+
+// Formats an error event into the same message the string error callback gets.
+// parser may be NULL. If it's given and this is called from within the error callback,
+// the bytes of the rejected packet are included as well.
+// Returns the length of the string written to buffer (truncated to fit buffer_size).
+extern int64_t stream_parser_format_error(const StreamParser *parser, const StreamParserErrorEvent *event, char *buffer, size_t buffer_size);
+
+// When enabled (the default), the bytes of a packet that fails the length, type, checksum or trailer
+// check are scanned again for a header, starting right after the rejected header. A real packet
+// that a corrupted one swallowed is then still found, instead of being lost along with it.
+// Rescanned bytes that aren't a header count as skipped again.
+// When disabled, the parser looks for the next header after the last byte of the rejected packet.
+extern void stream_parser_set_rescan_rejected(StreamParser *parser, int enabled);
+
+// When enabled, runs of bytes that aren't a header are reported as a single HEADER_NOT_FOUND_YET
+// event with skipped_bytes set, instead of one error per byte. The run is reported once a header
+// shows up, and at the end of every stream_parser_push_bytes() call.
+// Return codes of the push functions are not affected.
+extern void stream_parser_set_coalesce_header_errors(StreamParser *parser, int enabled);
+
 
 // Register error callback function for detailed error reporting.
 // If called twice- replaces previous callback.
@@ -56,9 +288,103 @@ extern void stream_parser_register_error_callback(StreamParser *parser, StreamPa
 // with a valid header, trailer, length, and checksum.
 
 // The packet buffer that you'll be called with is not persistent (same buffer reused for next time),
-// and you don't own it.
+// and you don't own it. When stream_parser_push_bytes() finds a whole packet inside the buffer it
+// was given, the packet is validated in place and packet_buffer points straight into that buffer
+// instead of being copied. Only packets split across push calls (or found again inside a rejected
+// packet that was) go through the parser's own staging buffer. Either way, packet_buffer is valid until the push call returns and no longer.
 extern void stream_parser_register_packet_callback(StreamParser *parser, StreamParserPacketCallback callback, void *packet_callback_data);
 
+
+// Register a packet callback that also gets when the packet's first and last bytes arrived, as
+// last given to stream_parser_set_arrival_time() before the push that brought them. Packets found
+// again inside the bytes of a rejected packet get that packet's first byte time.
+// If called twice- replaces previous callback.
+// If called with (parser, NULL, NULL), removes callback.
+// Works alongside the plain packet callback, which is called first. packet_buffer and times are
+// only valid during the call.
+extern void stream_parser_register_timed_packet_callback(StreamParser *parser, StreamParserTimedPacketCallback callback, void *timed_packet_callback_data);
+
+// When enabled, the parser keeps two latency histograms of the packets it delivers: from the
+// arrival of a packet's last byte until its callbacks are called, and from the arrival of its first
+// byte until that of its last. The first costs a clock_gettime() per packet, neither is kept by default.
+// Enable before pushing bytes. The histograms are allocated here- also for parsers made with
+// stream_parser_init()- and freed by disabling them or by stream_parser_close(), which such
+// parsers then need too.
+// Returns STREAM_PARSER_INVALID_ARG for a NULL parser, STREAM_PARSER_INTERNAL_ERROR if memory ran out.
+extern StreamParserError stream_parser_set_latency_histograms(StreamParser *parser, int enabled);
+
+// Copies the latency histograms out, either of which may be NULL. Same rules as
+// stream_parser_get_stats(): safe from a monitoring thread, counts since the last reset.
+// Returns STREAM_PARSER_INVALID_ARG if the parser is NULL or doesn't keep histograms.
+extern StreamParserError stream_parser_get_latency_histograms(StreamParser *parser, LatencyHistogram *arrival_to_callback, LatencyHistogram *first_to_last, int reset);
+
+// Where a parser's time went, in time stamp counter cycles (rdtsc on x86, the virtual counter on
+// ARM64), counted only in builds with -DSTREAM_PARSER_CYCLE_COUNTS (make profile). A push charges
+// its time to the state the parser was in, and time in any callback to callback_cycles. Frames
+// validated in place count as STATE_CHECKSUM, header hunting as STATE_FIND_HEADER.
+typedef struct {
+    uint64_t state_cycles[STREAM_PARSER_STATE_COUNT];
+    uint64_t callback_cycles;
+} StreamParserCycleCounts;
+
+// Same rules as stream_parser_get_stats(): safe from a monitoring thread, counts since the last reset.
+// Returns STREAM_PARSER_INVALID_ARG if the parser is NULL or cycles aren't counted in this build.
+extern StreamParserError stream_parser_get_cycle_counts(StreamParser *parser, StreamParserCycleCounts *counts, int reset);
+
+// Register a packet callback for one packet type (the 3 bytes after the length field).
+// Each collected packet of that type is passed to it after the plain packet callback, so
+// consumers don't have to decode and switch on the type themselves.
+// If called twice for a type- replaces previous handler.
+// If called with a NULL callback, removes the type's handler.
+// Returns STREAM_PARSER_INVALID_ARG if the parser or type is NULL, or if
+// STREAM_PARSER_MAX_TYPE_HANDLERS types already have handlers.
+extern StreamParserError stream_parser_register_type_handler(StreamParser *parser, const uint8_t type[3], StreamParserPacketCallback callback, void *type_handler_data);
+
+// Register the handler for packets of types without a handler of their own.
+// If called with (parser, NULL, NULL), removes it.
+extern void stream_parser_register_default_type_handler(StreamParser *parser, StreamParserPacketCallback callback, void *default_type_handler_data);
+
+// When enabled, packets whose type has no handler are rejected as soon as their type bytes arrive,
+// before any body bytes are collected or checksummed, with STREAM_PARSER_INVALID_PACKET
+// (reason STREAM_PARSER_REASON_UNKNOWN_TYPE). Cheap protection against floods of traffic nobody
+// listens to. The bytes of the rejected packet are rescanned as for any other rejected packet.
+// With no type handlers registered, this rejects every packet.
+extern void stream_parser_set_reject_unknown_types(StreamParser *parser, int enabled);
+
+// Packets per batch when stream_parser_register_packet_batch_callback() isn't given a count limit
+#define STREAM_PARSER_DEFAULT_BATCH_PACKETS 64
+
+// Register a callback that gets the collected packets in batches instead of one call per packet,
+// so that locking a queue or writing a log is paid once per batch.
+// If called twice- replaces previous callback.
+// If called with (parser, NULL, NULL, 0, 0), removes callback.
+// Works alongside the other packet callbacks, which still get every packet as it's collected.
+// A batch is delivered at the end of every push call that collected packets, or earlier once it
+// holds max_packets packets (0 means STREAM_PARSER_DEFAULT_BATCH_PACKETS) or max_bytes bytes
+// (0 means no byte limit). Packets and views are only valid during the call. Packets found whole in
+// a stream_parser_push_bytes() buffer point into that buffer, others are copied into a buffer the
+// parser allocates here- also for parsers made with stream_parser_init(), which then need
+// stream_parser_close() to free it.
+// Error callbacks aren't batched, so they can come before packets that preceded them in the stream.
+// Returns STREAM_PARSER_INVALID_ARG for a NULL parser or negative limits,
+// STREAM_PARSER_INTERNAL_ERROR if memory ran out.
+extern StreamParserError stream_parser_register_packet_batch_callback(StreamParser *parser, StreamParserPacketBatchCallback callback, void *packet_batch_callback_data, size_t max_packets, int64_t max_bytes);
+
+// Register a callback that gets each collected packet as a handle into a PacketPool instead of a
+// transient buffer, for consumers that work on packets from other threads.
+// If called twice- replaces previous callback.
+// If called with (parser, NULL, NULL, NULL), removes callback.
+// Works alongside the plain packet callback, which is called first.
+
+// Each packet is copied into a pool slot once. The handle is only guaranteed to live for the
+// duration of the call: take a reference with packet_pool_retain() to keep the packet, and release
+// it when done. Packets the pool has no room for are dropped according to its exhaustion policy,
+// and counted in packet_pool_get_stats() rather than in the parser's stats.
+// Returns STREAM_PARSER_INVALID_ARG if the pool's slots are smaller than the largest packet the
+// parser accepts (STREAM_PARSER_MAX_PAYLOAD_SIZE is measured without the 13 bytes of framing).
+// The pool may be shared between parsers, and must outlive the registration.
+extern StreamParserError stream_parser_register_pooled_packet_callback(StreamParser *parser, PacketPool *pool, StreamParserPooledPacketCallback callback, void *pooled_packet_callback_data);
+
 #ifdef __cplusplus
 }
 #endif